@@ -22,7 +22,7 @@
 #define BTNUSER_PULLREG			CNPUC	// Call also pull down with CNPDx
 #define BTNUSER_PULLBIT			(1<<5)
 
-// UART
+// UART - console port (Port_Console), UART2
 #define UART_TX_TRISbits		TRISCbits
 #define UART_TX_TRISPIN			TRISC8
 #define UART_TX_LATbits			LATCbits
@@ -34,7 +34,18 @@
 #define UART_RX_TRISPIN			TRISC9
 #define UART_RX_PULLREG			CNPUC	// UARTs are idle high, so pull-up
 #define UART_RX_PULLBIT			(1<<9)
-#define UART_RX_REMAP_VAL		0b0110
+#define UART_RX_REMAP_REG		U2RXR
+#define UART_RX_REMAP_VAL		0b0110	// RPC9
+
+// RTS/CTS are plain GPIO, handled by UARTDrv. Both active low.
+#define UART_RTS_TRISreg		TRISC
+#define UART_RTS_LATreg			LATC
+#define UART_RTS_PIN			(1<<6)
+
+#define UART_CTS_TRISreg		TRISC
+#define UART_CTS_PORTreg		PORTC
+#define UART_CTS_PIN			(1<<7)
+#define UART_CTS_PULLREG		CNPUC	// Pull-up, unconnected CTS reads as deasserted
 
 #define UART_MODE_bits			U2MODEbits
 #define UART_STA_bits			U2STAbits
@@ -42,13 +53,90 @@
 #define UART_TX_reg				U2TXREG
 #define UART_RX_reg				U2RXREG
 
-#define UART_INT_IPC_bits			IPC9bits
-#define UART_INT_IPC_PRIORITY		U2IP
-#define UART_INT_IPC_SUBPRIORITY	U2IS
-#define UART_INT_IEC_bits			IEC1bits
-#define UART_INT_IEC_RXIE			U2RXIE
-#define UART_INT_IFS_bits			IFS1bits
-#define UART_INT_IFS_RXIF				U2RXIF
+#define UART_INT_IPC_reg		IPC9
+#define UART_INT_IPC_POS		_IPC9_U2IS_POSITION	// UxIS, UxIP is right above it
+#define UART_INT_IEC_reg		IEC1
+#define UART_INT_IFS_reg		IFS1
+#define UART_INT_RX_MASK		_IEC1_U2RXIE_MASK	// Same bit in IECx and IFSx
+#define UART_INT_TX_MASK		_IEC1_U2TXIE_MASK
+
+#define UART_RX_IRQ				_UART2_RX_IRQ	// Used as DMA start trigger
+
+// UART - auxiliary port (Port_Aux), UART1. No RTS/CTS.
+// RB4/RA4 are SOSCI/SOSCO, the secondary oscillator is off in configBits.c.
+#define UARTAUX_TX_TRISbits		TRISBbits
+#define UARTAUX_TX_TRISPIN		TRISB4
+#define UARTAUX_TX_LATbits		LATBbits
+#define UARTAUX_TX_LATPIN		LATB4
+#define UARTAUX_TX_RP_REG		RPB4R
+#define UARTAUX_TX_RP_VAL		0b0001	// U1TX
+
+#define UARTAUX_RX_TRISbits		TRISAbits
+#define UARTAUX_RX_TRISPIN		TRISA4
+#define UARTAUX_RX_PULLREG		CNPUA
+#define UARTAUX_RX_PULLBIT		(1<<4)
+#define UARTAUX_RX_REMAP_REG	U1RXR
+#define UARTAUX_RX_REMAP_VAL	0b0010	// RPA4
+
+#define UARTAUX_MODE_bits		U1MODEbits
+#define UARTAUX_STA_bits		U1STAbits
+#define UARTAUX_BRG_reg			U1BRG
+#define UARTAUX_TX_reg			U1TXREG
+#define UARTAUX_RX_reg			U1RXREG
+
+#define UARTAUX_INT_IPC_reg		IPC8
+#define UARTAUX_INT_IPC_POS		_IPC8_U1IS_POSITION
+#define UARTAUX_INT_IEC_reg		IEC1
+#define UARTAUX_INT_IFS_reg		IFS1
+#define UARTAUX_INT_RX_MASK		_IEC1_U1RXIE_MASK
+#define UARTAUX_INT_TX_MASK		_IEC1_U1TXIE_MASK
+
+// ICSP - target MCLR, PGEC and PGED. Plain GPIO, bit-banged by ICSPDrv.
+#define ICSP_MCLR_TRISreg		TRISC
+#define ICSP_MCLR_LATreg		LATC
+#define ICSP_MCLR_PIN			(1<<0)
+
+#define ICSP_PGEC_TRISreg		TRISC
+#define ICSP_PGEC_LATreg		LATC
+#define ICSP_PGEC_PIN			(1<<1)
+
+#define ICSP_PGED_TRISreg		TRISC
+#define ICSP_PGED_LATreg		LATC
+#define ICSP_PGED_PORTreg		PORTC
+#define ICSP_PGED_PIN			(1<<2)
+
+#define ICSP_ANSELreg			ANSELC	// RC0-RC2 are analog (AN6-AN8) after reset
+#define ICSP_ANSEL_MASK			((1<<0) | (1<<1) | (1<<2))
+
+// JTAG - 4-wire target TAP. Whole bytes are shifted by SPI2 (TCK = SCK2, TDI = SDO2,
+// TDO = SDI2), everything else by plain GPIO on the same pins. TMS is always GPIO.
+#define JTAG_TCK_TRISreg		TRISB
+#define JTAG_TCK_LATreg			LATB
+#define JTAG_TCK_PIN			(1<<15)	// SCK2, not remappable
+
+#define JTAG_TDI_TRISreg		TRISB
+#define JTAG_TDI_LATreg			LATB
+#define JTAG_TDI_PIN			(1<<13)
+#define JTAG_TDI_RP_REG			RPB13R
+#define JTAG_TDI_RP_VAL			0b0100	// SDO2
+
+#define JTAG_TDO_TRISreg		TRISB
+#define JTAG_TDO_PORTreg		PORTB
+#define JTAG_TDO_PIN			(1<<2)
+#define JTAG_TDO_REMAP_REG		SDI2R
+#define JTAG_TDO_REMAP_VAL		0b0100	// RPB2
+
+#define JTAG_TMS_TRISreg		TRISB
+#define JTAG_TMS_LATreg			LATB
+#define JTAG_TMS_PIN			(1<<3)
+
+#define JTAG_ANSELreg			ANSELB	// All four are analog after reset
+#define JTAG_ANSEL_MASK			((1<<2) | (1<<3) | (1<<13) | (1<<15))
+
+#define JTAG_SPI_CON_bits		SPI2CONbits
+#define JTAG_SPI_STAT_bits		SPI2STATbits
+#define JTAG_SPI_BRG_reg		SPI2BRG
+#define JTAG_SPI_BUF_reg		SPI2BUF
 
 
 ////////
@@ -70,7 +158,7 @@
 #define BTNUSER_PORTPIN			RD0
 // No pull-up/down available on this pin
 
-// UART
+// UART - console port (Port_Console), UART1
 #define UART_TX_TRISbits		TRISDbits
 #define UART_TX_TRISPIN			TRISD3
 #define UART_TX_LATbits			LATDbits
@@ -80,19 +168,92 @@
 #define UART_RX_TRISbits		TRISDbits
 #define UART_RX_TRISPIN			TRISD2
 
+// RTS/CTS are plain GPIO, handled by UARTDrv. Both active low.
+#define UART_RTS_TRISreg		TRISD
+#define UART_RTS_LATreg			LATD
+#define UART_RTS_PIN			(1<<4)
+
+#define UART_CTS_TRISreg		TRISD
+#define UART_CTS_PORTreg		PORTD
+#define UART_CTS_PIN			(1<<5)
+// No pull-up set, add an external one
+
 #define UART_MODE_bits			U1MODEbits
 #define UART_STA_bits			U1STAbits
 #define UART_BRG_reg			U1BRG
 #define UART_TX_reg				U1TXREG
 #define UART_RX_reg				U1RXREG
 
-#define UART_INT_IPC_bits			IPC6bits
-#define UART_INT_IPC_PRIORITY		U1IP
-#define UART_INT_IPC_SUBPRIORITY	U1IS
-#define UART_INT_IEC_bits			IEC0bits
-#define UART_INT_IEC_RXIE			U1RXIE
-#define UART_INT_IFS_bits			IFS0bits
-#define UART_INT_IFS_RXIF			U1RXIF
+#define UART_INT_IPC_reg		IPC6
+#define UART_INT_IPC_POS		_IPC6_U1IS_POSITION	// UxIS, UxIP is right above it
+#define UART_INT_IEC_reg		IEC0
+#define UART_INT_IFS_reg		IFS0
+#define UART_INT_RX_MASK		_IEC0_U1RXIE_MASK	// Same bit in IECx and IFSx
+#define UART_INT_TX_MASK		_IEC0_U1TXIE_MASK
+
+#define UART_RX_IRQ				_UART1_RX_IRQ	// Used as DMA start trigger
+
+// UART - auxiliary port (Port_Aux), UART2. No RTS/CTS.
+#define UARTAUX_TX_TRISbits		TRISFbits
+#define UARTAUX_TX_TRISPIN		TRISF5
+#define UARTAUX_TX_LATbits		LATFbits
+#define UARTAUX_TX_LATPIN		LATF5
+// No remapping available
+
+#define UARTAUX_RX_TRISbits		TRISFbits
+#define UARTAUX_RX_TRISPIN		TRISF4
+
+#define UARTAUX_MODE_bits		U2MODEbits
+#define UARTAUX_STA_bits		U2STAbits
+#define UARTAUX_BRG_reg			U2BRG
+#define UARTAUX_TX_reg			U2TXREG
+#define UARTAUX_RX_reg			U2RXREG
+
+#define UARTAUX_INT_IPC_reg		IPC8
+#define UARTAUX_INT_IPC_POS		_IPC8_U2IS_POSITION
+#define UARTAUX_INT_IEC_reg		IEC1
+#define UARTAUX_INT_IFS_reg		IFS1
+#define UARTAUX_INT_RX_MASK		_IEC1_U2RXIE_MASK
+#define UARTAUX_INT_TX_MASK		_IEC1_U2TXIE_MASK
+
+// ICSP - target MCLR, PGEC and PGED. Plain GPIO, bit-banged by ICSPDrv.
+#define ICSP_MCLR_TRISreg		TRISE
+#define ICSP_MCLR_LATreg		LATE
+#define ICSP_MCLR_PIN			(1<<0)
+
+#define ICSP_PGEC_TRISreg		TRISE
+#define ICSP_PGEC_LATreg		LATE
+#define ICSP_PGEC_PIN			(1<<1)
+
+#define ICSP_PGED_TRISreg		TRISE
+#define ICSP_PGED_LATreg		LATE
+#define ICSP_PGED_PORTreg		PORTE
+#define ICSP_PGED_PIN			(1<<2)
+// PORTE is digital only, no ANSEL
+
+// JTAG - 4-wire target TAP. Whole bytes are shifted by SPI2 (TCK = SCK2, TDI = SDO2,
+// TDO = SDI2), everything else by plain GPIO on the same pins. TMS is always GPIO.
+#define JTAG_TCK_TRISreg		TRISG
+#define JTAG_TCK_LATreg			LATG
+#define JTAG_TCK_PIN			(1<<6)	// SCK2
+// No remapping available
+
+#define JTAG_TDI_TRISreg		TRISG
+#define JTAG_TDI_LATreg			LATG
+#define JTAG_TDI_PIN			(1<<8)	// SDO2
+
+#define JTAG_TDO_TRISreg		TRISG
+#define JTAG_TDO_PORTreg		PORTG
+#define JTAG_TDO_PIN			(1<<7)	// SDI2
+
+#define JTAG_TMS_TRISreg		TRISG
+#define JTAG_TMS_LATreg			LATG
+#define JTAG_TMS_PIN			(1<<9)	// SS2 pin, as GPIO
+
+#define JTAG_SPI_CON_bits		SPI2CONbits
+#define JTAG_SPI_STAT_bits		SPI2STATbits
+#define JTAG_SPI_BRG_reg		SPI2BRG
+#define JTAG_SPI_BUF_reg		SPI2BUF
 
 
 
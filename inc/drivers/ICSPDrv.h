@@ -0,0 +1,123 @@
+#ifndef ICSPDRV_H_0c5e9a3d71f84b6e9d2a4f1b86c03e57
+#define ICSPDRV_H_0c5e9a3d71f84b6e9d2a4f1b86c03e57
+
+#include <inttypes.h>
+
+// ICSP of a PIC32 target (PIC32 Flash Programming Specification), over 2-wire
+// 4-phase ICSP or 4-wire JTAG. The pins are in GPIODrv.h.
+
+typedef enum ICSPDrvTransportEnum {
+	Transport_2Wire	= 0,	// MCLR, PGEC, PGED. Bit-banged.
+	Transport_JTAG	= 1,	// TCK, TMS, TDI, TDO. Data shifts go through the SPI.
+} ICSPDrvTransport;
+
+typedef enum ICSPDrvStatusEnum {
+	ICSP_Ok				= 0,
+	ICSP_NotEntered		= 1,	// ICSPDrv_Enter() not called
+	ICSP_CodeProtected	= 2,	// Serial execution refused, erase the device first
+	ICSP_Timeout		= 3,	// Target didn't answer in time
+	ICSP_PeError		= 4,	// The PE didn't load, or answered with an error
+} ICSPDrvStatus;
+
+// TAP instructions (5 bits), for ICSPDrv_SendCommand()
+#define MTAP_IDCODE			0x01
+#define MTAP_SW_MTAP		0x04
+#define MTAP_SW_ETAP		0x05
+#define MTAP_COMMAND		0x07
+#define ETAP_ADDRESS		0x08
+#define ETAP_DATA			0x09
+#define ETAP_CONTROL		0x0A
+#define ETAP_EJTAGBOOT		0x0C
+#define ETAP_FASTDATA		0x0E
+
+// MTAP_COMMAND data values, for ICSPDrv_XferCommand()
+#define MCHP_STATUS			0x00
+#define MCHP_ASSERT_RST		0xD1
+#define MCHP_DE_ASSERT_RST	0xD0
+#define MCHP_ERASE			0xFC
+#define MCHP_FLASH_ENABLE	0xFE
+#define MCHP_FLASH_DISABLE	0xFD
+
+// MCHP_STATUS bits
+#define MCHP_STATUS_CPS		0x80	// 1 = not code protected
+#define MCHP_STATUS_NVMERR	0x20	// Flash controller error
+#define MCHP_STATUS_CFGRDY	0x08	// Configuration read after reset
+#define MCHP_STATUS_FCBUSY	0x04	// Flash controller busy (erasing)
+#define MCHP_STATUS_DEVRST	0x01	// Device reset asserted
+
+// Programming Executive commands, in the top half of the first word sent to the PE.
+// Its response echoes the command, with a status (0 = pass) in the bottom half.
+#define PE_ROW_PROGRAM		0x0
+#define PE_READ				0x1
+#define PE_PROGRAM			0x2
+#define PE_WORD_PROGRAM		0x3
+#define PE_CHIP_ERASE		0x4
+#define PE_PAGE_ERASE		0x5
+#define PE_BLANK_CHECK		0x6
+#define PE_EXEC_VERSION		0x7
+#define PE_GET_CRC			0x8
+
+// PE_GET_CRC is CRC-16/CCITT (polynomial 0x1021, MSB first) from this seed. ICSPDrv_PeCrc() does the same.
+#define PE_CRC_SEED			0xFFFF
+
+#define PE_LOADER_ADDRESS	0xA0000800	// Target RAM, kseg1
+#define PE_ADDRESS			0xA0000900
+
+void ICSPDrv_Init(void);
+void ICSPDrv_Enter(ICSPDrvTransport transport);
+void ICSPDrv_Exit(void);
+uint8_t ICSPDrv_IsEntered(void);
+ICSPDrvTransport ICSPDrv_GetTransport(void);
+uint32_t ICSPDrv_ReadIdCode(void);
+uint8_t ICSPDrv_ReadStatus(void);
+ICSPDrvStatus ICSPDrv_Erase(void);
+ICSPDrvStatus ICSPDrv_EraseStart(void);
+uint8_t ICSPDrv_EraseDone(void);
+ICSPDrvStatus ICSPDrv_EnterSerialExecution(uint8_t flashEnable);
+ICSPDrvStatus ICSPDrv_XferInstruction(uint32_t instruction);
+ICSPDrvStatus ICSPDrv_ReadWord(uint32_t address, uint32_t *word);
+
+// TAP level access, once entered
+void ICSPDrv_SendCommand(uint8_t command);
+uint8_t ICSPDrv_XferCommand(uint8_t command);
+uint32_t ICSPDrv_XferData(uint32_t data);
+uint32_t ICSPDrv_XferFastData(uint32_t data, uint8_t *prAcc);
+
+// Programming Executive, in serial execution mode
+ICSPDrvStatus ICSPDrv_PeLoadStart(uint32_t words);
+ICSPDrvStatus ICSPDrv_PeSend(const uint32_t *words, uint32_t count);
+ICSPDrvStatus ICSPDrv_PeLoadFinish(uint16_t *version);
+uint8_t ICSPDrv_PeIsLoaded(void);
+uint8_t ICSPDrv_PeResponseReady(void);
+uint32_t ICSPDrv_PeReadResponse(void);
+ICSPDrvStatus ICSPDrv_PeGetResponse(uint32_t *response);
+ICSPDrvStatus ICSPDrv_PeGetCrc(uint32_t address, uint32_t length, uint16_t *crc);
+uint16_t ICSPDrv_PeCrc(uint16_t crc, const void *data, uint32_t length);
+
+uint32_t ICSPDrv_GetTckFrequency(void);
+
+// Loops of the bit-bang delay, per PGEC/TCK half period. Bit-banged clocks run at well under 1MHz either way.
+#ifndef ICSP_CLOCK_LOOPS
+#define ICSP_CLOCK_LOOPS		2
+#endif
+
+// Most TCK for the SPI shifted bytes over JTAG. The SPI divider rounds it down
+// (12MHz on a 48MHz MX270 PBCLK, 10MHz on a 80MHz MX440 PBCLK).
+#ifndef JTAG_TCK_HZ
+#define JTAG_TCK_HZ				12000000
+#endif
+
+// Longest a chip erase may take, before ICSPDrv_Erase() or COMMS_ICSP_ERASE gives up
+#define ICSP_ERASE_TIMEOUT_MS	1000
+
+// Longest wait for the target CPU to fetch an instruction, in ICSPDrv_XferInstruction(),
+// or for the PE to take a word
+#define ICSP_PRACC_TIMEOUT_MS	10
+
+// Longest wait for a PE response. A row takes a few ms, a chip erase much longer.
+#define ICSP_PE_TIMEOUT_MS		1000
+
+// Longest wait for a PE_GET_CRC. The PE runs on the target's FRC, a whole flash takes a while.
+#define ICSP_PE_CRC_TIMEOUT_MS	5000
+
+#endif
@@ -3,15 +3,94 @@
 
 #include <inttypes.h>
 
-void UARTDrv_Init(uint32_t baud);
-void UARTDrv_SendBlocking(uint8_t * buffer, uint32_t length);
-uint32_t UARTDrv_GetCount();
-uint32_t UARTDrv_GetReceiveData(uint8_t *copyTo, uint8_t maxSize);
+// UART instances. The pins and registers for each are in GPIODrv.h.
+typedef enum UARTDrvPortEnum {
+	Port_Console	= 0,	// Target console, first CDC ACM port
+	Port_Aux		= 1,	// Auxiliary channel, second CDC ACM port
+} UARTDrvPort;
 
+#define UART_NUM_PORTS		2
+
+typedef enum UARTDrvRxModeEnum {
+	RxMode_Interrupt	= 0,	// One interrupt per received byte
+	RxMode_DMA			= 1,	// DMA channel streams received bytes into the ring, no CPU per byte. Port_Console only.
+	RxMode_Direct		= 2,	// Received bytes go straight into a buffer given with UARTDrv_RxAttach()
+} UARTDrvRxMode;
+
+typedef enum UARTDrvParityEnum {
+	Parity_None	= 0,
+	Parity_Odd	= 1,
+	Parity_Even	= 2,
+} UARTDrvParity;
+
+// Receive error events, as a bit mask. See UARTDrv_TakeErrorEvents().
+typedef enum UARTDrvErrorEnum {
+	Error_Overrun	= 0x01,	// HW FIFO overflowed (OERR)
+	Error_Framing	= 0x02,	// Missing stop bit (FERR)
+	Error_Parity	= 0x04,	// PERR
+	Error_Dropped	= 0x08,	// Receive ring was full, byte thrown away
+} UARTDrvError;
+
+// Receive error counters, per port
+typedef struct UARTDrvErrorsStruct {
+	uint32_t dropped;	// Bytes thrown away, because the ring was full
+	uint32_t overrun;	// HW FIFO overruns. The bytes lost in one aren't known.
+	uint32_t framing;	// Bytes received with a framing error (still delivered)
+	uint32_t parity;	// Bytes received with a parity error (still delivered)
+} UARTDrvErrors;
+
+// Receive interrupt cost. Cycles per byte is cycles / bytes.
+typedef struct UARTDrvIsrStatsStruct {
+	uint32_t calls;		// RX interrupts served
+	uint32_t bytes;		// Bytes read from the HW FIFO in them
+	uint32_t cycles;	// CPU cycles spent in the RX part of the ISR (from CP0 Count)
+} UARTDrvIsrStats;
+
+void UARTDrv_Init(UARTDrvPort port, uint32_t baud, UARTDrvRxMode rxMode);
+uint32_t UARTDrv_Configure(UARTDrvPort port, uint32_t baud, uint8_t dataBits, UARTDrvParity parity, uint8_t stopBits);
+uint32_t UARTDrv_CheckConfig(uint32_t baud, uint8_t dataBits, UARTDrvParity parity, uint8_t stopBits);
+void UARTDrv_SendBlocking(UARTDrvPort port, uint8_t * buffer, uint32_t length);
+uint32_t UARTDrv_SendAsync(UARTDrvPort port, const uint8_t *buffer, uint32_t length);
+uint32_t UARTDrv_TxFree(UARTDrvPort port);
+void UARTDrv_RxAttach(UARTDrvPort port, uint8_t *buffer, uint32_t size);
+uint32_t UARTDrv_RxDetach(UARTDrvPort port);
+uint32_t UARTDrv_GetCount(UARTDrvPort port);
+uint32_t UARTDrv_GetReceiveData(UARTDrvPort port, uint8_t *copyTo, uint32_t maxSize);
+void UARTDrv_SetFlowControl(UARTDrvPort port, uint8_t enable);
+void UARTDrv_SetRts(UARTDrvPort port, uint8_t asserted);
+void UARTDrv_Poll();
+void UARTDrv_GetErrors(UARTDrvPort port, UARTDrvErrors *copyTo);
+void UARTDrv_ClearErrors(UARTDrvPort port);
+uint8_t UARTDrv_TakeErrorEvents(UARTDrvPort port);
+void UARTDrv_GetIsrStats(UARTDrvPort port, UARTDrvIsrStats *copyTo);
+void UARTDrv_ClearIsrStats(UARTDrvPort port);
+
+// Size of the receive ring, one per port. Must be a power of 2.
+// In DMA mode the whole ring is one DMA block, so it is limited by DCHxDSIZ.
+// Only RxMode_Interrupt and RxMode_DMA use it. When only RxMode_Direct is
+// used, build with -D UART_RX_BUFFER_SIZE=0 to drop the ring from RAM. Both
+// modes are compiled out then, and UARTDrv_Init() falls back to RxMode_Direct
+// for them: nothing is received until a buffer is given with UARTDrv_RxAttach().
+#ifndef UART_RX_BUFFER_SIZE
 #if defined(__32MX270F256D__)
-	
+	#define UART_RX_BUFFER_SIZE		1024	// 16-bit DSIZ on MX1/MX2
 #elif defined(__32MX440F256H__)
-
+	#define UART_RX_BUFFER_SIZE		256		// 8-bit DSIZ on MX3/MX4, 256 is the max
+#endif
 #endif
 
+// Size of the transmit ring, one per port. Must be a power of 2.
+// At least a few USB packets, so the host can keep streaming while the UART drains.
+#define UART_TX_BUFFER_SIZE			256
+
+// With flow control on, RTS is deasserted when only this many bytes of
+// receive space are left. Covers the sender's reaction time.
+#define UART_RTS_MARGIN				8
+
+// While data comes in, the RX interrupt fires at 3/4 full HW FIFO. Fewer bytes
+// are picked up after about this many character times without reaching it
+// (Timer 2). An idle port interrupts on its first byte, and Timer 2 only runs
+// while a port is receiving.
+#define UART_RX_IDLE_CHARS			4
+
 #endif
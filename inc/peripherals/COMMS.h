@@ -1,6 +1,11 @@
-#ifndef COMMS_H_96582fe1b9194228b1c0-475bf8856698
-#define COMMS_H_96582fe1b9194228b1c0-475bf8856698
+#ifndef COMMS_H_96582fe1b9194228b1c0475bf8856698
+#define COMMS_H_96582fe1b9194228b1c0475bf8856698
 
+// Programmer command channel, on the vendor bulk interface. Protocol in vendor.h.
+#define COMMS_EP		5
 
+void COMMS_init();
+void COMMS_reset();
+void COMMS_service();
 
 #endif
@@ -0,0 +1,42 @@
+#ifndef HEX_H_ea7dc32d70c94760a2b3649e2d476f4c
+#define HEX_H_ea7dc32d70c94760a2b3649e2d476f4c
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Intel HEX parser, fed the file in pieces as it comes in over USB. The data records
+// are gathered into flash rows (physical address, gaps 0xFF), handed out one at a time.
+// Records may come in any order, but each row only once: a row is handed out as soon
+// as a record leaves it, so data for it after that is an error.
+
+typedef enum HEXStatusEnum {
+	HEX_Ok			= 0,
+	HEX_ErrSyntax	= 1,	// Not a record, bad digit, length or record type
+	HEX_ErrChecksum	= 2,
+	HEX_ErrAddress	= 3,	// Data outside program and boot flash
+	HEX_ErrRowAgain	= 4,	// Data for a row that was already handed out
+} HEXStatus;
+
+// Flash the data can go to, physical addresses. Sized for the largest PIC32MX.
+#define HEX_FLASH_BASE		0x1D000000
+#define HEX_FLASH_SIZE		0x80000
+#define HEX_BOOT_BASE		0x1FC00000
+#define HEX_BOOT_SIZE		0x3000
+
+// Smallest row size, sets the size of the table of rows handed out
+#define HEX_MIN_ROW			128
+
+// Largest row size, sets the size of the row buffer
+#define HEX_MAX_ROW			512
+
+void HEX_init(uint32_t rowSize);
+size_t HEX_parse(const uint8_t *data, size_t len);
+bool HEX_rowReady();
+uint32_t HEX_getRowAddress();
+const uint32_t *HEX_takeRow(uint32_t *address);
+bool HEX_isDone();
+HEXStatus HEX_getStatus();
+uint32_t HEX_getLine();
+
+#endif
@@ -6,6 +6,17 @@
 // Config bits, defined for different chips.
 // Currently for a PIC32MX270 target, and a PIC32MX440 target
 
+// DEVCFG3 USERID. It is the per-board part of the USB serial number, so give
+// each board its own: build with -D CONFIG_USERID=0x1234, or patch DEVCFG3
+// in the hex file when programming.
+#ifndef CONFIG_USERID
+	#if defined(__32MX270F256D__)
+		#define CONFIG_USERID	0xF0C5
+	#elif defined(__32MX440F256H__)
+		#define CONFIG_USERID	0xBEEF
+	#endif
+#endif
+
 #if defined(__32MX270F256D__) || defined(__32MX440F256H__)
 	extern const uint32_t temp3;
 	extern const uint32_t temp2;
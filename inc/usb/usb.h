@@ -360,8 +360,15 @@ void usb_init(void);
  * happen automatically, as the interrupt handler is embedded in usb.c. On
  * 8-bit PIC since the interrupt handlers are shared, this function will need
  * to be called from the application's interrupt handler.
+ *
+ * Each call handles all the completed transactions waiting in the SIE's
+ * status FIFO, up to @p USB_SERVICE_TOKEN_BUDGET (default 4, the FIFO
+ * depth) of them.
+ *
+ * @returns
+ *   Return the number of transactions handled.
  */
-void usb_service(void);
+uint8_t usb_service(void);
 
 /** @brief Get the device configuration
  *
@@ -397,7 +404,8 @@ uint8_t usb_get_configuration(void);
  *
  * @param endpoint   The endpoint requested
  * @returns
- *   Return a pointer to the endpoint's buffer.
+ *   Return a pointer to the endpoint's buffer, or NULL if the endpoint has
+ *   @p EP_n_IN_DIRECT defined.
  */
 unsigned char *usb_get_in_buffer(uint8_t endpoint);
 
@@ -415,6 +423,40 @@ unsigned char *usb_get_in_buffer(uint8_t endpoint);
  */
 void usb_send_in_buffer(uint8_t endpoint, size_t len);
 
+/** @brief Send IN data from an application buffer
+ *
+ * Queue one IN packet like @p usb_send_in_buffer(), but point the buffer
+ * descriptor straight at @p buffer instead of the endpoint's own buffer,
+ * so no copy is made. This is the only way to send single packets on
+ * endpoints with @p EP_n_IN_DIRECT defined in usb_config.h, which have no
+ * buffer of their own. @p buffer must be in RAM, and must not be changed
+ * until the transaction completes (@p usb_in_endpoint_busy() on the same
+ * buffer descriptor turns false, or @p IN_TRANSACTION_COMPLETE_CALLBACK).
+ * Both ping-pong buffer descriptors can be loaded this way, with
+ * different buffers.
+ *
+ * @param endpoint   The endpoint on which to send data
+ * @param buffer     The data to send, at most the endpoint length
+ * @param len        The amount of data to send
+ */
+void usb_send_in_buffer_at(uint8_t endpoint, const void *buffer, size_t len);
+
+/** @brief Check whether an IN transfer needs a zero-length packet to end
+ *
+ * A bulk transfer ends with a short packet. If the last packet sent with
+ * @p usb_send_in_buffer() was exactly the endpoint length, the host will
+ * keep waiting for more data. When the application has no more data to
+ * send, and this function returns true, it should call
+ * @p usb_send_in_buffer() with a length of zero once the endpoint is not
+ * busy. Sending a short packet (including a zero-length one) clears this
+ * condition.
+ *
+ * @param endpoint   The endpoint requested
+ * @returns
+ *    Return true if a zero-length packet is needed to end the transfer.
+ */
+bool usb_in_endpoint_needs_zlp(uint8_t endpoint);
+
 /** @brief Check whether an IN endpoint is busy
  *
  * An IN endpoint is said to be busy if there is data in its buffer and it
@@ -611,6 +653,176 @@ void usb_send_data_stage(char *buffer, size_t len,
 	usb_ep0_data_stage_callback callback, void *context);
 
 
+/** @brief Endpoint transaction handler definition
+ *
+ * This is the function type passed to @p usb_set_endpoint_handlers(). It
+ * is called from @p usb_service() when a transaction has completed on the
+ * endpoint, in place of @p IN_TRANSACTION_COMPLETE_CALLBACK or @p
+ * OUT_TRANSACTION_CALLBACK.
+ *
+ * @param endpoint      The endpoint number of the transaction
+ */
+typedef void (*usb_transaction_callback)(uint8_t endpoint);
+
+/** @brief Set the transaction handlers of an endpoint
+ *
+ * Give a non-zero endpoint its own IN and OUT transaction handlers, so a
+ * class driver gets its endpoints' completions directly instead of through
+ * the application-wide @p IN_TRANSACTION_COMPLETE_CALLBACK and @p
+ * OUT_TRANSACTION_CALLBACK. Those are still called for endpoints (and
+ * directions) without a handler. The handlers are kept across USB resets
+ * and SET_CONFIGURATION; call this once at init. Transactions of a
+ * transfer started with @p usb_start_in_transfer() or @p
+ * usb_start_out_transfer() don't reach the handlers.
+ *
+ * @param endpoint   The endpoint number, 1 to NUM_ENDPOINT_NUMBERS
+ * @param in         Handler for completed IN transactions, or NULL
+ * @param out        Handler for received OUT transactions, or NULL
+ */
+void usb_set_endpoint_handlers(uint8_t endpoint,
+	usb_transaction_callback in, usb_transaction_callback out);
+
+/** @brief Transfer completion callback definition
+ *
+ * This is the callback function type expected to be passed to @p
+ * usb_start_in_transfer() and @p usb_start_out_transfer(). It is called
+ * from @p usb_service() (so from the USB interrupt when @p
+ * USB_USE_INTERRUPTS is defined) when the last transaction of the transfer
+ * has completed. A new transfer can be started from the callback.
+ *
+ * @param endpoint      The endpoint of the transfer
+ * @param len           The number of bytes transferred. For OUT transfers
+ *                      this is less than requested if the host ended the
+ *                      transfer with a short packet.
+ * @param context       A pointer to application-provided context data
+ */
+typedef void (*usb_transfer_callback)(uint8_t endpoint, size_t len, void *context);
+
+/** @brief Start a multi-packet IN transfer
+ *
+ * Send @p len bytes from @p buffer to the host on a non-zero endpoint,
+ * split into as many transactions as needed. The stack keeps both
+ * ping-pong buffer descriptors loaded, refilling each one as soon as its
+ * transaction completes, so the endpoint doesn't NAK between packets.
+ * Packets are sent straight from @p buffer when it is in RAM; data in
+ * flash is copied through the endpoint's buffers, so it can't be sent on
+ * an endpoint with @p EP_n_IN_DIRECT defined.
+ *
+ * No zero-length packet is added at the end. If the host needs one to see
+ * the end of a transfer whose length is a multiple of the endpoint size,
+ * start a transfer with a @p len of zero from the @p callback.
+ *
+ * While the transfer is active, don't call @p usb_send_in_buffer() on the
+ * endpoint; @p IN_TRANSACTION_COMPLETE_CALLBACK is not called for its
+ * transactions. A USB reset, SET_CONFIGURATION or halting the endpoint
+ * abandons the transfer without calling @p callback.
+ *
+ * @param endpoint   The endpoint on which to send data
+ * @param buffer     The data to send. It is owned by the USB stack until
+ *                   @p callback is called; do not use a stack variable.
+ * @param len        The number of bytes to send
+ * @param callback   Function to call when the transfer completes. This
+ *                   parameter is mandatory.
+ * @param context    A pointer to be passed to the callback. The USB stack
+ *                   does not dereference this pointer.
+ * @returns
+ *   Return 0 if the transfer was started, or -1 if the device is not
+ *   configured, the endpoint is invalid or halted, a transfer or packet
+ *   is already pending on it, or @p buffer can't be sent from it.
+ */
+int8_t usb_start_in_transfer(uint8_t endpoint, const void *buffer, size_t len,
+	usb_transfer_callback callback, void *context);
+
+/** @brief Start a multi-packet OUT transfer
+ *
+ * Receive up to @p len bytes from the host on a non-zero endpoint into @p
+ * buffer. The transfer completes when @p len bytes have been received, or
+ * when the host sends a short packet. Each received packet is moved to @p
+ * buffer and its buffer descriptor given back to the SIE in the same
+ * @p usb_service() call, so both ping-pong buffers stay armed. Packets
+ * which were already received when the transfer is started are taken as
+ * its first data.
+ *
+ * While the transfer is active, don't call @p usb_get_out_buffer() or
+ * @p usb_arm_out_endpoint() on the endpoint; @p OUT_TRANSACTION_CALLBACK
+ * is not called for its transactions. A USB reset, SET_CONFIGURATION or
+ * halting the endpoint abandons the transfer without calling @p callback.
+ *
+ * @param endpoint   The endpoint on which to receive data
+ * @param buffer     A buffer in which to place the data. It is owned by the
+ *                   USB stack until @p callback is called.
+ * @param len        The maximum number of bytes to receive
+ * @param callback   Function to call when the transfer completes. This
+ *                   parameter is mandatory.
+ * @param context    A pointer to be passed to the callback. The USB stack
+ *                   does not dereference this pointer.
+ * @returns
+ *   Return 0 if the transfer was started, or -1 if the device is not
+ *   configured, the endpoint is invalid or halted, or a transfer is
+ *   already active on it.
+ */
+int8_t usb_start_out_transfer(uint8_t endpoint, void *buffer, size_t len,
+	usb_transfer_callback callback, void *context);
+
+/** @brief Check whether an IN transfer is active on an endpoint
+ *
+ * @param endpoint   The endpoint requested
+ * @returns
+ *   Return true from @p usb_start_in_transfer() until just before its
+ *   callback is called.
+ */
+bool usb_in_transfer_active(uint8_t endpoint);
+
+/** @brief Check whether an OUT transfer is active on an endpoint
+ *
+ * @param endpoint   The endpoint requested
+ * @returns
+ *   Return true from @p usb_start_out_transfer() until just before its
+ *   callback is called.
+ */
+bool usb_out_transfer_active(uint8_t endpoint);
+
+#ifdef USB_STATS
+/** @brief Transaction counters of one endpoint number
+ *
+ * See @p struct usb_stats.
+ */
+struct usb_endpoint_stats {
+	uint32_t in_transactions;  /**< Completed IN transactions */
+	uint32_t in_bytes;         /**< Bytes sent in them */
+	uint32_t out_transactions; /**< Completed OUT (and SETUP) transactions */
+	uint32_t out_bytes;        /**< Bytes received in them */
+	uint32_t in_busy;          /**< Calls to @p usb_in_endpoint_busy()
+	                                which returned true */
+};
+
+/** @brief USB core statistics
+ *
+ * Counted by @p usb_service() when @p USB_STATS is defined in
+ * usb_config.h. A high @p in_busy count against few transactions means the
+ * host isn't polling the endpoint (a stalled or absent reader); high
+ * transaction counts with full packets mean the link is saturated.
+ */
+struct usb_stats {
+	uint32_t resets;            /**< USB resets from the host */
+	uint32_t stalls;            /**< STALL handshakes sent */
+	uint32_t sofs;              /**< Start-of-frame tokens */
+	uint32_t max_service_ticks; /**< Longest @p usb_service() call, in CP0
+	                                 Count ticks (half the CPU clock) */
+	struct usb_endpoint_stats ep[NUM_ENDPOINT_NUMBERS+1];
+};
+
+/** @brief Get the USB core statistics
+ *
+ * @param copy_to   Where to copy the counters to
+ */
+void usb_get_stats(struct usb_stats *copy_to);
+
+/** @brief Reset the USB core statistics to zero
+ */
+void usb_clear_stats(void);
+#endif
+
 /* Doxygen end-of-group for public_api */
 /** @}*/
 
@@ -28,10 +28,15 @@
    BOTH IN and OUT endpoints for endpoint numbers (besides zero) up to the
    value specified.  For example, setting NUM_ENDPOINT_NUMBERS to 2 will
    activate endpoints EP 1 IN, EP 1 OUT, EP 2 IN, EP 2 OUT.  */
-#define NUM_ENDPOINT_NUMBERS 2
+#define NUM_ENDPOINT_NUMBERS 5
 
-/* Only 8, 16, 32 and 64 are supported for endpoint zero length. */
-#define EP_0_LEN 8
+/* Only 8, 16, 32 and 64 are supported for endpoint zero length.
+   64 sends each descriptor in one or a few transactions, at the cost of
+   4 x 64 bytes of RAM for the EP0 ping-pong buffers. Overridable with -D,
+   the host benchmarks build it with 8 too. */
+#ifndef EP_0_LEN
+#define EP_0_LEN 64
+#endif
 
 #define EP_1_OUT_LEN 1
 #define EP_1_IN_LEN 10 /* May need to be longer, depending
@@ -41,6 +46,24 @@
 #define EP_2_OUT_LEN EP_2_LEN
 #define EP_2_IN_LEN EP_2_LEN
 
+/* Second CDC ACM port: EP3 is its notification endpoint, EP4 its data. */
+#define EP_3_OUT_LEN 1
+#define EP_3_IN_LEN 10
+#define EP_4_LEN 64
+#define EP_4_OUT_LEN EP_4_LEN
+#define EP_4_IN_LEN EP_4_LEN
+
+/* Programmer command channel (vendor interface 4, see COMMS.c): EP5 bulk.
+   Replies are always sent from RAM, so EP5 IN has no static buffers. */
+#define EP_5_LEN 64
+#define EP_5_OUT_LEN EP_5_LEN
+#define EP_5_IN_LEN EP_5_LEN
+#define EP_5_IN_DIRECT
+
+/* Define EP_n_IN_DIRECT to drop the static IN buffers of endpoint n (two per
+   endpoint with ping-pong). Its data is then only sent from application RAM,
+   with usb_send_in_buffer_at() or usb_start_in_transfer(). */
+
 #define NUMBER_OF_CONFIGURATIONS 1
 
 /* Ping-pong buffering mode. Valid values are:
@@ -59,7 +82,15 @@
 /* Comment the following line to use polling USB operation. When using polling,
    You are responsible for calling usb_service() periodically from your
    application. */
-//#define USB_USE_INTERRUPTS	// TODO FIX!!!
+#define USB_USE_INTERRUPTS
+
+/* Most completed transactions usb_service() handles per call. Default is 4,
+   the depth of the USTAT FIFO. Lower it to bound the time spent per call. */
+//#define USB_SERVICE_TOKEN_BUDGET 4
+
+/* Count transactions, bytes, stalls, resets and usb_service() time, see
+   usb_get_stats(). Costs a few cycles per token, and a CP0 read per call. */
+#define USB_STATS
 
 /* Uncomment if you have a composite device which has multiple different types
  * of device classes. For example a device which has HID+CDC or
@@ -74,6 +105,7 @@
 #define USB_DEVICE_DESCRIPTOR this_device_descriptor
 #define USB_CONFIG_DESCRIPTOR_MAP usb_application_config_descs
 #define USB_STRING_DESCRIPTOR_FUNC usb_application_get_string
+void usb_application_init_serial(void);	/* In usb_descriptors.c, call before usb_init() */
 
 /* Optional callbacks from usb.c. Leave them commented if you don't want to
    use them. For the prototypes and documentation for each one, see usb.h. */
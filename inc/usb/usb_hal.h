@@ -25,15 +25,26 @@
  */
 
 #ifndef USB_HAL_H__
-#define UAB_HAL_H__
+#define USB_HAL_H__
+
+#include <p32xxxx.h>
+#include <sys/kmem.h>	// KVA_TO_PA(), for PHYS_ADDR()
+#include <interrupt.h>	// INTERRUPT(), for the USB ISR in usb.c
+#include <system.h>	// GetCP0Count(), for USB_TICKS()
 
 
 #define USB_NEEDS_POWER_ON
 #define USB_NEEDS_SET_BD_ADDR_REG
 #define USB_FULL_PING_PONG_ONLY
 
+/* Free running counter for the USB_STATS timings. CP0 Count, CPU clock / 2 */
+#define USB_TICKS()              GetCP0Count()
+
 #define BDNADR_TYPE              uint32_t /* physical address */
 #define PHYS_ADDR(VIRTUAL_ADDR)  KVA_TO_PA(VIRTUAL_ADDR)
+/* The USB module can only bus-master to RAM (not flash), which sits below
+   the flash in the physical map. No alignment is needed for BDnADR. */
+#define USB_DMA_ADDRESSABLE(VIRTUAL_ADDR) (KVA_TO_PA(VIRTUAL_ADDR) < 0x1D000000)
 
 #define SFR_PULL_EN              /* Not used on PIC32MX */
 #define SFR_ON_CHIP_XCVR_DIS     U1CNFG2bits.UTRDIS
@@ -52,6 +63,9 @@
 #define SFR_RESET_IE             U1IEbits.URSTIE
 #define SFR_SOF_IE               U1IEbits.SOFIE
 #define SFR_USB_IE               IEC1bits.USBIE
+/* Set/clear registers, IEC1 is shared with the UART and DMA interrupts */
+#define USB_IE_DISABLE()         (IEC1CLR = _IEC1_USBIE_MASK)
+#define USB_IE_ENABLE()          (IEC1SET = _IEC1_USBIE_MASK)
 
 #define SFR_USB_EXTENDED_INTERRUPT_EN U1EIE
 
@@ -74,6 +88,10 @@
 #define SFR_USB_STATUS_EP        U1STATbits.ENDPT
 #define SFR_USB_STATUS_DIR       U1STATbits.DIR
 #define SFR_USB_STATUS_PPBI      U1STATbits.PPBI
+/* Fields of a value read from SFR_USB_STATUS */
+#define USTAT_EP(STAT)           (((STAT) >> 4) & 0x0f)
+#define USTAT_DIR(STAT)          (((STAT) >> 3) & 0x01)
+#define USTAT_PPBI(STAT)         (((STAT) >> 2) & 0x01)
 
 #define SFR_USB_POWER            U1PWRCbits.USBPWR
 #define SFR_BD_ADDR_REG1         U1BDTP1
@@ -405,6 +405,20 @@ struct msc_application_data {
 	msc_completion_callback operation_complete_callback;
 };
 
+#ifdef MULTI_CLASS_DEVICE
+/** Set the list of MSC interfaces on this device
+ *
+ * Provide a list to the MSC class implementation of the interfaces on this
+ * device which should be treated as MSC devices.  This is only necessary
+ * for multi-class composite devices to make sure that requests are not
+ * confused between interfaces.  It should be called before usb_init().
+ *
+ * @param interfaces      An array of interfaces which are MSC class.
+ * @param num_interfaces  The size of the @p interfaces array.
+ */
+void msc_set_interface_list(uint8_t *interfaces, uint8_t num_interfaces);
+#endif
+
 /** Initialize the MSC class for all interfaces
  *
  * Initialize all instances of the MSC class. Call this function with an
@@ -36,9 +36,16 @@
  * not nested.  */
 void usb_disable_transaction_interrupt();
 void usb_enable_transaction_interrupt();
+/* Manipulate the whole USB interrupt, for code that shares state with the
+ * reset, SOF and control request callbacks, which run from it. Not nestable
+ * either.  */
+void usb_disable_interrupt();
+void usb_enable_interrupt();
 #else
-#define usb_disable_transaction_interrupt
-#define usb_enable_transaction_interrupt
+#define usb_disable_transaction_interrupt()
+#define usb_enable_transaction_interrupt()
+#define usb_disable_interrupt()
+#define usb_enable_interrupt()
 #endif
 
 #endif /* USB_PRIV_H__ */
@@ -0,0 +1,165 @@
+#ifndef VENDOR_H_fe1c7e117d024796a190c07cb0be235f
+#define VENDOR_H_fe1c7e117d024796a190c07cb0be235f
+
+#include <inttypes.h>
+
+// Vendor specific control requests, handled in main.c.
+// bmRequestType: type = vendor, recipient = device. Shared with host side tools.
+// Per port requests (stats, flow control) take the UART port in wIndex, 0 = console, 1 = aux.
+
+enum VendorRequest {
+	VENDOR_SET_COALESCE_FRAMES	= 0x01,	// OUT, no data. wValue = frames to hold a partial IN packet (0 = send at once). Stalled above BRIDGE_COALESCE_FRAMES_MAX.
+	VENDOR_GET_COALESCE_FRAMES	= 0x02,	// IN, 1 byte
+	VENDOR_GET_BRIDGE_STATS		= 0x03,	// IN, struct bridge_stats
+	VENDOR_CLEAR_BRIDGE_STATS	= 0x04,	// OUT, no data
+	VENDOR_SET_FLOW_CONTROL		= 0x05,	// OUT, no data. wValue bit 0 = RTS/CTS flow control on the UART
+	VENDOR_GET_UART_ERRORS		= 0x06,	// IN, struct uart_error_stats
+	VENDOR_CLEAR_UART_ERRORS	= 0x07,	// OUT, no data
+	VENDOR_GET_UART_ISR_STATS	= 0x08,	// IN, struct uart_isr_stats
+	VENDOR_CLEAR_UART_ISR_STATS	= 0x09,	// OUT, no data
+	VENDOR_GET_USB_LATENCY		= 0x0A,	// IN, struct usb_latency_stats
+	VENDOR_CLEAR_USB_LATENCY	= 0x0B,	// OUT, no data
+	VENDOR_GET_USB_STATS		= 0x0C,	// IN, struct usb_core_stats. Stalled if built without USB_STATS.
+	VENDOR_CLEAR_USB_STATS		= 0x0D,	// OUT, no data
+};
+
+// Default and limit for VENDOR_SET_COALESCE_FRAMES, in 1ms USB frames.
+// The SOF count per port saturates at the limit.
+#define BRIDGE_COALESCE_FRAMES_DEFAULT	1
+#define BRIDGE_COALESCE_FRAMES_MAX		255
+
+// UART -> USB direction. Bytes per packet is in_bytes / in_packets.
+struct bridge_stats {
+	uint32_t in_bytes;		// Bytes sent on the data IN endpoint
+	uint32_t in_packets;	// Packets sent on the data IN endpoint
+	uint32_t in_full;		// Packets sent because the buffer was full
+	uint32_t in_timeout;	// Packets sent because the coalescing time ran out
+	uint32_t in_zlp;		// Zero-length packets, sent after a transfer ended on a full packet
+};
+
+// UART receive errors, since power up or VENDOR_CLEAR_UART_ERRORS
+struct uart_error_stats {
+	uint32_t dropped;		// Bytes thrown away, receive buffer full
+	uint32_t overrun;		// UART hardware FIFO overruns
+	uint32_t framing;		// Bytes with a framing error
+	uint32_t parity;		// Bytes with a parity error
+};
+
+// UART receive interrupt cost. Cycles per byte = cycles / bytes, bytes per interrupt = bytes / calls.
+struct uart_isr_stats {
+	uint32_t calls;			// RX interrupts served
+	uint32_t bytes;			// Bytes read in them
+	uint32_t cycles;		// CPU cycles spent reading them
+};
+
+// Worst case time from a USB token completing to usb_service() handling it.
+// Polling: longest main loop pass. Interrupts: longest time the main loop held the USB interrupt off.
+struct usb_latency_stats {
+	uint32_t interrupt_mode;	// 0 = polled usb_service(), 1 = USB_USE_INTERRUPTS
+	uint32_t max_cycles;		// Worst case, in CPU cycles
+	uint32_t cpu_clock;			// CPU clock in Hz, to convert max_cycles to time
+};
+
+// USB core counters, since power up or VENDOR_CLEAR_USB_STATS.
+// Saturated link: IN transactions near 19 per frame (sofs), mostly full packets.
+// Stalled reader: in_busy climbing while in_transactions stays put.
+#define USB_STATS_ENDPOINTS		6	// EP0 to EP5
+
+struct usb_endpoint_counters {
+	uint32_t in_transactions;	// Completed IN transactions
+	uint32_t in_bytes;			// Bytes sent in them
+	uint32_t out_transactions;	// Completed OUT/SETUP transactions
+	uint32_t out_bytes;			// Bytes received in them
+	uint32_t in_busy;			// Times the firmware found the IN endpoint still busy
+};
+
+struct usb_core_stats {
+	uint32_t resets;			// USB resets
+	uint32_t stalls;			// STALL handshakes sent
+	uint32_t sofs;				// Start-of-frame tokens, one per 1ms
+	uint32_t max_service_ticks;	// Longest usb_service() call, in CP0 Count ticks (cpu_clock / 2)
+	uint32_t cpu_clock;			// CPU clock in Hz
+	struct usb_endpoint_counters ep[USB_STATS_ENDPOINTS];
+};
+
+// Programmer commands, on the vendor bulk interface (interface 4, EP5 OUT/IN), see COMMS.c.
+// The host writes one struct comms_command as its own transfer, then the command's
+// payload if it has one (command.length bytes), and reads back one struct comms_reply,
+// followed by reply.length bytes of data, as one transfer.
+// One command at a time: the next one is NAKed until the reply has been read.
+// A payload is always read to the end, even once the command has failed.
+#define COMMS_PROTOCOL_VERSION	5
+
+enum CommsCommand {
+	COMMS_PING					= 0x00,	// value = COMMS_PROTOCOL_VERSION
+	COMMS_ICSP_ENTER			= 0x10,	// Enter 2-wire ICSP (target held in reset), or flags bit 0: 4-wire JTAG. value = MCHP status
+	COMMS_ICSP_EXIT				= 0x11,	// Release the target
+	COMMS_ICSP_IDCODE			= 0x12,	// value = target IDCODE
+	COMMS_ICSP_STATUS			= 0x13,	// value = MCHP status (MCHP_STATUS_* in ICSPDrv.h)
+	COMMS_ICSP_ERASE			= 0x14,	// Chip erase, replies when done. value = MCHP status
+	COMMS_ICSP_SERIAL_EXEC		= 0x15,	// Enter serial execution. flags bit 0 = flash enable (MX3/4/5/6/7)
+	COMMS_ICSP_READ				= 0x16,	// Serial execution read. address, length = bytes (multiple of 4). Data = words read
+	COMMS_SHIFT_BENCHMARK		= 0x17,	// Shift length 32-bit words through IDCODE. Data = struct comms_shift_benchmark
+	COMMS_PE_LOAD				= 0x20,	// In serial execution. Payload = length bytes of PE image, loaded to target RAM. value = PE version
+	COMMS_PE_PROGRAM			= 0x21,	// Payload = length bytes to flash from physical address, in rows of param bytes. value = bytes programmed
+	COMMS_HEX_PROGRAM			= 0x22,	// Payload = length bytes of Intel HEX file, flashed as it comes in, in rows of param bytes. value = bytes programmed
+	COMMS_PE_CRC				= 0x23,	// value = CRC of length bytes of flash from physical address, by the PE (PE_CRC_SEED in ICSPDrv.h)
+};
+
+enum CommsStatus {
+	COMMS_OK					= 0,
+	COMMS_ERR_COMMAND			= 1,	// Unknown command, or it came in short
+	COMMS_ERR_LENGTH			= 2,	// length out of range for the command
+	COMMS_ERR_NOT_ENTERED		= 3,	// COMMS_ICSP_ENTER first
+	COMMS_ERR_CODE_PROTECTED	= 4,	// Target is code protected, erase it
+	COMMS_ERR_TIMEOUT			= 5,	// Target stopped answering
+	COMMS_ERR_PE				= 6,	// PE answered with an error, value = its response
+	COMMS_ERR_NO_PE				= 7,	// COMMS_PE_LOAD first
+	COMMS_ERR_HEX				= 8,	// Bad HEX record, data outside flash or a row twice, or no EOF record. value = line
+	COMMS_ERR_VERIFY			= 9,	// Flash CRC doesn't match the data sent. value = address of the run of rows
+	COMMS_ERR_FAMILY			= 10,	// Target family not known, so no row size for COMMS_PE_PROGRAM/COMMS_HEX_PROGRAM
+};
+
+// COMMS_PE_PROGRAM and COMMS_HEX_PROGRAM flags bit 0: verify. Each run of rows programmed one after the
+// other is checked against the PE's CRC of the flash, instead of reading it back.
+#define COMMS_FLAG_VERIFY		0x01
+
+// Most data bytes in one reply
+#define COMMS_MAX_DATA			1024
+
+// Largest flash row. COMMS_PE_PROGRAM and COMMS_HEX_PROGRAM take only the row size (param) of the
+// target family, known from its IDCODE at COMMS_ICSP_ENTER: 128 bytes on MX1/2, 512 on MX3/4/5/6/7.
+// Another size is COMMS_ERR_LENGTH, with value = the target's row size.
+#define COMMS_MAX_ROW			512
+
+// Most words in one COMMS_SHIFT_BENCHMARK. They are shifted a millisecond's worth per
+// main loop pass, so the bridges keep going. This only bounds the wait for the reply.
+#define COMMS_BENCHMARK_MAX_WORDS	65536
+
+struct comms_command {
+	uint8_t command;		// enum CommsCommand
+	uint8_t flags;			// Per command
+	uint16_t param;			// Per command
+	uint32_t address;		// Target address, per command
+	uint32_t length;		// Byte count, per command
+};
+
+struct comms_reply {
+	uint8_t command;		// Copied from the command
+	uint8_t status;			// enum CommsStatus
+	uint16_t reserved;
+	uint32_t value;			// Per command
+	uint32_t length;		// Data bytes following this header
+};
+
+// COMMS_SHIFT_BENCHMARK result. Throughput in bits/s = bits * (cpu_clock / 2) / ticks,
+// including the TMS moves around each word.
+struct comms_shift_benchmark {
+	uint32_t bits;			// Data bits shifted
+	uint32_t ticks;			// CP0 Count ticks it took (cpu_clock / 2)
+	uint32_t cpu_clock;		// CPU clock in Hz
+	uint32_t tck;			// TCK of SPI shifted bytes in Hz, JTAG only
+	uint32_t transport;		// 0 = 2-wire ICSP, 1 = JTAG
+};
+
+#endif
@@ -0,0 +1,700 @@
+#include <p32xxxx.h>
+#include <inttypes.h>
+#include <ICSPDrv.h>
+#include <GPIODrv.h>
+#include <system.h>
+
+// SFRs are followed by their CLR, SET and INV registers
+#define SFR_CLR		1
+#define SFR_SET		2
+
+#define PIN_HIGH(lat, pin)		((&(lat))[SFR_SET] = (pin))
+#define PIN_LOW(lat, pin)		((&(lat))[SFR_CLR] = (pin))
+#define PIN_OUT(lat, pin, b)	((&(lat))[(b) ? SFR_SET : SFR_CLR] = (pin))
+#define PIN_OUTPUT(tris, pin)	((&(tris))[SFR_CLR] = (pin))
+#define PIN_INPUT(tris, pin)	((&(tris))[SFR_SET] = (pin))
+
+#define PGEC_HIGH()		PIN_HIGH(ICSP_PGEC_LATreg, ICSP_PGEC_PIN)
+#define PGEC_LOW()		PIN_LOW(ICSP_PGEC_LATreg, ICSP_PGEC_PIN)
+#define PGED_OUT(b)		PIN_OUT(ICSP_PGED_LATreg, ICSP_PGED_PIN, b)
+#define PGED_IN()		((ICSP_PGED_PORTreg & ICSP_PGED_PIN) ? 1 : 0)
+
+#define TCK_HIGH()		PIN_HIGH(JTAG_TCK_LATreg, JTAG_TCK_PIN)
+#define TCK_LOW()		PIN_LOW(JTAG_TCK_LATreg, JTAG_TCK_PIN)
+#define TDI_OUT(b)		PIN_OUT(JTAG_TDI_LATreg, JTAG_TDI_PIN, b)
+#define TMS_OUT(b)		PIN_OUT(JTAG_TMS_LATreg, JTAG_TMS_PIN, b)
+#define TDO_IN()		((JTAG_TDO_PORTreg & JTAG_TDO_PIN) ? 1 : 0)
+
+// "MCHP", clocked in MSb first with MCLR low, selects ICSP over the default
+#define ICSP_ENTRY_KEY		0x4D434850
+
+// EJTAG Control register values for ICSPDrv_XferInstruction()
+#define ETAP_CONTROL_PRACC		(1<<18)		// Processor access pending
+#define ETAP_CONTROL_WAIT		0x0004C000	// PrAcc | ProbEn | ProbTrap, leaves a pending access alone
+#define ETAP_CONTROL_RUN		0x0000C000	// ProbEn | ProbTrap, PrAcc cleared: the access is served
+
+static uint8_t entered = 0;
+static uint8_t peLoaded = 0;
+static ICSPDrvTransport transport = Transport_2Wire;
+static uint32_t ticksPerMs;		// CP0 Count runs at half the CPU clock
+static uint32_t tckFrequency;	// SPI shifted TCK, JTAG only
+
+// JTAG shifts LSb first, the SPI MSb first
+static const uint8_t bitReverse[256] = {
+#define R2(n)	(n), (n) + 2*64, (n) + 1*64, (n) + 3*64
+#define R4(n)	R2(n), R2((n) + 2*16), R2((n) + 1*16), R2((n) + 3*16)
+#define R6(n)	R4(n), R4((n) + 2*4), R4((n) + 1*4), R4((n) + 3*4)
+	R6(0), R6(2), R6(1), R6(3)
+#undef R6
+#undef R4
+#undef R2
+};
+
+static void ICSPDrv_Wait(void){
+	volatile uint32_t i;
+
+	for (i = 0; i < ICSP_CLOCK_LOOPS; i++){
+	}
+}
+
+static void ICSPDrv_DelayUs(uint32_t us){
+	uint32_t start = GetCP0Count();
+	uint32_t ticks = (ticksPerMs * us) / 1000 + 1;
+
+	while ((GetCP0Count() - start) < ticks){
+	}
+}
+
+// One TAP clock, as 4 PGEC cycles: TDI and TMS from us, a turnaround, TDO from the target.
+// The target samples PGED on the falling edge, and drives TDO while PGEC is high.
+static uint8_t ICSPDrv_Clock2Wire(uint8_t tms, uint8_t tdi){
+	uint8_t tdo;
+
+	PGED_OUT(tdi);
+	PGEC_HIGH();
+	ICSPDrv_Wait();
+	PGEC_LOW();
+	ICSPDrv_Wait();
+
+	PGED_OUT(tms);
+	PGEC_HIGH();
+	ICSPDrv_Wait();
+	PGEC_LOW();
+	ICSPDrv_Wait();
+
+	PIN_INPUT(ICSP_PGED_TRISreg, ICSP_PGED_PIN);	// Turnaround, the target takes PGED
+	PGEC_HIGH();
+	ICSPDrv_Wait();
+	PGEC_LOW();
+	ICSPDrv_Wait();
+
+	PGEC_HIGH();
+	ICSPDrv_Wait();
+	tdo = PGED_IN();
+	PGEC_LOW();
+	PIN_OUTPUT(ICSP_PGED_TRISreg, ICSP_PGED_PIN);
+	ICSPDrv_Wait();
+
+	return tdo;
+}
+
+// One JTAG clock by GPIO. The target samples TDI/TMS on the rising edge, and changes TDO on the falling one.
+static uint8_t ICSPDrv_ClockJtag(uint8_t tms, uint8_t tdi){
+	uint8_t tdo;
+
+	TMS_OUT(tms);
+	TDI_OUT(tdi);
+	ICSPDrv_Wait();
+	TCK_HIGH();
+	tdo = TDO_IN();
+	ICSPDrv_Wait();
+	TCK_LOW();
+
+	return tdo;
+}
+
+static uint8_t ICSPDrv_ClockTap(uint8_t tms, uint8_t tdi){
+	if (transport == Transport_JTAG){
+		return ICSPDrv_ClockJtag(tms, tdi);
+	}
+	return ICSPDrv_Clock2Wire(tms, tdi);
+}
+
+// Clock count TMS bits, LSb first, with TDI low
+static void ICSPDrv_SetMode(uint32_t tms, uint8_t count){
+	uint8_t i;
+
+	for (i = 0; i < count; i++){
+		ICSPDrv_ClockTap((tms >> i) & 1, 0);
+	}
+}
+
+// Give TCK and TDI to the SPI, or back to their LAT bits. SCK idles low, like TCK.
+static void ICSPDrv_JtagSpi(uint8_t on){
+	if (on){
+#ifdef JTAG_TDI_RP_REG
+		JTAG_TDI_RP_REG = JTAG_TDI_RP_VAL;
+#endif
+		JTAG_SPI_CON_bits.ON = 1;
+	}
+	else{
+		JTAG_SPI_CON_bits.ON = 0;
+#ifdef JTAG_TDI_RP_REG
+		JTAG_TDI_RP_REG = 0;	// Back to LATx
+#endif
+	}
+}
+
+// JTAG shift: all but the last bit go out a byte at a time through the SPI. Dummy
+// bits in front round them up to whole bytes. They are shifted through and out of the
+// far end of the register, so count must be the register's length. The last bit needs
+// TMS high, so it is clocked by GPIO, like the odd bits would otherwise be.
+static uint64_t ICSPDrv_ShiftJtag(uint64_t data, uint8_t count){
+	uint8_t pad = (8 - (count - 1) % 8) % 8;
+	uint8_t bytes = (pad + count - 1) / 8;
+	uint64_t tdi = data << pad;
+	uint64_t tdo = 0;
+	uint8_t last;
+	uint8_t i;
+
+	TMS_OUT(0);
+	ICSPDrv_JtagSpi(1);
+	for (i = 0; i < bytes; i++){
+		JTAG_SPI_BUF_reg = bitReverse[(tdi >> (8*i)) & 0xFF];
+		while (!JTAG_SPI_STAT_bits.SPIRBF){
+		}
+		tdo |= (uint64_t)bitReverse[JTAG_SPI_BUF_reg & 0xFF] << (8*i);
+	}
+	ICSPDrv_JtagSpi(0);
+
+	// TDO is the register from its first bit on, the dummies come out after it
+	last = ICSPDrv_ClockJtag(1, (data >> (count - 1)) & 1);
+	if (pad == 0){
+		tdo |= (uint64_t)last << (count - 1);
+	}
+
+	return tdo & (((uint64_t)1 << count) - 1);
+}
+
+// Shift count bits through the selected register, LSb first. From Shift-xR, ends in Run-Test/Idle.
+static uint64_t ICSPDrv_ShiftDR(uint64_t data, uint8_t count){
+	uint64_t tdo = 0;
+	uint8_t i;
+
+	if (transport == Transport_JTAG){
+		tdo = ICSPDrv_ShiftJtag(data, count);
+	}
+	else{
+		for (i = 0; i < count; i++){
+			tdo |= (uint64_t)ICSPDrv_Clock2Wire(i == count - 1, (data >> i) & 1) << i;
+		}
+	}
+	ICSPDrv_SetMode(0b01, 2);	// Update-xR, Run-Test/Idle
+
+	return tdo;
+}
+
+// Test-Logic-Reset, then Run-Test/Idle (SetMode(6'b011111) in the spec)
+static void ICSPDrv_TapReset(void){
+	ICSPDrv_SetMode(0b011111, 6);
+}
+
+static void ICSPDrv_InitSpi(void){
+	uint32_t brg = (GetPeripheralClock() + 2*JTAG_TCK_HZ - 1) / (2*JTAG_TCK_HZ);	// Rounded up, TCK rounded down
+
+	if (brg > 0){
+		brg--;
+	}
+	tckFrequency = GetPeripheralClock() / (2*(brg + 1));
+
+	JTAG_SPI_CON_bits.ON = 0;
+	JTAG_SPI_BRG_reg = brg;
+	JTAG_SPI_CON_bits.MODE16 = 0;	// 8-bit
+	JTAG_SPI_CON_bits.MODE32 = 0;
+	JTAG_SPI_CON_bits.MSTEN = 1;
+	JTAG_SPI_CON_bits.CKP = 0;		// Idle low
+	JTAG_SPI_CON_bits.CKE = 1;		// SDO changes on the falling edge, stable for the rising one
+	JTAG_SPI_CON_bits.SMP = 0;		// SDI sampled mid-bit, on the rising edge
+#ifdef JTAG_TDO_REMAP_REG
+	JTAG_TDO_REMAP_REG = JTAG_TDO_REMAP_VAL;
+#endif
+}
+
+// All target pins to inputs
+static void ICSPDrv_ReleasePins(void){
+	ICSPDrv_JtagSpi(0);
+	PIN_INPUT(JTAG_TCK_TRISreg, JTAG_TCK_PIN);
+	PIN_INPUT(JTAG_TMS_TRISreg, JTAG_TMS_PIN);
+	PIN_INPUT(JTAG_TDI_TRISreg, JTAG_TDI_PIN);
+	PIN_INPUT(JTAG_TDO_TRISreg, JTAG_TDO_PIN);
+	PIN_INPUT(ICSP_PGEC_TRISreg, ICSP_PGEC_PIN);
+	PIN_INPUT(ICSP_PGED_TRISreg, ICSP_PGED_PIN);
+	PIN_INPUT(ICSP_MCLR_TRISreg, ICSP_MCLR_PIN);
+}
+
+void ICSPDrv_Init(void){
+	ticksPerMs = GetSystemClock() / 2000;
+
+#ifdef ICSP_ANSELreg
+	ICSP_ANSELreg = ICSP_ANSELreg & ~ICSP_ANSEL_MASK;
+#endif
+#ifdef JTAG_ANSELreg
+	JTAG_ANSELreg = JTAG_ANSELreg & ~JTAG_ANSEL_MASK;
+#endif
+	ICSPDrv_InitSpi();
+	ICSPDrv_ReleasePins();
+}
+
+// 2-wire: hold the target in reset and put it in ICSP mode.
+// JTAG: the TAP is always there (JTAGEN), MCLR is left alone.
+void ICSPDrv_Enter(ICSPDrvTransport t){
+	int8_t i;
+
+	ICSPDrv_ReleasePins();	// The other transport's pins too
+	transport = t;
+
+	if (transport == Transport_JTAG){
+		TCK_LOW();
+		TMS_OUT(1);
+		TDI_OUT(0);
+		PIN_OUTPUT(JTAG_TCK_TRISreg, JTAG_TCK_PIN);
+		PIN_OUTPUT(JTAG_TMS_TRISreg, JTAG_TMS_PIN);
+		PIN_OUTPUT(JTAG_TDI_TRISreg, JTAG_TDI_PIN);
+		PIN_INPUT(JTAG_TDO_TRISreg, JTAG_TDO_PIN);
+	}
+	else{
+		PIN_LOW(ICSP_MCLR_LATreg, ICSP_MCLR_PIN);
+		PGEC_LOW();
+		PGED_OUT(0);
+		PIN_OUTPUT(ICSP_MCLR_TRISreg, ICSP_MCLR_PIN);
+		PIN_OUTPUT(ICSP_PGEC_TRISreg, ICSP_PGEC_PIN);
+		PIN_OUTPUT(ICSP_PGED_TRISreg, ICSP_PGED_PIN);
+		ICSPDrv_DelayUs(500);
+
+		// Key, MSb first. Latched on the rising edge of PGEC.
+		for (i = 31; i >= 0; i--){
+			PGED_OUT((ICSP_ENTRY_KEY >> i) & 1);
+			ICSPDrv_Wait();
+			PGEC_HIGH();
+			ICSPDrv_Wait();
+			PGEC_LOW();
+		}
+		PGED_OUT(0);
+		ICSPDrv_DelayUs(1);
+
+		PIN_HIGH(ICSP_MCLR_LATreg, ICSP_MCLR_PIN);
+		ICSPDrv_DelayUs(500);
+	}
+
+	ICSPDrv_TapReset();
+	entered = 1;
+	peLoaded = 0;
+}
+
+// Release the target. A short reset pulse, so it starts over from its new flash,
+// then MCLR is left to the target's pull-up.
+void ICSPDrv_Exit(void){
+	PIN_LOW(ICSP_MCLR_LATreg, ICSP_MCLR_PIN);
+	PIN_OUTPUT(ICSP_MCLR_TRISreg, ICSP_MCLR_PIN);
+	ICSPDrv_DelayUs(100);
+	ICSPDrv_ReleasePins();
+	entered = 0;
+	peLoaded = 0;
+}
+
+uint8_t ICSPDrv_IsEntered(void){
+	return entered;
+}
+
+ICSPDrvTransport ICSPDrv_GetTransport(void){
+	return transport;
+}
+
+// TCK of the SPI shifted bytes, in Hz
+uint32_t ICSPDrv_GetTckFrequency(void){
+	return tckFrequency;
+}
+
+// Load a 5-bit TAP instruction. From and back to Run-Test/Idle.
+void ICSPDrv_SendCommand(uint8_t command){
+	ICSPDrv_SetMode(0b0011, 4);	// Select-DR, Select-IR, Capture-IR, Shift-IR
+	ICSPDrv_ShiftDR(command, 5);
+}
+
+// Select-DR, Capture-DR, Shift-DR
+static void ICSPDrv_ShiftDRStart(void){
+	ICSPDrv_SetMode(0b001, 3);
+}
+
+// The MCHP command register (MTAP_COMMAND) is 8 bits. Returns the status it held.
+uint8_t ICSPDrv_XferCommand(uint8_t command){
+	ICSPDrv_ShiftDRStart();
+	return ICSPDrv_ShiftDR(command, 8);
+}
+
+// Shift 32 bits through the selected data register, returns what came out
+uint32_t ICSPDrv_XferData(uint32_t data){
+	ICSPDrv_ShiftDRStart();
+	return ICSPDrv_ShiftDR(data, 32);
+}
+
+// FASTDATA is 33 bits, the PrAcc bit first. prAcc gets the target's PrAcc, 0 means it didn't take the word.
+uint32_t ICSPDrv_XferFastData(uint32_t data, uint8_t *prAcc){
+	uint64_t tdo;
+
+	ICSPDrv_ShiftDRStart();
+	tdo = ICSPDrv_ShiftDR((uint64_t)data << 1, 33);	// PrAcc in as 0
+	*prAcc = tdo & 1;
+
+	return tdo >> 1;
+}
+
+uint32_t ICSPDrv_ReadIdCode(void){
+	ICSPDrv_SendCommand(MTAP_SW_MTAP);
+	ICSPDrv_SendCommand(MTAP_IDCODE);
+	return ICSPDrv_XferData(0);
+}
+
+uint8_t ICSPDrv_ReadStatus(void){
+	ICSPDrv_SendCommand(MTAP_SW_MTAP);
+	ICSPDrv_SendCommand(MTAP_COMMAND);
+	return ICSPDrv_XferCommand(MCHP_STATUS);
+}
+
+// Chip erase, flash and configuration. The only way out of code protection.
+ICSPDrvStatus ICSPDrv_Erase(void){
+	uint32_t start;
+	ICSPDrvStatus status;
+
+	status = ICSPDrv_EraseStart();
+	start = GetCP0Count();
+	while (status == ICSP_Ok && !ICSPDrv_EraseDone()){
+		if ((GetCP0Count() - start) >= ticksPerMs * ICSP_ERASE_TIMEOUT_MS){
+			status = ICSP_Timeout;
+		}
+	}
+	return status;
+}
+
+// The same, without waiting for it. Poll ICSPDrv_EraseDone() until it is over.
+ICSPDrvStatus ICSPDrv_EraseStart(void){
+	if (!entered){
+		return ICSP_NotEntered;
+	}
+
+	ICSPDrv_SendCommand(MTAP_SW_MTAP);
+	ICSPDrv_SendCommand(MTAP_COMMAND);
+	ICSPDrv_XferCommand(MCHP_ERASE);
+	return ICSP_Ok;
+}
+
+// The erase has finished, the flash controller is idle again
+uint8_t ICSPDrv_EraseDone(void){
+	uint8_t status = ICSPDrv_XferCommand(MCHP_STATUS);
+
+	return (status & MCHP_STATUS_CFGRDY) && !(status & MCHP_STATUS_FCBUSY);
+}
+
+// Boot the target CPU into EJTAG debug mode, fetching its instructions from us.
+// MX3/4/5/6/7 need flashEnable, MX1/2 don't have the flash enable bit.
+ICSPDrvStatus ICSPDrv_EnterSerialExecution(uint8_t flashEnable){
+	if (!entered){
+		return ICSP_NotEntered;
+	}
+
+	ICSPDrv_TapReset();
+	ICSPDrv_SendCommand(MTAP_SW_MTAP);
+	ICSPDrv_TapReset();
+	ICSPDrv_SendCommand(MTAP_COMMAND);
+	if (!(ICSPDrv_XferCommand(MCHP_STATUS) & MCHP_STATUS_CPS)){
+		return ICSP_CodeProtected;
+	}
+	ICSPDrv_XferCommand(MCHP_ASSERT_RST);
+
+	ICSPDrv_SendCommand(MTAP_SW_ETAP);
+	ICSPDrv_TapReset();
+	ICSPDrv_SendCommand(ETAP_EJTAGBOOT);
+
+	ICSPDrv_SendCommand(MTAP_SW_MTAP);
+	ICSPDrv_SendCommand(MTAP_COMMAND);
+	ICSPDrv_XferCommand(MCHP_DE_ASSERT_RST);
+	if (flashEnable){
+		ICSPDrv_XferCommand(MCHP_FLASH_ENABLE);
+	}
+
+	ICSPDrv_SendCommand(MTAP_SW_ETAP);
+	ICSPDrv_TapReset();
+
+	return ICSP_Ok;
+}
+
+// Hand one instruction to the target CPU, in serial execution mode
+ICSPDrvStatus ICSPDrv_XferInstruction(uint32_t instruction){
+	uint32_t start = GetCP0Count();
+
+	// Wait for the CPU to fetch
+	ICSPDrv_SendCommand(ETAP_CONTROL);
+	while (!(ICSPDrv_XferData(ETAP_CONTROL_WAIT) & ETAP_CONTROL_PRACC)){
+		if ((GetCP0Count() - start) >= ticksPerMs * ICSP_PRACC_TIMEOUT_MS){
+			return ICSP_Timeout;
+		}
+	}
+
+	ICSPDrv_SendCommand(ETAP_DATA);
+	ICSPDrv_XferData(instruction);
+
+	// Let it execute
+	ICSPDrv_SendCommand(ETAP_CONTROL);
+	ICSPDrv_XferData(ETAP_CONTROL_RUN);
+
+	return ICSP_Ok;
+}
+
+// Read a word of target memory, in serial execution mode. The target stores it to FASTDATA.
+ICSPDrvStatus ICSPDrv_ReadWord(uint32_t address, uint32_t *word){
+	static const uint32_t code[] = {
+		0x3C13FF20,		// lui s3, 0xFF20 (FASTDATA)
+		0x3C080000,		// lui t0, address[31:16]
+		0x35080000,		// ori t0, t0, address[15:0]
+		0x8D090000,		// lw t1, 0(t0)
+		0xAE690000,		// sw t1, 0(s3)
+	};
+	ICSPDrvStatus status;
+	uint8_t prAcc;
+	uint8_t i;
+
+	for (i = 0; i < sizeof(code)/sizeof(code[0]); i++){
+		uint32_t instruction = code[i];
+		if (i == 1){
+			instruction |= address >> 16;
+		}
+		else if (i == 2){
+			instruction |= address & 0xFFFF;
+		}
+		status = ICSPDrv_XferInstruction(instruction);
+		if (status != ICSP_Ok){
+			return status;
+		}
+	}
+
+	ICSPDrv_SendCommand(ETAP_FASTDATA);
+	*word = ICSPDrv_XferFastData(0, &prAcc);
+
+	return prAcc ? ICSP_Ok : ICSP_Timeout;
+}
+
+// Copies words from FASTDATA to RAM: an address and a count, then count words, until
+// the count is 0xDEAD0000. Then it jumps to PE_ADDRESS. From the programming specification.
+static const uint32_t peLoader[] = {
+	0x3C07DEAD,		// lui a3, 0xDEAD
+	0x3C06FF20,		// lui a2, 0xFF20
+	0x3C05FF20,		// lui a1, 0xFF20
+					// here:
+	0x8CC40000,		// lw a0, 0(a2)
+	0x8CC30000,		// lw v1, 0(a2)
+	0x1067000B,		// beq v1, a3, exit
+	0x00000000,		// nop
+	0x1060FFFB,		// beqz v1, here
+	0x00000000,		// nop
+					// loop:
+	0x8CA20000,		// lw v0, 0(a1)
+	0x2463FFFF,		// addiu v1, v1, -1
+	0xAC820000,		// sw v0, 0(a0)
+	0x24840004,		// addiu a0, a0, 4
+	0x1460FFFB,		// bnez v1, loop
+	0x00000000,		// nop
+	0x1000FFF3,		// b here
+	0x00000000,		// nop
+					// exit:
+	0x3C02A000,		// lui v0, 0xA000
+	0x34420900,		// ori v0, v0, 0x0900
+	0x00400008,		// jr v0
+	0x00000000,		// nop
+};
+
+// Hand the PE (or its loader) one word through FASTDATA. It's taken once the
+// target has a read of FASTDATA pending, PrAcc tells.
+static ICSPDrvStatus ICSPDrv_PeSendWord(uint32_t word){
+	uint32_t start = GetCP0Count();
+	uint8_t prAcc;
+
+	for (;;){
+		ICSPDrv_XferFastData(word, &prAcc);
+		if (prAcc){
+			return ICSP_Ok;
+		}
+		if ((GetCP0Count() - start) >= ticksPerMs * ICSP_PRACC_TIMEOUT_MS){
+			return ICSP_Timeout;
+		}
+	}
+}
+
+// Start the PE download ("Downloading the PE" in the spec): all of RAM made kernel
+// data and program, the loader written to PE_LOADER_ADDRESS and started, then told
+// to expect words at PE_ADDRESS. Send them with ICSPDrv_PeSend().
+ICSPDrvStatus ICSPDrv_PeLoadStart(uint32_t words){
+	static const uint32_t setup[] = {
+		0x3C04BF88,		// lui a0, 0xBF88
+		0x34842000,		// ori a0, a0, 0x2000		a0 = &BMXCON
+		0x3C05001F,		// lui a1, 0x001F
+		0x34A50040,		// ori a1, a1, 0x0040
+		0xAC850000,		// sw a1, 0(a0)				BMXCON = 0x001F0040
+		0x34050800,		// li a1, 0x0800
+		0xAC850010,		// sw a1, 16(a0)			BMXDKPBA = 0x800
+		0x8C850040,		// lw a1, 64(a0)			BMXDRMSZ
+		0xAC850020,		// sw a1, 32(a0)			BMXDUDBA
+		0xAC850030,		// sw a1, 48(a0)			BMXDUPBA
+		0x3C04A000,		// lui a0, 0xA000
+		0x34840800,		// ori a0, a0, 0x0800		a0 = PE_LOADER_ADDRESS
+	};
+	static const uint32_t jump[] = {
+		0x3C19A000,		// lui t9, 0xA000
+		0x37390800,		// ori t9, t9, 0x0800
+		0x03200008,		// jr t9
+		0x00000000,		// nop
+	};
+	ICSPDrvStatus status = ICSP_Ok;
+	uint32_t i;
+
+	if (!entered){
+		return ICSP_NotEntered;
+	}
+	peLoaded = 0;
+
+	for (i = 0; i < sizeof(setup)/sizeof(setup[0]) && status == ICSP_Ok; i++){
+		status = ICSPDrv_XferInstruction(setup[i]);
+	}
+	for (i = 0; i < sizeof(peLoader)/sizeof(peLoader[0]) && status == ICSP_Ok; i++){
+		status = ICSPDrv_XferInstruction(0x3C060000 | (peLoader[i] >> 16));		// lui a2, hi
+		if (status == ICSP_Ok){
+			status = ICSPDrv_XferInstruction(0x34C60000 | (peLoader[i] & 0xFFFF));	// ori a2, a2, lo
+		}
+		if (status == ICSP_Ok){
+			status = ICSPDrv_XferInstruction(0xAC860000);	// sw a2, 0(a0)
+		}
+		if (status == ICSP_Ok){
+			status = ICSPDrv_XferInstruction(0x24840004);	// addiu a0, a0, 4
+		}
+	}
+	for (i = 0; i < sizeof(jump)/sizeof(jump[0]) && status == ICSP_Ok; i++){
+		status = ICSPDrv_XferInstruction(jump[i]);
+	}
+
+	if (status == ICSP_Ok){
+		uint32_t header[2] = { PE_ADDRESS, words };
+		status = ICSPDrv_PeSend(header, 2);
+	}
+	return status;
+}
+
+// Words to the PE, or to its loader while downloading it
+ICSPDrvStatus ICSPDrv_PeSend(const uint32_t *words, uint32_t count){
+	ICSPDrvStatus status = ICSP_Ok;
+	uint32_t i;
+
+	ICSPDrv_SendCommand(ETAP_FASTDATA);
+	for (i = 0; i < count && status == ICSP_Ok; i++){
+		status = ICSPDrv_PeSendWord(words[i]);
+	}
+	return status;
+}
+
+// End the download: the loader jumps to the PE, which has to tell its version
+ICSPDrvStatus ICSPDrv_PeLoadFinish(uint16_t *version){
+	static const uint32_t end[] = { 0, 0xDEAD0000, PE_EXEC_VERSION << 16 };
+	ICSPDrvStatus status;
+	uint32_t response;
+
+	status = ICSPDrv_PeSend(end, 3);
+	if (status == ICSP_Ok){
+		status = ICSPDrv_PeGetResponse(&response);
+	}
+	if (status == ICSP_Ok && (response >> 16) != PE_EXEC_VERSION){
+		status = ICSP_PeError;
+	}
+	if (status == ICSP_Ok){
+		*version = response & 0xFFFF;
+		peLoaded = 1;
+	}
+	return status;
+}
+
+uint8_t ICSPDrv_PeIsLoaded(void){
+	return peLoaded;
+}
+
+// The PE has a response waiting, a write to FASTDATA pending
+uint8_t ICSPDrv_PeResponseReady(void){
+	ICSPDrv_SendCommand(ETAP_CONTROL);
+	return (ICSPDrv_XferData(ETAP_CONTROL_WAIT) & ETAP_CONTROL_PRACC) ? 1 : 0;
+}
+
+// Take the response, once ICSPDrv_PeResponseReady()
+uint32_t ICSPDrv_PeReadResponse(void){
+	uint32_t response;
+
+	ICSPDrv_SendCommand(ETAP_DATA);
+	response = ICSPDrv_XferData(0);
+	ICSPDrv_SendCommand(ETAP_CONTROL);
+	ICSPDrv_XferData(ETAP_CONTROL_RUN);
+
+	return response;
+}
+
+static ICSPDrvStatus ICSPDrv_PeWaitResponse(uint32_t *response, uint32_t timeoutMs){
+	uint32_t start = GetCP0Count();
+
+	while (!ICSPDrv_PeResponseReady()){
+		if ((GetCP0Count() - start) >= ticksPerMs * timeoutMs){
+			return ICSP_Timeout;
+		}
+	}
+	*response = ICSPDrv_PeReadResponse();
+	return ICSP_Ok;
+}
+
+ICSPDrvStatus ICSPDrv_PeGetResponse(uint32_t *response){
+	return ICSPDrv_PeWaitResponse(response, ICSP_PE_TIMEOUT_MS);
+}
+
+// CRC of length bytes of flash from address (physical), worked out by the PE
+ICSPDrvStatus ICSPDrv_PeGetCrc(uint32_t address, uint32_t length, uint16_t *crc){
+	uint32_t request[3] = { PE_GET_CRC << 16, address, length };
+	ICSPDrvStatus status;
+	uint32_t response;
+	uint32_t word;
+
+	if (!peLoaded){
+		return ICSP_PeError;
+	}
+	status = ICSPDrv_PeSend(request, 3);
+	if (status == ICSP_Ok){
+		status = ICSPDrv_PeWaitResponse(&response, ICSP_PE_CRC_TIMEOUT_MS);
+	}
+	if (status == ICSP_Ok){
+		status = ICSPDrv_PeGetResponse(&word);	// The CRC, in the bottom half
+	}
+	if (status == ICSP_Ok && response != (PE_GET_CRC << 16)){
+		status = ICSP_PeError;
+	}
+	if (status == ICSP_Ok){
+		*crc = word & 0xFFFF;
+	}
+	return status;
+}
+
+// Carry on crc over the data, the way PE_GET_CRC does. Start from PE_CRC_SEED.
+uint16_t ICSPDrv_PeCrc(uint16_t crc, const void *data, uint32_t length){
+	static const uint16_t table[16] = {
+		0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+		0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+	};
+	const uint8_t *p = data;
+
+	while (length--){
+		crc = table[(crc >> 12) ^ (*p >> 4)] ^ (crc << 4);	// A nibble at a time, MSB first
+		crc = table[(crc >> 12) ^ (*p & 0x0F)] ^ (crc << 4);
+		p++;
+	}
+	return crc;
+}
@@ -1,4 +1,6 @@
+
 #include <p32xxxx.h>
+#include <sys/kmem.h>	// KVA_TO_PA, for the DMA addresses
 #include <UARTDrv.h>
 #include <GPIODrv.h>
 #include <system.h>
@@ -6,129 +8,908 @@
 #include <interrupt.h>
 #include <LED.h>
 
-// Circular buffer for receiving elements
-volatile uint8_t head = 0;
-volatile uint8_t tail = 0;
-volatile uint8_t receiveArray[256];
-uint8_t temp;
+// SFRs are followed by their CLR, SET and INV registers
+#define SFR_CLR		1
+#define SFR_SET		2
+
+// All UARTs have the same register layout, so the UART1 bit-field types fit any of them.
+typedef volatile __U1MODEbits_t UARTModeBits;
+typedef volatile __U1STAbits_t UARTStaBits;
+
+// Registers and pins of one UART, from GPIODrv.h
+typedef struct UARTDrvHwStruct {
+	UARTModeBits *mode;
+	UARTStaBits *sta;
+	volatile uint32_t *brg;
+	volatile uint32_t *txReg;
+	volatile uint32_t *rxReg;
+
+	volatile uint32_t *ipc;		// Interrupt priority register
+	uint32_t ipcPos;			// Position of UxIS in it, UxIP is right above
+	volatile uint32_t *iec;		// Interrupt enable register
+	volatile uint32_t *ifs;		// Interrupt flag register
+	uint32_t rxMask;			// RX bit, in both iec and ifs
+	uint32_t txMask;			// TX bit, in both iec and ifs
+
+	volatile uint32_t *rtsLat;	// 0 when the port has no RTS/CTS
+	uint32_t rtsPin;
+	volatile uint32_t *ctsPort;
+	uint32_t ctsPin;
+} UARTDrvHw;
+
+static const UARTDrvHw uartHw[UART_NUM_PORTS] = {
+	{	// Port_Console
+		(UARTModeBits *)&UART_MODE_bits, (UARTStaBits *)&UART_STA_bits,
+		&UART_BRG_reg, &UART_TX_reg, &UART_RX_reg,
+		&UART_INT_IPC_reg, UART_INT_IPC_POS,
+		&UART_INT_IEC_reg, &UART_INT_IFS_reg, UART_INT_RX_MASK, UART_INT_TX_MASK,
+		&UART_RTS_LATreg, UART_RTS_PIN, &UART_CTS_PORTreg, UART_CTS_PIN,
+	},
+	{	// Port_Aux
+		(UARTModeBits *)&UARTAUX_MODE_bits, (UARTStaBits *)&UARTAUX_STA_bits,
+		&UARTAUX_BRG_reg, &UARTAUX_TX_reg, &UARTAUX_RX_reg,
+		&UARTAUX_INT_IPC_reg, UARTAUX_INT_IPC_POS,
+		&UARTAUX_INT_IEC_reg, &UARTAUX_INT_IFS_reg, UARTAUX_INT_RX_MASK, UARTAUX_INT_TX_MASK,
+		0, 0, 0, 0,
+	},
+};
+
+// State of one UART
+typedef struct UARTDrvStateStruct {
+	const UARTDrvHw *hw;
+	UARTDrvRxMode rxMode;
+
+#if UART_RX_BUFFER_SIZE > 0
+	// Circular buffer for receiving elements
+	// In RxMode_Interrupt head is written by the UART ISR.
+	// In RxMode_DMA head is the DMA destination pointer, see UARTDrv_GetHead().
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	volatile uint8_t receiveArray[UART_RX_BUFFER_SIZE];
+	uint32_t taken;		// RxMode_DMA: bytes read out since the DMA started, see UARTDrv_DmaCheckLap()
+#endif
+
+	// Buffer attached with UARTDrv_RxAttach(), for RxMode_Direct.
+	// The ISR writes straight into it, and stops reading when it is full.
+	volatile uint8_t *rxBuffer;
+	volatile uint32_t rxBufferSize;
+	volatile uint32_t rxBufferCount;
+
+	// Circular buffer for transmitting elements
+	// txHead is written by UARTDrv_SendAsync(), txTail by the UART ISR.
+	volatile uint32_t txHead;
+	volatile uint32_t txTail;
+	volatile uint8_t transmitArray[UART_TX_BUFFER_SIZE];
+
+	// Hardware flow control. RTS is driven from the receive space left,
+	// TX is held while CTS is deasserted.
+	volatile uint8_t flowControl;
+	volatile uint8_t txPausedByCts;
+
+	// Receive errors. Counters, and UARTDrvError bits not yet taken by UARTDrv_TakeErrorEvents().
+	volatile UARTDrvErrors errors;
+	volatile uint8_t errorEvents;
+
+	volatile UARTDrvIsrStats isrStats;	// Receive interrupt cost
+	uint32_t baud;						// Current baud rate, for the idle timer
+	volatile uint8_t rxWatched;			// Receiving: RX interrupt at 3/4 FIFO, the idle timer gets the rest
+} UARTDrvState;
+
+static UARTDrvState uartPorts[UART_NUM_PORTS];
+
+volatile uint32_t rxBlockEvents = 0;	// Half/full ring events in DMA mode
+#if UART_RX_BUFFER_SIZE > 0
+static volatile uint32_t rxDmaBlocks = 0;	// Whole rings written by the DMA
+#endif
+
+#define RXIE_ON(p)		((p)->hw->iec[SFR_SET] = (p)->hw->rxMask)
+#define RXIE_OFF(p)		((p)->hw->iec[SFR_CLR] = (p)->hw->rxMask)
+#define TXIE_ON(p)		((p)->hw->iec[SFR_SET] = (p)->hw->txMask)
+#define TXIE_OFF(p)		((p)->hw->iec[SFR_CLR] = (p)->hw->txMask)
+
+#if UART_RX_BUFFER_SIZE > 0
+static uint32_t UARTDrv_GetHead(UARTDrvState *p);
+static uint32_t UARTDrv_DmaWritten();
+#endif
+
+// Receive space left, in whichever buffer the current mode uses
+static inline uint32_t UARTDrv_RxSpace(UARTDrvState *p){
+	if (p->rxMode == RxMode_Direct){
+		return p->rxBufferSize - p->rxBufferCount;	// 0 when nothing is attached
+	}
+#if UART_RX_BUFFER_SIZE > 0
+	if (p->rxMode == RxMode_DMA){
+		uint32_t unread = UARTDrv_DmaWritten() - p->taken;
+		return (unread < UART_RX_BUFFER_SIZE-1) ? (UART_RX_BUFFER_SIZE-1) - unread : 0;
+	}
+	return (UART_RX_BUFFER_SIZE-1) - ((UARTDrv_GetHead(p) - p->tail) & (UART_RX_BUFFER_SIZE-1));
+#else
+	return 0;
+#endif
+}
+
+static inline void UARTDrv_UpdateRts(UARTDrvState *p){
+	if (p->flowControl){
+		// Active low. Deassert at the high-water mark.
+		if (UARTDrv_RxSpace(p) <= UART_RTS_MARGIN){
+			p->hw->rtsLat[SFR_SET] = p->hw->rtsPin;
+		}
+		else{
+			p->hw->rtsLat[SFR_CLR] = p->hw->rtsPin;
+		}
+	}
+}
+
+// Common interrupt handler, for any port
+static void UARTDrv_Service(UARTDrvState *p){
+	const UARTDrvHw *hw = p->hw;
+
+	if ((*hw->iec & hw->rxMask) && (*hw->ifs & hw->rxMask)){
+		uint32_t start = GetCP0Count();
+		uint32_t bytes = 0;
+
+		// Clear first. A threshold crossed while draining then gets its own interrupt.
+		hw->ifs[SFR_CLR] = hw->rxMask;
+
+		// Drain the whole HW FIFO, not just the byte that raised the interrupt
+		while (hw->sta->URXDA){
+			if (p->rxMode == RxMode_Direct && p->rxBufferCount >= p->rxBufferSize){
+				break;	// Full, see below
+			}
+
+			// FERR and PERR belong to the byte at the top of the FIFO, check before reading it
+			if (hw->sta->FERR){
+				p->errors.framing++;
+				p->errorEvents |= Error_Framing;
+			}
+			if (hw->sta->PERR){
+				p->errors.parity++;
+				p->errorEvents |= Error_Parity;
+			}
+
+			if (p->rxMode == RxMode_Direct){
+				p->rxBuffer[p->rxBufferCount++] = *hw->rxReg;
+			}
+#if UART_RX_BUFFER_SIZE > 0
+			else if (((p->head+1) & (UART_RX_BUFFER_SIZE-1)) == p->tail){
+				// Buffer full
+				(void)*hw->rxReg;	// Readout data, otherwise we'll be stuck here
+				p->errors.dropped++;
+				p->errorEvents |= Error_Dropped;
+			}
+			else{
+				// If we have space, save into buffer
+				p->receiveArray[p->head] = *hw->rxReg;
+				p->head = (p->head+1) & (UART_RX_BUFFER_SIZE-1);
+			}
+#endif
+			bytes++;
+		}
+
+		if (p->rxMode == RxMode_Direct && p->rxBufferCount >= p->rxBufferSize){
+			// Full. Leave further data in the HW FIFO, until a new buffer is attached.
+			RXIE_OFF(p);
+		}
+
+		if (p->rxMode != RxMode_DMA){
+			// Data is coming in. Interrupt at 3/4 FIFO from now on, the idle timer
+			// picks up the rest. Its count starts over from the last byte read.
+			if (!p->rxWatched){
+				hw->sta->URXISEL = 0b10;
+				p->rxWatched = 1;
+			}
+			TMR2 = 0;
+			T2CONSET = _T2CON_ON_MASK;
+		}
+
+		if (hw->sta->OERR && !hw->sta->URXDA){
+			// Receiver stops on overrun. Restart it, once the FIFO is read out.
+			hw->sta->OERR = 0;
+			p->errors.overrun++;
+			p->errorEvents |= Error_Overrun;
+		}
+
+		UARTDrv_UpdateRts(p);
+
+		LED_toggle();
+
+		// Cost of the receive path. CP0 Count runs at half the CPU clock.
+		p->isrStats.calls++;
+		p->isrStats.bytes += bytes;
+		p->isrStats.cycles += 2*(GetCP0Count() - start);
+	}
+
+	if ((*hw->iec & hw->txMask) && (*hw->ifs & hw->txMask)
+		&& p->flowControl && (*hw->ctsPort & hw->ctsPin)){
+		// CTS deasserted (high). Hold off, UARTDrv_Poll() restarts TX.
+		TXIE_OFF(p);
+		p->txPausedByCts = 1;
+		hw->ifs[SFR_CLR] = hw->txMask;
+	}
+
+	if ((*hw->iec & hw->txMask) && (*hw->ifs & hw->txMask)){
+		// Top up the hardware FIFO from the ring
+		uint32_t tempTail = p->txTail;
+		while (!hw->sta->UTXBF && tempTail != p->txHead){
+			*hw->txReg = p->transmitArray[tempTail];
+			tempTail = (tempTail+1) & (UART_TX_BUFFER_SIZE-1);
+		}
+		p->txTail = tempTail;
+
+		if (tempTail == p->txHead){
+			// Nothing left, stop until UARTDrv_SendAsync() queues more
+			TXIE_OFF(p);
+		}
+
+		hw->ifs[SFR_CLR] = hw->txMask;
+	}
+}
+
+// Receive idle timeout. An idle port interrupts on the first byte. While data
+// comes in, the RX interrupt only fires at 3/4 FIFO, so the end of a burst
+// would stay in the FIFO. Timer 2 polls for it, by raising the RX flag of any
+// port with data waiting. The RX interrupt restarts the count, so while data
+// streams in, it only expires in the gaps. A port found without data is idle
+// again, and once none is receiving, the timer stops. So an idle line costs
+// no interrupts at all.
+INTERRUPT(Timer2Interrupt){
+	uint32_t receiving = 0;
+	uint32_t i;
+
+	for (i = 0; i < UART_NUM_PORTS; i++){
+		UARTDrvState *p = &uartPorts[i];
+		if (!p->rxWatched){
+			continue;
+		}
+		if (p->hw->sta->URXDA && (*p->hw->iec & p->hw->rxMask)){
+			p->hw->ifs[SFR_SET] = p->hw->rxMask;	// Same priority, runs right after this
+			receiving++;
+		}
+		else{
+			// Nothing waiting, or no buffer for it (UARTDrv_RxAttach() raises the flag then)
+			p->hw->sta->URXISEL = 0b00;
+			p->rxWatched = 0;
+		}
+	}
+	if (receiving == 0){
+		T2CONCLR = _T2CON_ON_MASK;
+	}
+	IFS0CLR = _IFS0_T2IF_MASK;
+}
+
+// Set the idle timer period to UART_RX_IDLE_CHARS at the fastest port's baud rate
+static void UARTDrv_UpdateIdleTimer(){
+	uint32_t timerClk = GetPeripheralClock()/8;		// 1:8 prescaler
+	uint32_t maxBaud = 0;
+	uint32_t period;
+	uint32_t i;
+
+	for (i = 0; i < UART_NUM_PORTS; i++){
+		if (uartPorts[i].hw != 0 && uartPorts[i].baud > maxBaud){
+			maxBaud = uartPorts[i].baud;
+		}
+	}
+	if (maxBaud == 0){
+		return;
+	}
+
+	period = (timerClk * (10*UART_RX_IDLE_CHARS)) / maxBaud;	// ~10 bits per character
+	if (period > timerClk/1000){
+		period = timerClk/1000;	// Latency below 1ms (one USB frame) doesn't help
+	}
+	if (period < 1){
+		period = 1;		// Above timerClk/40 baud. PR2 would wrap to 0xFFFF.
+	}
+
+	T2CONbits.ON = 0;
+	T2CONbits.TCKPS = 0b011;	// 1:8
+	T2CONbits.T32 = 0;
+	TMR2 = 0;
+	PR2 = period - 1;
+
+	IPC2bits.T2IP = 1;	// Same as the UARTs, so it never interrupts them
+	IPC2bits.T2IS = 0;
+	IFS0CLR = _IFS0_T2IF_MASK;
+	IEC0SET = _IEC0_T2IE_MASK;
+	for (i = 0; i < UART_NUM_PORTS; i++){
+		if (uartPorts[i].rxWatched){
+			T2CONSET = _T2CON_ON_MASK;	// Otherwise the next RX interrupt starts it
+		}
+	}
+}
 
 #if defined(__32MX270F256D__)
 INTERRUPT(UART2Interrupt){
+	UARTDrv_Service(&uartPorts[Port_Console]);
+}
+
+INTERRUPT(UART1Interrupt){
+	UARTDrv_Service(&uartPorts[Port_Aux]);
+}
 #elif defined(__32MX440F256H__)
 INTERRUPT(UART1Interrupt){
+	UARTDrv_Service(&uartPorts[Port_Console]);
+}
+
+INTERRUPT(UART2Interrupt){
+	UARTDrv_Service(&uartPorts[Port_Aux]);
+}
 #endif
 
-	// Should check if TX or RX interrupt
-	if ((uint8_t)(head+1) == tail){
-		// Buffer full
-		temp = UART_RX_reg;	// Readout data, otherwise we'll be stuck here
+#if UART_RX_BUFFER_SIZE > 0
+// DMA channel 0 is used for UART RX, on Port_Console.
+// It runs in auto-enable mode, so the ring never stops. The interrupt only
+// fires twice per ring (half and full block), instead of once per byte.
+// The vector is _DMA_0_VECTOR, see src/isrwrapper/ISRwrapper.S.
+INTERRUPT(DMA0Interrupt){
+	uint32_t flags = DCH0INT & 0xFF;
+
+	if (flags & (_DCH0INT_CHDHIF_MASK | _DCH0INT_CHBCIF_MASK)){
+		rxBlockEvents++;
+		LED_toggle();
 	}
-	else{
-		// If we have space, save into buffer
-		receiveArray[head++] = UART_RX_reg;
+	if (flags & _DCH0INT_CHBCIF_MASK){
+		rxDmaBlocks++;	// Counted together with the clear below, see UARTDrv_DmaWritten()
 	}
+	DCH0INTCLR = flags;	// Only the flags seen, a block end since then stays pending
+
+	UARTDrv_UpdateRts(&uartPorts[Port_Console]);	// Only this often in DMA mode
+
+	IFS1bits.DMA0IF = 0;
+}
 
-	LED_toggle();
+static void UARTDrv_InitRxDMA(UARTDrvState *p){
+	DCH0CONbits.CHEN = 0;	// Stop the channel, in case of re-init
+	while(DCH0CONbits.CHBUSY){ asm("nop"); }
+
+	DCH0CON = 0;
+	DCH0ECON = 0;
+	DCH0INT = 0;
+
+	DCH0SSA = KVA_TO_PA(&UART_RX_reg);				// Source is the RX register
+	DCH0DSA = KVA_TO_PA((void *)p->receiveArray);	// Destination is the ring
+	DCH0SSIZ = 1;						// One byte source
+	DCH0DSIZ = UART_RX_BUFFER_SIZE;		// Whole ring is one block (256 wraps to 0 == 256 on MX3/MX4)
+	DCH0CSIZ = 1;						// One byte per RX event
+
+	DCH0ECONbits.CHSIRQ = UART_RX_IRQ;	// Start transfer on UART RX event
+	DCH0ECONbits.SIRQEN = 1;
+
+	DCH0CONbits.CHPRI = 3;	// Highest priority - must keep up with the line
+	DCH0CONbits.CHAEN = 1;	// Auto-enable, restart at block end -> circular buffer
+
+	DCH0INTbits.CHDHIE = 1;	// Event when destination half full
+	DCH0INTbits.CHBCIE = 1;	// Event when block done (ring wraps)
+
+	IPC9bits.DMA0IP = 1;	// Priority = 1
+	IPC9bits.DMA0IS = 0;	// Subpriority = 0
+	IFS1bits.DMA0IF = 0;
+	IEC1bits.DMA0IE = 1;
+
+	rxDmaBlocks = 0;
+	p->taken = 0;
+
+	DMACONbits.ON = 1;
+	DCH0CONbits.CHEN = 1;
+}
+
+// Bytes written by the DMA since it started. Free running, wraps at 2^32
+// like p->taken, so the difference of the two is the unread count.
+// Block ends are counted by the ISR, so it has to run at least once a ring.
+static uint32_t UARTDrv_DmaWritten(){
+	uint32_t dmaie = IEC1 & _IEC1_DMA0IE_MASK;
+	uint32_t blocks;
+	uint32_t ptr;
+
+	IEC1CLR = _IEC1_DMA0IE_MASK;	// rxDmaBlocks and CHBCIF change together in the ISR
+	do{
+		// A block end the ISR hasn't counted yet is still pending in CHBCIF
+		blocks = rxDmaBlocks + DCH0INTbits.CHBCIF;
+		ptr = DCH0DPTR & (UART_RX_BUFFER_SIZE-1);
+	} while (blocks != rxDmaBlocks + DCH0INTbits.CHBCIF);	// Ring wrapped between the two reads
+	if (dmaie){
+		IEC1SET = _IEC1_DMA0IE_MASK;
+	}
+	return blocks*UART_RX_BUFFER_SIZE + ptr;
+}
+
+// The DMA never stops, so it overwrites unread data once it gets a whole ring
+// ahead of the reader. What is left in the ring then can't be told apart from
+// new data, so it is all dropped, and reading carries on at the DMA.
+// Return the unread count.
+static uint32_t UARTDrv_DmaCheckLap(UARTDrvState *p){
+	uint32_t written = UARTDrv_DmaWritten();
+	uint32_t unread = written - p->taken;
+
+	if (unread >= UART_RX_BUFFER_SIZE){
+		p->errors.dropped += unread;
+		p->errorEvents |= Error_Dropped;
+		p->taken = written;
+		p->tail = written & (UART_RX_BUFFER_SIZE-1);
+		unread = 0;
+	}
+	return unread;
+}
+
+// Current write position in the ring.
+static uint32_t UARTDrv_GetHead(UARTDrvState *p){
+	if (p->rxMode == RxMode_DMA){
+		return UARTDrv_DmaWritten() & (UART_RX_BUFFER_SIZE-1);
+	}
+	return p->head;
+}
+#endif
+
+static void UARTDrv_InitPins(UARTDrvPort port){
+	if (port == Port_Console){
+		UART_TX_TRISbits.UART_TX_TRISPIN = 0;	// 0 == output
+		UART_TX_LATbits.UART_TX_LATPIN = 1;		// Set high, as UART is Idle High
+		#ifdef UART_TX_RP_REG
+			UART_TX_RP_REG = UART_TX_RP_VAL;		// Remap to proper pin
+		#endif
+
+		UART_RX_TRISbits.UART_RX_TRISPIN = 1;						// 1 == input
+		#ifdef UART_RX_PULLREG
+			UART_RX_PULLREG = UART_RX_PULLREG | UART_RX_PULLBIT;	// Enable pull-up
+		#endif
+		#ifdef UART_RX_REMAP_REG
+			UART_RX_REMAP_REG = UART_RX_REMAP_VAL;					// Set to which pin
+		#endif
+
+		UART_RTS_LATreg = UART_RTS_LATreg & ~UART_RTS_PIN;		// Asserted (active low)
+		UART_RTS_TRISreg = UART_RTS_TRISreg & ~UART_RTS_PIN;	// 0 == output
+		UART_CTS_TRISreg = UART_CTS_TRISreg | UART_CTS_PIN;		// 1 == input
+		#ifdef UART_CTS_PULLREG
+			UART_CTS_PULLREG = UART_CTS_PULLREG | UART_CTS_PIN;	// Enable pull-up
+		#endif
+	}
+	else{
+		UARTAUX_TX_TRISbits.UARTAUX_TX_TRISPIN = 0;
+		UARTAUX_TX_LATbits.UARTAUX_TX_LATPIN = 1;
+		#ifdef UARTAUX_TX_RP_REG
+			UARTAUX_TX_RP_REG = UARTAUX_TX_RP_VAL;
+		#endif
 
-	UART_INT_IFS_bits.UART_INT_IFS_RXIF = 0;
+		UARTAUX_RX_TRISbits.UARTAUX_RX_TRISPIN = 1;
+		#ifdef UARTAUX_RX_PULLREG
+			UARTAUX_RX_PULLREG = UARTAUX_RX_PULLREG | UARTAUX_RX_PULLBIT;
+		#endif
+		#ifdef UARTAUX_RX_REMAP_REG
+			UARTAUX_RX_REMAP_REG = UARTAUX_RX_REMAP_VAL;
+		#endif
+	}
 }
 
+void UARTDrv_Init(UARTDrvPort port, uint32_t baud, UARTDrvRxMode mode){
+	UARTDrvState *p = &uartPorts[port];
+	const UARTDrvHw *hw = &uartHw[port];
+
+	p->hw = hw;
+	hw->mode->ON = 0;
+	hw->iec[SFR_CLR] = hw->rxMask | hw->txMask;
+#if UART_RX_BUFFER_SIZE > 0
+	if (port == Port_Console){
+		DCH0CONbits.CHEN = 0;
+		IEC1bits.DMA0IE = 0;
+	}
+	else if (mode == RxMode_DMA){
+		mode = RxMode_Interrupt;	// Only one DMA channel is set up
+	}
+	p->head = 0;
+	p->tail = 0;
+#else
+	mode = RxMode_Direct;	// The ring is compiled out, nothing else can receive
+#endif
+
+	p->rxBuffer = 0;
+	p->rxBufferSize = 0;
+	p->rxBufferCount = 0;
+	p->txHead = 0;
+	p->txTail = 0;
+	p->flowControl = 0;
+	p->txPausedByCts = 0;
+	p->errorEvents = 0;
+	UARTDrv_ClearErrors(port);
+	UARTDrv_ClearIsrStats(port);
+	p->rxMode = mode;
+
+	UARTDrv_InitPins(port);
+
+	hw->mode->SIDL = 0;		// Stop when in IDLE mode
+	hw->mode->IREN = 0;		// Disable IrDA
+	hw->mode->RTSMD = 0;	// Don't care, RTS not used by the peripheral
+	hw->mode->UEN = 0;		// TX & RX controlled by UART peripheral, RTS & CTS are GPIO (see UARTDrv_SetFlowControl())
+	hw->mode->WAKE = 0;		// Don't wake up from sleep
+	hw->mode->LPBACK = 0;	// Loopback mode disabled
+	hw->mode->ABAUD = 0;	// No autobauding
+	hw->mode->RXINV = 0;	// Idle HIGH
+	// BRGH, PDSEL, STSEL and BRG are set by UARTDrv_Configure()
+
+	hw->sta->ADM_EN = 0;	// Don't care for auto address detection, unused
+	hw->sta->ADDR = 0;		// Don't care for auto address mark
+	hw->sta->UTXISEL = 00;	// Generate interrupt, when at least one space available
+	hw->sta->UTXINV = 0;	// Idle HIGH
+	hw->sta->URXEN = 1;		// UART receiver pin enabled
+	hw->sta->UTXBRK = 0;	// Don't send breaks.
+	hw->sta->UTXEN = 1;		// Uart transmitter pin enabled
+	if (mode == RxMode_DMA){
+		hw->sta->URXISEL = 0b00;	// Interrupt what receiver buffer not empty (the DMA trigger, one byte per event)
+	}
+	else{
+		hw->sta->URXISEL = 0b00;	// Idle: interrupt on the first byte, see Timer2Interrupt()
+	}
+	p->rxWatched = 0;
+	hw->sta->ADDEN = 0;		// Address detect mode disabled (unused)
+	hw->sta->OERR = 0;		// Clear RX Overrun bit - not important at this point
+
+	// Setup interrupt. Priority = 1, subpriority = 0
+	hw->ipc[SFR_CLR] = 0x1F << hw->ipcPos;
+	hw->ipc[SFR_SET] = (1 << 2) << hw->ipcPos;
+	hw->ifs[SFR_CLR] = hw->rxMask | hw->txMask;	// TX interrupt is enabled by UARTDrv_SendAsync()
 
-void UARTDrv_Init(uint32_t baud){
-	UART_MODE_bits.ON = 0;
+	if (mode == RxMode_Direct){
+		// Enabled by UARTDrv_RxAttach(), once there is somewhere to put the data
+	}
+#if UART_RX_BUFFER_SIZE > 0
+	else if (mode == RxMode_DMA){
+		// The RX event still triggers the DMA, even with the interrupt disabled.
+		UARTDrv_InitRxDMA(p);
+	}
+	else{
+		RXIE_ON(p);		// Enable interrupt.
+	}
+#endif
 
-	UART_TX_TRISbits.UART_TX_TRISPIN = 0;	// 0 == output
-	UART_TX_LATbits.UART_TX_LATPIN = 1;		// Set high, as UART is Idle High
-	#ifdef UART_TX_RP_REG
-		UART_TX_RP_REG = UART_TX_RP_VAL;		// Remap to proper pin
-	#endif
+	UARTDrv_Configure(port, baud, 8, Parity_None, 1);	// Also turns the UART on
+}
 
-	UART_RX_TRISbits.UART_TX_TRISPIN = 1;						// 1 == input
-	#ifdef UART_RX_PULLREG
-		UART_RX_PULLREG = UART_RX_PULLREG | UART_RX_PULLBIT;	// Enable pull-up
-	#endif
+// Find the closest BRG value for baud, in either clock mode.
+// Return the baud rate actually achieved, 0 if out of range.
+static uint32_t UARTDrv_CalcBRG(uint32_t pbClk, uint32_t baud, uint32_t *brg, uint8_t *brgh){
+	uint32_t bestBaud = 0;
+	uint64_t bestError = 0;
+	uint32_t bestClocks = 1;
+	uint8_t highSpeed;
 
-	#ifdef UART_RX_REMAP_VAL
-		U2RXR = UART_RX_REMAP_VAL;									// Set to which pin
-	#endif
+	// Standard speed (16x) first - on a tie it wins, as it samples 3 times per bit.
+	for (highSpeed = 0; highSpeed < 2; highSpeed++){
+		uint32_t clocksPerBit = highSpeed ? 4 : 16;
+		// (PBCLK/(BRGH?4:16))/BAUD, rounded to nearest
+		uint32_t divisor = (pbClk + (clocksPerBit*baud)/2) / (clocksPerBit*baud);
+		uint32_t clocks = clocksPerBit*divisor;		// PBCLK cycles per bit
+		uint64_t wanted = (uint64_t)baud*clocks;
+		uint64_t error;
 
-	UART_MODE_bits.SIDL = 0;	// Stop when in IDLE mode
-	UART_MODE_bits.IREN	= 0;	// Disable IrDA
-	UART_MODE_bits.RTSMD = 0;	// Don't care, RTS not used
-	UART_MODE_bits.UEN = 0;		// TX & RX controlled by UART peripheral, RTC & CTS are not.
-	UART_MODE_bits.WAKE = 0;	// Don't wake up from sleep
-	UART_MODE_bits.LPBACK = 0;	// Loopback mode disabled
-	UART_MODE_bits.ABAUD = 0;	// No autobauding
-	UART_MODE_bits.RXINV = 0;	// Idle HIGH
-	UART_MODE_bits.BRGH = 0;	// Standard speed mode - 16x baud clock
-	UART_MODE_bits.PDSEL = 0;	// 8 bits, no parity
-	UART_MODE_bits.STSEL = 0;	// 1 stop bit
+		if (divisor < 1 || divisor > 0x10000){
+			continue;	// BRG is 16 bits
+		}
+		// Rate error times clocks. Compared exactly, the rounded down rates
+		// can tie while one mode is closer.
+		error = (wanted > pbClk) ? (wanted - pbClk) : (pbClk - wanted);
+		if (bestBaud == 0 || error*bestClocks < bestError*clocks){
+			bestError = error;
+			bestClocks = clocks;
+			bestBaud = pbClk / clocks;
+			*brg = divisor - 1;
+			*brgh = highSpeed;
+		}
+	}
+	return bestBaud;
+}
+
+// Check a line setting and work out its registers.
+// Return the baud rate it would get, 0 if it isn't supported.
+static uint32_t UARTDrv_CalcConfig(uint32_t baud, uint8_t dataBits, UARTDrvParity parity, uint8_t stopBits,
+		uint32_t *brg, uint8_t *brgh, uint8_t *pdsel){
+	uint32_t pbClk = GetPeripheralClock();
 
-	UART_STA_bits.ADM_EN = 0;	// Don't care for auto address detection, unused
-	UART_STA_bits.ADDR = 0;		// Don't care for auto address mark
-	UART_STA_bits.UTXISEL = 00;	// Generate interrupt, when at least one space available (unused)
-	UART_STA_bits.UTXINV = 0;	// Idle HIGH
-	UART_STA_bits.URXEN = 1;	// UART receiver pin enabled
-	UART_STA_bits.UTXBRK = 0;	// Don't send breaks.
-	UART_STA_bits.UTXEN = 1;	// Uart transmitter pin enabled
-	UART_STA_bits.URXISEL = 0;	// Interrupt what receiver buffer not empty
-	UART_STA_bits.ADDEN = 0;	// Address detect mode disabled (unused)
-	UART_STA_bits.OERR = 0;		// Clear RX Overrun bit - not important at this point
+	// PDSEL: 00 = 8N, 01 = 8E, 10 = 8O, 11 = 9N
+	if (dataBits == 8 && parity == Parity_None){
+		*pdsel = 0b00;
+	}
+	else if (dataBits == 8 && parity == Parity_Even){
+		*pdsel = 0b01;
+	}
+	else if (dataBits == 8 && parity == Parity_Odd){
+		*pdsel = 0b10;
+	}
+	else if (dataBits == 9 && parity == Parity_None){
+		*pdsel = 0b11;
+	}
+	else{
+		return 0;
+	}
+	if (stopBits != 1 && stopBits != 2){
+		return 0;
+	}
+	if (baud == 0 || baud > pbClk/4){
+		return 0;
+	}
 
-	// (PBCLK/BRGH?4:16)/BAUD - 1
-	UART_BRG_reg = (GetPeripheralClock() / (U2MODEbits.BRGH ? 4 : 16)) / baud - 1;
+	return UARTDrv_CalcBRG(pbClk, baud, brg, brgh);
+}
 
-	// Setup interrupt - Split into new function fer easier ifdef-ing?
-	UART_INT_IPC_bits.UART_INT_IPC_PRIORITY		= 1;	// Priority = 1
-	UART_INT_IPC_bits.UART_INT_IPC_SUBPRIORITY 	= 0;	// Subpriority = 0;
-	UART_INT_IEC_bits.UART_INT_IEC_RXIE			= 1;	// Enable interrupt.
+uint32_t UARTDrv_CheckConfig(uint32_t baud, uint8_t dataBits, UARTDrvParity parity, uint8_t stopBits){
+	// Would UARTDrv_Configure() take this setting? Touches nothing, so it can run from any interrupt.
+	// Return the baud rate it would get, 0 if it isn't supported.
+	uint32_t brg;
+	uint8_t brgh;
+	uint8_t pdsel;
 
-	UART_MODE_bits.ON = 1;
+	return UARTDrv_CalcConfig(baud, dataBits, parity, stopBits, &brg, &brgh, &pdsel);
 }
 
-void UARTDrv_SendBlocking(uint8_t * buffer, uint32_t length){
+uint32_t UARTDrv_Configure(UARTDrvPort port, uint32_t baud, uint8_t dataBits, UARTDrvParity parity, uint8_t stopBits){
+	// Apply a new line setting. From the main loop, not from an interrupt: it
+	// turns the UART off and back on, and sets up the idle timer again.
+	// Return the baud rate actually achieved, 0 if the setting isn't supported (nothing is changed then).
+	const UARTDrvHw *hw = &uartHw[port];
+	uint32_t brg = 0;
+	uint8_t brgh = 0;
+	uint8_t pdsel;
+	uint32_t actual;
+
+	actual = UARTDrv_CalcConfig(baud, dataBits, parity, stopBits, &brg, &brgh, &pdsel);
+	if (actual == 0){
+		return 0;
+	}
+
+	// Settings only change safely with the module off. This drops the HW FIFOs,
+	// the TX ring is kept, and carries on when the module is back on.
+	hw->mode->ON = 0;
+	hw->mode->BRGH = brgh;			// 0 = 16x baud clock, 1 = 4x baud clock (high speed)
+	hw->mode->PDSEL = pdsel;
+	hw->mode->STSEL = (stopBits == 2);
+	*hw->brg = brg;
+	hw->mode->ON = 1;
+	hw->sta->URXEN = 1;
+	hw->sta->UTXEN = 1;
 
+	uartPorts[port].baud = actual;
+	UARTDrv_UpdateIdleTimer();
+
+	return actual;
+}
+
+void UARTDrv_SendBlocking(UARTDrvPort port, uint8_t * buffer, uint32_t length){
+	const UARTDrvHw *hw = &uartHw[port];
+	UARTDrvState *p = &uartPorts[port];
 	uint32_t counter = 0;
 
+	// Let anything queued with UARTDrv_SendAsync() go out first. The ISR may be
+	// held off by CTS with bytes left in the ring (TX interrupt off), so wait for
+	// the ring itself, and let UARTDrv_Poll() restart it.
+	while(p->txTail != p->txHead){
+		UARTDrv_Poll();
+	}
+
 	for (counter = 0; counter<length; counter++){
-		while(UART_STA_bits.UTXBF){ asm("nop"); }
-		UART_TX_reg = buffer[counter];
+		while(hw->sta->UTXBF){ asm("nop"); }
+		*hw->txReg = buffer[counter];
 	}
 
-	// Wait until sent
-	while(UART_STA_bits.TRMT){
+	// Wait until sent (TRMT == 1 when the shift register is empty)
+	while(!hw->sta->TRMT){
 		_nop();
 	}
 }
 
-uint32_t UARTDrv_GetCount(){
-	uint32_t tempHead = head;
-	uint32_t tempTail = tail;
-	if (tempHead == tempTail){
-		return 0;
+uint32_t UARTDrv_TxFree(UARTDrvPort port){
+	// One slot is always left empty, to tell full from empty
+	UARTDrvState *p = &uartPorts[port];
+	return (UART_TX_BUFFER_SIZE-1) - ((p->txHead - p->txTail) & (UART_TX_BUFFER_SIZE-1));
+}
+
+uint32_t UARTDrv_SendAsync(UARTDrvPort port, const uint8_t *buffer, uint32_t length){
+	// Queue as much as fits into the ring, and return immediately.
+	// Return number of Bytes queued.
+	UARTDrvState *p = &uartPorts[port];
+	uint32_t tempHead = p->txHead;
+	uint32_t counter = 0;
+	uint32_t space = UARTDrv_TxFree(port);
+
+	for (counter = 0; counter<length && counter<space; counter++){
+		p->transmitArray[tempHead] = buffer[counter];
+		tempHead = (tempHead+1) & (UART_TX_BUFFER_SIZE-1);
 	}
-	else if (tempHead > tempTail){
-		return (tempHead-tempTail);
+	p->txHead = tempHead;
+
+	if (counter > 0){
+		// (Re)start draining. The flag is set while there's space in the FIFO.
+		TXIE_ON(p);
 	}
-	else{
-		return (sizeof(receiveArray) - tempTail + tempHead);
+	return counter;
+}
+
+void UARTDrv_RxAttach(UARTDrvPort port, uint8_t *buffer, uint32_t size){
+	// Give the receiver a buffer to fill directly (RxMode_Direct)
+	UARTDrvState *p = &uartPorts[port];
+
+	RXIE_OFF(p);
+	p->rxBuffer = buffer;
+	p->rxBufferSize = size;
+	p->rxBufferCount = 0;
+	UARTDrv_UpdateRts(p);
+	if (size > 0){
+		if (p->hw->sta->URXDA){
+			p->hw->ifs[SFR_SET] = p->hw->rxMask;	// Anything waiting in the HW FIFO comes in now
+		}
+		RXIE_ON(p);
 	}
+}
 
+uint32_t UARTDrv_RxDetach(UARTDrvPort port){
+	// Take the buffer back from the receiver.
+	// Return number of Bytes written into it.
+	UARTDrvState *p = &uartPorts[port];
+	uint32_t count;
+
+	RXIE_OFF(p);	// ISR can't run past this point
+	count = p->rxBufferCount;
+	p->rxBuffer = 0;
+	p->rxBufferSize = 0;
+	p->rxBufferCount = 0;
+	UARTDrv_UpdateRts(p);	// Nowhere to put data until the next attach
+	return count;
 }
 
-uint32_t UARTDrv_GetReceiveData(uint8_t *copyTo, uint8_t maxSize){
+uint32_t UARTDrv_GetCount(UARTDrvPort port){
+	UARTDrvState *p = &uartPorts[port];
+
+	if (p->rxMode == RxMode_Direct){
+		return p->rxBufferCount;
+	}
+#if UART_RX_BUFFER_SIZE > 0
+	if (p->rxMode == RxMode_DMA){
+		return UARTDrv_DmaCheckLap(p);
+	}
+	uint32_t tempHead = UARTDrv_GetHead(p);
+	uint32_t tempTail = p->tail;
+	// Size is a power of 2, so this also handles the wrap
+	return (tempHead - tempTail) & (UART_RX_BUFFER_SIZE-1);
+#else
+	return 0;
+#endif
+}
+
+uint32_t UARTDrv_GetReceiveData(UARTDrvPort port, uint8_t *copyTo, uint32_t maxSize){
 	// Copy a max of maxSize into copyTo array.
 	// Return number of Bytes received from the array
-	uint8_t tempHead = head;
-	uint8_t tempTail = tail;
-	uint8_t counter = 0;
+#if UART_RX_BUFFER_SIZE > 0
+	UARTDrvState *p = &uartPorts[port];
+
+	if (p->rxMode == RxMode_Direct){
+		return 0;	// Data is already in the attached buffer
+	}
+	if (p->rxMode == RxMode_DMA){
+		UARTDrv_DmaCheckLap(p);
+	}
+
+	uint32_t tempHead = UARTDrv_GetHead(p);
+	uint32_t tempTail = p->tail;
+	uint32_t counter = 0;
 	for (counter = 0; counter<maxSize && tempTail != tempHead; ){
-		copyTo[counter] = receiveArray[tempTail];
+		copyTo[counter] = p->receiveArray[tempTail];
 
 		counter++;
-		tempTail++;	// Relying on uint8_t overflow
+		tempTail = (tempTail+1) & (UART_RX_BUFFER_SIZE-1);
 	}
-	tail = tempTail;
+
+	if (p->rxMode == RxMode_DMA){
+		if (UARTDrv_DmaWritten() - p->taken > UART_RX_BUFFER_SIZE){
+			// Lapped while copying, the first bytes may already be new data
+			UARTDrv_DmaCheckLap(p);		// Drops them with the rest
+			UARTDrv_UpdateRts(p);
+			return 0;
+		}
+		p->taken += counter;
+	}
+	p->tail = tempTail;
+	UARTDrv_UpdateRts(p);
 	return counter;
+#else
+	return 0;
+#endif
+}
+
+void UARTDrv_SetFlowControl(UARTDrvPort port, uint8_t enable){
+	UARTDrvState *p = &uartPorts[port];
+
+	if (p->hw->rtsLat == 0){
+		return;		// No RTS/CTS pins on this port
+	}
+	p->flowControl = enable;
+	if (enable){
+		UARTDrv_UpdateRts(p);
+	}
+	else{
+		p->hw->rtsLat[SFR_CLR] = p->hw->rtsPin;	// Leave asserted
+		UARTDrv_Poll();		// Release TX, if it was held
+	}
 }
 
+void UARTDrv_SetRts(UARTDrvPort port, uint8_t asserted){
+	// Manual RTS control, only when flow control is off
+	UARTDrvState *p = &uartPorts[port];
+
+	if (p->hw->rtsLat != 0 && !p->flowControl){
+		p->hw->rtsLat[asserted ? SFR_CLR : SFR_SET] = p->hw->rtsPin;	// Active low
+	}
+}
+
+void UARTDrv_Poll(){
+	// Call periodically. Restarts TX once CTS is asserted again.
+	uint32_t i;
+
+	for (i = 0; i < UART_NUM_PORTS; i++){
+		UARTDrvState *p = &uartPorts[i];
+		if (p->txPausedByCts && (!p->flowControl || !(*p->hw->ctsPort & p->hw->ctsPin))){
+			p->txPausedByCts = 0;
+			TXIE_ON(p);		// Also fine if the ring is empty, ISR turns it off
+		}
+#if UART_RX_BUFFER_SIZE > 0
+		if (p->rxMode == RxMode_DMA && p->hw->sta->OERR){
+			// No RX interrupt in DMA mode, so overruns are caught here
+			p->hw->sta->OERR = 0;
+			p->errors.overrun++;
+			p->errorEvents |= Error_Overrun;
+		}
+#endif
+	}
+}
+
+void UARTDrv_GetErrors(UARTDrvPort port, UARTDrvErrors *copyTo){
+	UARTDrvState *p = &uartPorts[port];
+
+	copyTo->dropped = p->errors.dropped;
+	copyTo->overrun = p->errors.overrun;
+	copyTo->framing = p->errors.framing;
+	copyTo->parity = p->errors.parity;
+}
+
+void UARTDrv_ClearErrors(UARTDrvPort port){
+	UARTDrvState *p = &uartPorts[port];
+
+	p->errors.dropped = 0;
+	p->errors.overrun = 0;
+	p->errors.framing = 0;
+	p->errors.parity = 0;
+}
+
+uint8_t UARTDrv_TakeErrorEvents(UARTDrvPort port){
+	// Return the UARTDrvError bits seen since the last call, and clear them.
+	UARTDrvState *p = &uartPorts[port];
+	uint32_t rxie = *p->hw->iec & p->hw->rxMask;
+	uint8_t events;
+
+	RXIE_OFF(p);	// The ISR also sets bits
+	events = p->errorEvents;
+	p->errorEvents = 0;
+	if (rxie){
+		RXIE_ON(p);
+	}
+	return events;
+}
+
+void UARTDrv_GetIsrStats(UARTDrvPort port, UARTDrvIsrStats *copyTo){
+	UARTDrvState *p = &uartPorts[port];
+	uint32_t rxie = *p->hw->iec & p->hw->rxMask;
+
+	// Consistent from the main loop. From the USB ISR (IPL7) the UART ISR may
+	// have been cut off midway, and calls can be one ahead of bytes and cycles.
+	RXIE_OFF(p);
+	copyTo->calls = p->isrStats.calls;
+	copyTo->bytes = p->isrStats.bytes;
+	copyTo->cycles = p->isrStats.cycles;
+	if (rxie){
+		RXIE_ON(p);
+	}
+}
+
+void UARTDrv_ClearIsrStats(UARTDrvPort port){
+	UARTDrvState *p = &uartPorts[port];
+
+	p->isrStats.calls = 0;
+	p->isrStats.bytes = 0;
+	p->isrStats.cycles = 0;
+}
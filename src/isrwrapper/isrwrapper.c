@@ -68,6 +68,7 @@
     // OTHER
     void RTCCInterrupt() __attribute__ ((weak, alias ("__DoNothing")));
     void USBInterrupt() __attribute__ ((weak, alias ("__DoNothing")));
+    void DMA0Interrupt() __attribute__ ((weak, alias ("__DoNothing")));
 
     void _general_exception_handler() __attribute__ ((weak, alias ("__DoNothing")));
 #else
@@ -225,6 +226,10 @@
     void USBInterrupt(void) { Nop(); }
     #endif
 
+    #ifndef __DMA__
+    void DMA0Interrupt(void) { Nop(); }
+    #endif
+
 #endif
 
 #endif // ISRWRAPPER_C
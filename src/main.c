@@ -16,20 +16,54 @@
 #include <UARTDrv.h>
 #include <BTN.h>
 #include <LED.h>
+#include <COMMS.h>
 // USB
 #include <usb.h>
 #include <usb_config.h>
 #include <usb_ch9.h>
 #include <usb_cdc.h>
+#include <usb_priv.h>	// usb_disable_transaction_interrupt()
+#include <vendor.h>
 
+#define MIN(x,y) (((x)<(y))?(x):(y))
 
 
 
 volatile char tempArray[128];
 volatile uint8_t lengthArray = 0;
-#ifdef MULTI_CLASS_DEVICE
-static uint8_t cdc_interfaces[] = { 0 };
+
+// One CDC ACM function per UART port. Interfaces 2*port and 2*port+1.
+static const uint8_t bridgeDataEp[UART_NUM_PORTS] = { 2, 4 };	// Bulk IN/OUT endpoint of each port
+static const uint8_t bridgeDataLen[UART_NUM_PORTS] = { EP_2_IN_LEN, EP_4_IN_LEN };
+static const uint8_t bridgeNotifyEp[UART_NUM_PORTS] = { 1, 3 };	// Interrupt IN endpoint of each port
+static uint8_t uartErrorsPending[UART_NUM_PORTS];	// UARTDrvError bits not yet sent to the host
+
+static bool uartRxAttached[UART_NUM_PORTS];	// An IN buffer is attached to the UART receiver
+static uint32_t uartRxSize[UART_NUM_PORTS];		// Size of the attached buffer
+
+// Line coding of each port, as the host set it. SET_LINE_CODING comes in the USB
+// interrupt, the UART is reconfigured from the main loop.
+static struct cdc_line_coding line_coding[UART_NUM_PORTS] =
+{
+	{ 115200, CDC_CHAR_FORMAT_1_STOP_BIT, CDC_PARITY_NONE, 8, },
+	{ 115200, CDC_CHAR_FORMAT_1_STOP_BIT, CDC_PARITY_NONE, 8, },
+};
+static volatile bool lineCodingPending[UART_NUM_PORTS];	// line_coding not applied to the UART yet
+
+// IN packet coalescing. A partial packet is held for up to coalesceFrames SOFs,
+// so a fast stream fills whole packets, while a slow one still gets out in time.
+static uint8_t coalesceFrames = BRIDGE_COALESCE_FRAMES_DEFAULT;
+static volatile uint8_t rxFramesWaiting[UART_NUM_PORTS];	// SOFs seen while the attached buffer held data
+static struct bridge_stats bridgeStats[UART_NUM_PORTS];
+
+// Worst case token-to-service latency, in CPU cycles (CP0 Count runs at half the CPU clock).
+// Polling: the longest gap between two usb_service() calls.
+// Interrupts: the longest time the main loop held the USB interrupt off.
+static volatile uint32_t usbLatencyMax = 0;
+#ifndef USB_USE_INTERRUPTS
+static uint32_t usbLastService = 0;	// Polling: CP0 Count after the last usb_service()
 #endif
+static uint32_t usbLockStart = 0;	// Interrupts: CP0 Count at bridge_lock()
 
 // TODO - run the timer, like in MX440 example (SysTick style)
 void simpleDelay(unsigned int noOfLoops){
@@ -62,7 +96,9 @@ void setup(){
 
 	LED_init();
 	BTN_init();
-	UARTDrv_Init(115200);
+	UARTDrv_Init(Port_Console, 115200, RxMode_Direct);	// RX goes straight into the EP2 IN buffers
+	UARTDrv_Init(Port_Aux, 115200, RxMode_Direct);		// And EP4 IN
+	COMMS_init();		// Programmer, target pins released
 
 	// Enable DMA. This was enabled during testing USB, TODO check.
 	DMACONbits.ON = 1;
@@ -70,12 +106,11 @@ void setup(){
 	// Enable interrupts
 	INTEnableSystemMultiVectoredInt();
 
-	// Copied for USB, from hardware.c
-	// TODO, make generic, make proper.
+	// USB at IPL7, above the UARTs. Only bridge_lock() holds it off.
 #if defined (__32MX270F256D__)
-	IPC7bits.USBIP = 4;
+	IPC7bits.USBIP = 7;
 #elif defined(__32MX440F256H__)
-	IPC11bits.USBIP = 4;
+	IPC11bits.USBIP = 7;
 #endif
 
 
@@ -96,61 +131,211 @@ static void send_string_sync(uint8_t endpoint, const char *str)
 }
 */
 
-int main(){
+// The bridge shares endpoint state with the USB ISR, and the UART receive
+// buffers and line coding with its reset, SOF and line coding callbacks. Hold
+// off the whole USB interrupt while it works on them. Not nestable.
+static void bridge_lock(void)
+{
+	usb_disable_interrupt();
+	usbLockStart = GetCP0Count();
+}
 
+static void bridge_unlock(void)
+{
+#ifdef USB_USE_INTERRUPTS
+	uint32_t held = 2*(GetCP0Count() - usbLockStart);
+	if (held > usbLatencyMax) {
+		usbLatencyMax = held;	// An event at the start waited this long
+	}
+#endif
+	usb_enable_interrupt();
+}
 
-	setup();
-	usb_init();
+// Tell the host about receive errors, with a CDC SERIAL_STATE notification.
+// Overrun, framing and parity are one-shot bits. They are sent set once per batch of errors.
+static void bridge_notify(UARTDrvPort port)
+{
+	uint8_t ep = bridgeNotifyEp[port];
+	struct cdc_serial_state_notification *n;
+	uint8_t events;
+
+	uartErrorsPending[port] |= UARTDrv_TakeErrorEvents(port);
+	events = uartErrorsPending[port];
+	if (events == 0 || usb_in_endpoint_halted(ep) || usb_in_endpoint_busy(ep)) {
+		return;	// Nothing to say, or try again on the next pass
+	}
 
-	// A very basic USB-UART example.
-	// Currently everything is hardcoded. Will be expanded later.
+	n = (struct cdc_serial_state_notification *)usb_get_in_buffer(ep);
+	n->header.REQUEST.bmRequestType = 0xA1;	// Device to host, class, interface
+	n->header.bNotification = CDC_SERIAL_STATE;
+	n->header.wValue = 0;
+	n->header.wIndex = 2*port;	// Communication interface of the port
+	n->header.wLength = sizeof(n->data);
+	n->data.serial_state = 0;
+	n->data.bits.bRxCarrier = 1;	// No DCD/DSR lines, report them as always on
+	n->data.bits.bTxCarrier = 1;
+	n->data.bits.bOverrun = (events & (Error_Overrun | Error_Dropped)) ? 1 : 0;
+	n->data.bits.bFraming = (events & Error_Framing) ? 1 : 0;
+	n->data.bits.bParity = (events & Error_Parity) ? 1 : 0;
+	usb_send_in_buffer(ep, sizeof(*n));
+
+	uartErrorsPending[port] = 0;
+}
 
-	for(;;){
+// Move data between one UART port and its CDC data endpoint
+static void bridge_service(UARTDrvPort port)
+{
+	uint8_t ep = bridgeDataEp[port];
+
+	bridge_lock();
 
-		// Send data to the PC if anything in buffer
-		if (usb_is_configured() && !usb_in_endpoint_halted(2) && !usb_in_endpoint_busy(2) && (UARTDrv_GetCount() > 0)) {
-
-			uint32_t i;
-			uint8_t *buf = usb_get_in_buffer(2);
-			// Copy from UART buffer to buffer provided by USB
-			// TODO, check length
-			i = UARTDrv_GetReceiveData(buf, EP_2_LEN-1);	// Send one less than the Endpoint length. - saves us doig a 0 length transaction
-			usb_send_in_buffer(2, i);	// Send on endpoint 2, of length i
-			/*
-			// Send a zero-length packet if the transaction length was the same as the endpoint
-			// length. This is for demo purposes. In real life, you only need to do this if the data
-			// you're transferring ends on a multiple of the endpoint length.
-			if (out_buf_len == EP_2_LEN) {
-				// Wait until the IN endpoint can accept it
-				while (usb_in_endpoint_busy(2)){
+	if (usb_is_configured()) {
+		bridge_notify(port);
+	}
+
+	// Send data to the PC if anything in buffer
+	// The UART receiver writes directly into the current IN (ping-pong) buffer,
+	// which is then handed to the SIE as-is. No intermediate copy.
+	if (usb_is_configured() && !usb_in_endpoint_halted(ep)) {
+		// Full packets are sent as soon as they fill up. If the data then stops
+		// on a packet boundary, a zero-length packet ends the transfer, after
+		// the same coalescing time a partial packet would get.
+		uint32_t count = uartRxAttached[port] ? UARTDrv_GetCount(port) : 0;
+		bool pending = (count > 0) || (uartRxAttached[port] && usb_in_endpoint_needs_zlp(ep));
+		bool full = (count > 0) && (count >= uartRxSize[port]);
+		bool timeout = pending && (rxFramesWaiting[port] >= coalesceFrames);
+		if (full || timeout) {
+			uint32_t i = UARTDrv_RxDetach(port);
+			usb_send_in_buffer(ep, i);	// Send on the data endpoint, of length i (0 == ZLP)
+			uartRxAttached[port] = false;
+			rxFramesWaiting[port] = 0;
+
+			if (i == 0){
+				bridgeStats[port].in_zlp++;
+			}
+			else{
+				bridgeStats[port].in_bytes += i;
+				bridgeStats[port].in_packets++;
+				if (full){
+					bridgeStats[port].in_full++;
+				}
+				else{
+					bridgeStats[port].in_timeout++;
 				}
-				usb_send_in_buffer(2, 0);
 			}
-			*/
 		}
 
-		// Handle data received from the host
-		if (usb_is_configured() && !usb_out_endpoint_halted(2) && usb_out_endpoint_has_data(2)) {
-			const unsigned char *out_buf;
-			size_t out_buf_len;
+		// Attach the next buffer, once the SIE is done with it
+		if (!uartRxAttached[port] && !usb_in_endpoint_busy(ep)) {
+			uartRxSize[port] = bridgeDataLen[port];
+			UARTDrv_RxAttach(port, usb_get_in_buffer(ep), uartRxSize[port]);
+			uartRxAttached[port] = true;
+		}
+	}
 
-			// Check for an empty transaction.
-			out_buf_len = usb_get_out_buffer(2, &out_buf);
-			if (out_buf_len <= 0){
-				// Let's avoid gotos
-			}
-			else{
-				UARTDrv_SendBlocking((uint8_t *)out_buf, out_buf_len);
+	// Handle data received from the host
+	if (usb_is_configured() && !usb_out_endpoint_halted(ep) && usb_out_endpoint_has_data(ep)) {
+		const unsigned char *out_buf;
+		size_t out_buf_len;
+
+		// Only take the packet once it fits in the UART TX ring.
+		// Until then the endpoint stays unarmed, and the host gets NAKs.
+		out_buf_len = usb_get_out_buffer(ep, &out_buf);
+		if (UARTDrv_TxFree(port) >= out_buf_len){
+			if (out_buf_len > 0){
+				UARTDrv_SendAsync(port, out_buf, out_buf_len);
 			}
 
 			LED_toggle();
 
-			usb_arm_out_endpoint(2);
+			usb_arm_out_endpoint(ep);
 		}
+	}
+
+	bridge_unlock();
+}
+
+// CDC line coding to UART parity and stop bits. False if the UART can't do them.
+static bool line_coding_to_uart(const struct cdc_line_coding *coding, UARTDrvParity *parity, uint8_t *stopBits)
+{
+	if (coding->bParityType == CDC_PARITY_NONE){
+		*parity = Parity_None;
+	}
+	else if (coding->bParityType == CDC_PARITY_ODD){
+		*parity = Parity_Odd;
+	}
+	else if (coding->bParityType == CDC_PARITY_EVEN){
+		*parity = Parity_Even;
+	}
+	else{
+		return false;	// Mark/space parity not supported by the UART
+	}
+
+	if (coding->bCharFormat == CDC_CHAR_FORMAT_1_STOP_BIT){
+		*stopBits = 1;
+	}
+	else if (coding->bCharFormat == CDC_CHAR_FORMAT_2_STOP_BITS){
+		*stopBits = 2;
+	}
+	else{
+		return false;	// 1.5 stop bits not supported
+	}
+	return true;
+}
+
+// Reconfigure the UARTs the host set a new line coding for. Under bridge_lock(),
+// so the callback can't change it halfway.
+static void uart_apply_line_coding(void)
+{
+	UARTDrvParity parity;
+	uint8_t stopBits;
+	uint8_t port;
+
+	for (port = 0; port < UART_NUM_PORTS; port++) {
+		if (lineCodingPending[port]) {
+			lineCodingPending[port] = false;
+			if (line_coding_to_uart(&line_coding[port], &parity, &stopBits)) {	// Checked by the callback already
+				UARTDrv_Configure(port, line_coding[port].dwDTERate, line_coding[port].bDataBits, parity, stopBits);
+			}
+		}
+	}
+}
 
-		#ifndef USB_USE_INTERRUPTS
+// One pass of the main loop
+static void loop(){
+	bridge_lock();
+	uart_apply_line_coding();
+	UARTDrv_Poll();		// Resume TX held by CTS
+	bridge_unlock();
+
+	bridge_service(Port_Console);
+	bridge_service(Port_Aux);
+	COMMS_service();
+
+	#ifndef USB_USE_INTERRUPTS
+	{
+		uint32_t gap = 2*(GetCP0Count() - usbLastService);
+		if (usbLastService != 0 && gap > usbLatencyMax) {
+			usbLatencyMax = gap;	// A token completing right after the last call waited this long
+		}
 		usb_service();
-		#endif
+		usbLastService = GetCP0Count();
+	}
+	#endif
+}
+
+int main(){
+
+
+	setup();
+	usb_application_init_serial();	// Serial string from DEVID and USERID, built once
+	usb_init();
+
+	// A very basic USB-UART example.
+	// Currently everything is hardcoded. Will be expanded later.
+
+	for(;;){
+		loop();
 	}
 
     return(0);
@@ -164,9 +349,24 @@ int main(){
 
 
 /* Callbacks. These function names are set in usb_config.h. */
-void app_set_configuration_callback(uint8_t configuration)
+// Endpoint buffers get reset, so take back the one the UART was filling.
+static void uart_rx_release(void)
 {
+	uint8_t port;
+
+	for (port = 0; port < UART_NUM_PORTS; port++) {
+		if (uartRxAttached[port]) {
+			UARTDrv_RxDetach(port);
+			uartRxAttached[port] = false;
+		}
+		rxFramesWaiting[port] = 0;
+	}
+}
 
+void app_set_configuration_callback(uint8_t configuration)
+{
+	uart_rx_release();
+	COMMS_reset();
 }
 
 uint16_t app_get_device_status_callback()
@@ -199,8 +399,135 @@ void app_in_transaction_complete_callback(uint8_t endpoint)
 
 }
 
+// Vendor requests, see vendor.h
+static int8_t handle_vendor_request(const struct setup_packet *setup)
+{
+	static uint8_t reply;
+	static struct uart_error_stats errorReply;
+	static struct uart_isr_stats isrReply;
+	static struct usb_latency_stats latencyReply;
+#ifdef USB_STATS
+	static struct usb_core_stats usbStatsReply;
+	struct usb_stats usbStats;
+	uint8_t i;
+#endif
+	UARTDrvErrors errors;
+	UARTDrvIsrStats isrStats;
+	uint16_t port = setup->wIndex;	// UART port, for the per-port requests
+
+	if (setup->REQUEST.destination != 0 /*0=device*/){
+		return -1;
+	}
+	switch (setup->bRequest){
+		case VENDOR_GET_BRIDGE_STATS:
+		case VENDOR_CLEAR_BRIDGE_STATS:
+		case VENDOR_GET_UART_ERRORS:
+		case VENDOR_CLEAR_UART_ERRORS:
+		case VENDOR_GET_UART_ISR_STATS:
+		case VENDOR_CLEAR_UART_ISR_STATS:
+		case VENDOR_SET_FLOW_CONTROL:
+			if (port >= UART_NUM_PORTS){
+				return -1;
+			}
+			break;
+		default:
+			break;	// Not per port, wIndex is unused
+	}
+
+	switch (setup->bRequest){
+		case VENDOR_SET_COALESCE_FRAMES:
+			if (setup->wValue > BRIDGE_COALESCE_FRAMES_MAX){
+				return -1;
+			}
+			coalesceFrames = setup->wValue;
+			usb_send_data_stage(NULL, 0, NULL, NULL);	// No data stage
+			return 0;
+		case VENDOR_GET_COALESCE_FRAMES:
+			reply = coalesceFrames;
+			usb_send_data_stage((char *)&reply, MIN(setup->wLength, sizeof(reply)), NULL, NULL);
+			return 0;
+		case VENDOR_GET_BRIDGE_STATS:
+			usb_send_data_stage((char *)&bridgeStats[port], MIN(setup->wLength, sizeof(bridgeStats[port])), NULL, NULL);
+			return 0;
+		case VENDOR_CLEAR_BRIDGE_STATS:
+			memset(&bridgeStats[port], 0, sizeof(bridgeStats[port]));
+			usb_send_data_stage(NULL, 0, NULL, NULL);
+			return 0;
+		case VENDOR_GET_UART_ERRORS:
+			UARTDrv_GetErrors(port, &errors);
+			errorReply.dropped = errors.dropped;
+			errorReply.overrun = errors.overrun;
+			errorReply.framing = errors.framing;
+			errorReply.parity = errors.parity;
+			usb_send_data_stage((char *)&errorReply, MIN(setup->wLength, sizeof(errorReply)), NULL, NULL);
+			return 0;
+		case VENDOR_CLEAR_UART_ERRORS:
+			UARTDrv_ClearErrors(port);
+			usb_send_data_stage(NULL, 0, NULL, NULL);
+			return 0;
+		case VENDOR_GET_UART_ISR_STATS:
+			UARTDrv_GetIsrStats(port, &isrStats);
+			isrReply.calls = isrStats.calls;
+			isrReply.bytes = isrStats.bytes;
+			isrReply.cycles = isrStats.cycles;
+			usb_send_data_stage((char *)&isrReply, MIN(setup->wLength, sizeof(isrReply)), NULL, NULL);
+			return 0;
+		case VENDOR_CLEAR_UART_ISR_STATS:
+			UARTDrv_ClearIsrStats(port);
+			usb_send_data_stage(NULL, 0, NULL, NULL);
+			return 0;
+		case VENDOR_GET_USB_LATENCY:
+#ifdef USB_USE_INTERRUPTS
+			latencyReply.interrupt_mode = 1;
+#else
+			latencyReply.interrupt_mode = 0;
+#endif
+			latencyReply.max_cycles = usbLatencyMax;
+			latencyReply.cpu_clock = GetSystemClock();
+			usb_send_data_stage((char *)&latencyReply, MIN(setup->wLength, sizeof(latencyReply)), NULL, NULL);
+			return 0;
+		case VENDOR_CLEAR_USB_LATENCY:
+			usbLatencyMax = 0;
+			usb_send_data_stage(NULL, 0, NULL, NULL);
+			return 0;
+#ifdef USB_STATS
+		case VENDOR_GET_USB_STATS:
+			usb_get_stats(&usbStats);
+			memset(&usbStatsReply, 0, sizeof(usbStatsReply));
+			usbStatsReply.resets = usbStats.resets;
+			usbStatsReply.stalls = usbStats.stalls;
+			usbStatsReply.sofs = usbStats.sofs;
+			usbStatsReply.max_service_ticks = usbStats.max_service_ticks;
+			usbStatsReply.cpu_clock = GetSystemClock();
+			for (i = 0; i <= NUM_ENDPOINT_NUMBERS && i < USB_STATS_ENDPOINTS; i++){
+				usbStatsReply.ep[i].in_transactions = usbStats.ep[i].in_transactions;
+				usbStatsReply.ep[i].in_bytes = usbStats.ep[i].in_bytes;
+				usbStatsReply.ep[i].out_transactions = usbStats.ep[i].out_transactions;
+				usbStatsReply.ep[i].out_bytes = usbStats.ep[i].out_bytes;
+				usbStatsReply.ep[i].in_busy = usbStats.ep[i].in_busy;
+			}
+			usb_send_data_stage((char *)&usbStatsReply, MIN(setup->wLength, sizeof(usbStatsReply)), NULL, NULL);
+			return 0;
+		case VENDOR_CLEAR_USB_STATS:
+			usb_clear_stats();
+			usb_send_data_stage(NULL, 0, NULL, NULL);
+			return 0;
+#endif
+		case VENDOR_SET_FLOW_CONTROL:
+			UARTDrv_SetFlowControl(port, setup->wValue & 0x01);
+			usb_send_data_stage(NULL, 0, NULL, NULL);
+			return 0;
+		default:
+			return -1;
+	}
+}
+
 int8_t app_unknown_setup_request_callback(const struct setup_packet *setup)
 {
+	if (setup->REQUEST.type == REQUEST_TYPE_VENDOR){
+		return handle_vendor_request(setup);
+	}
+
 	/* To use the CDC device class, have a handler for unknown setup
 	 * requests and call process_cdc_setup_request() (as shown here),
 	 * which will check if the setup request is CDC-related, and will
@@ -219,12 +546,21 @@ int16_t app_unknown_get_descriptor_callback(const struct setup_packet *pkt, cons
 
 void app_start_of_frame_callback(void)
 {
+	uint8_t port;
 
+	// 1ms tick for IN packet coalescing
+	for (port = 0; port < UART_NUM_PORTS; port++) {
+		if (uartRxAttached[port] && (UARTDrv_GetCount(port) > 0 || usb_in_endpoint_needs_zlp(bridgeDataEp[port]))
+			&& rxFramesWaiting[port] < 0xFF) {
+			rxFramesWaiting[port]++;
+		}
+	}
 }
 
 void app_usb_reset_callback(void)
 {
-
+	uart_rx_release();
+	COMMS_reset();
 }
 
 /* CDC Callbacks. See usb_cdc.h for documentation. */
@@ -263,18 +599,31 @@ int8_t app_get_comm_feature_callback(uint8_t interface,
 	return -1;
 }
 
-static struct cdc_line_coding line_coding =
-{
-	115200,
-	CDC_CHAR_FORMAT_1_STOP_BIT,
-	CDC_PARITY_NONE,
-	8,
-};
+// Communication and data interface of a port are 2*port and 2*port+1
+#define INTERFACE_TO_PORT(i)	((UARTDrvPort)((i)/2))
+// wIndex comes from the host, it needn't be one of our interfaces
+#define INTERFACE_HAS_PORT(i)	((i)/2 < UART_NUM_PORTS)
 
 int8_t app_set_line_coding_callback(uint8_t interface,
                                     const struct cdc_line_coding *coding)
 {
-	line_coding = *coding;
+	UARTDrvPort port = INTERFACE_TO_PORT(interface);
+	UARTDrvParity parity;
+	uint8_t stopBits;
+
+	if (!INTERFACE_HAS_PORT(interface)){
+		return -1;
+	}
+
+	// STALL (keeping the old setting) if the UART can't do it. Otherwise the
+	// main loop applies it, see uart_apply_line_coding().
+	if (!line_coding_to_uart(coding, &parity, &stopBits) ||
+		UARTDrv_CheckConfig(coding->dwDTERate, coding->bDataBits, parity, stopBits) == 0){
+		return -1;
+	}
+
+	line_coding[port] = *coding;
+	lineCodingPending[port] = true;
 	return 0;
 }
 
@@ -282,13 +631,21 @@ int8_t app_get_line_coding_callback(uint8_t interface,
                                     struct cdc_line_coding *coding)
 {
 	/* This is where baud rate, data, stop, and parity bits are set. */
-	*coding = line_coding;
+	if (!INTERFACE_HAS_PORT(interface)){
+		return -1;
+	}
+	*coding = line_coding[INTERFACE_TO_PORT(interface)];
 	return 0;
 }
 
 int8_t app_set_control_line_state_callback(uint8_t interface,
                                            bool dtr, bool dts)
 {
+	// The host's RTS drives the RTS pin, unless hardware flow control owns it
+	if (!INTERFACE_HAS_PORT(interface)){
+		return -1;
+	}
+	UARTDrv_SetRts(INTERFACE_TO_PORT(interface), dts);
 	return 0;
 }
 
@@ -0,0 +1,600 @@
+#include <p32xxxx.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <COMMS.h>
+#include <HEX.h>
+#include <ICSPDrv.h>
+#include <vendor.h>
+#include <usb_config.h>
+#include <usb.h>
+#include <system.h>
+
+#define MIN(x,y) (((x)<(y))?(x):(y))
+
+// COMMS_SHIFT_BENCHMARK shifts for at most this long per main loop pass
+#define COMMS_BENCHMARK_CHUNK_MS	1
+
+// One command at a time. The OUT transfer for the next command is only
+// started once the reply has gone out, so the host gets NAKs meanwhile.
+typedef enum CommsStateEnum {
+	State_Idle		= 0,	// No transfer, device not configured yet
+	State_Receiving	= 1,	// Waiting for a command
+	State_Ready		= 2,	// Command in, to be run by COMMS_service()
+	State_Streaming	= 3,	// Taking the command's payload, or waiting for the target, see COMMS_stream()
+	State_Replying	= 4,	// Sending the reply
+} CommsState;
+
+static volatile CommsState state = State_Idle;
+static volatile bool resetPending = false;	// From the USB interrupt, taken by COMMS_service()
+static struct comms_command command;
+static volatile size_t commandLength;
+
+static struct {
+	struct comms_reply header;
+	uint8_t data[COMMS_MAX_DATA];
+} reply;
+
+// Payload of the current command, in chunks through two buffers. The next chunk
+// comes in over USB while the target works on this one. Only one OUT transfer at
+// a time, so a payload cut short by the host never swallows the next command.
+static struct {
+	uint32_t total;				// Payload bytes
+	uint32_t chunkSize;			// Bytes per chunk, whole packets
+	uint32_t chunks;			// Chunks in the payload
+	uint32_t requested;			// OUT transfers started
+	volatile uint32_t received;	// OUT transfers done
+	volatile bool ended;		// The host sent a short chunk, nothing more comes
+	uint32_t handled;			// Chunks passed on to the target, their buffer is free
+	uint32_t offset;			// Bytes of the next chunk already parsed, COMMS_HEX_PROGRAM
+	bool waiting;				// For the PE to answer the last chunk, or the target to finish the command
+	uint8_t expect;				// PE command of the awaited response
+	uint32_t waitStart;
+	uint32_t waitMs;
+	uint32_t regionAddress;		// COMMS_FLAG_VERIFY: rows programmed one after the other, not checked yet
+	uint32_t regionLength;
+	uint16_t regionCrc;
+	uint32_t address;			// Target address of the next chunk
+} stream;
+static uint32_t streamBuf[2][COMMS_MAX_ROW/4];
+static volatile size_t streamLen[2];
+static uint32_t ticksPerMs;
+static uint32_t targetRow;	// Flash row size of the entered target, 0 if its family isn't known
+
+static void COMMS_startReceive();
+
+// Transfer callbacks, called from usb_service()
+static void COMMS_commandReceived(uint8_t endpoint, size_t len, void *context){
+	commandLength = len;
+	state = State_Ready;
+}
+
+static void COMMS_chunkReceived(uint8_t endpoint, size_t len, void *context){
+	if (len < MIN(stream.chunkSize, stream.total - stream.received * stream.chunkSize)){
+		stream.ended = true;
+	}
+	streamLen[stream.received & 1] = len;
+	stream.received++;
+}
+
+static void COMMS_replySent(uint8_t endpoint, size_t len, void *context){
+	// A reply of whole packets only ends with a zero-length packet
+	if (len > 0 && (len % EP_5_IN_LEN) == 0){
+		if (usb_start_in_transfer(COMMS_EP, &reply, 0, COMMS_replySent, NULL) == 0){
+			return;
+		}
+	}
+	COMMS_startReceive();
+}
+
+// A command already waiting in the endpoint is taken inside usb_start_out_transfer(),
+// and COMMS_commandReceived() moves on to State_Ready from there. So the state is
+// set before, and only put back on failure.
+static void COMMS_startReceive(){
+	state = State_Receiving;
+	if (usb_start_out_transfer(COMMS_EP, &command, sizeof(command), COMMS_commandReceived, NULL) != 0){
+		state = State_Idle;
+	}
+}
+
+static uint8_t COMMS_icspStatus(ICSPDrvStatus status){
+	switch (status){
+		case ICSP_Ok:				return COMMS_OK;
+		case ICSP_NotEntered:		return COMMS_ERR_NOT_ENTERED;
+		case ICSP_CodeProtected:	return COMMS_ERR_CODE_PROTECTED;
+		case ICSP_PeError:			return COMMS_ERR_PE;
+		default:					return COMMS_ERR_TIMEOUT;
+	}
+}
+
+// COMMS_SHIFT_BENCHMARK: shift words through IDCODE, which only reads. Measures the TAP transport.
+static void COMMS_benchmarkStart(){
+	struct comms_shift_benchmark *b = (struct comms_shift_benchmark *)reply.data;
+
+	ICSPDrv_SendCommand(MTAP_SW_MTAP);
+	ICSPDrv_SendCommand(MTAP_IDCODE);
+
+	b->bits = 0;
+	b->ticks = 0;
+	b->cpu_clock = GetSystemClock();
+	b->tck = ICSPDrv_GetTckFrequency();
+	b->transport = ICSPDrv_GetTransport();
+}
+
+// The next words, for up to COMMS_BENCHMARK_CHUNK_MS. Returns true once all of them are through.
+static bool COMMS_benchmarkStep(){
+	struct comms_shift_benchmark *b = (struct comms_shift_benchmark *)reply.data;
+	uint32_t start = GetCP0Count();
+	uint32_t now;
+
+	do {
+		ICSPDrv_XferData(b->bits / 32);
+		b->bits += 32;
+		now = GetCP0Count();
+	} while (b->bits < 32 * command.length && (now - start) < ticksPerMs * COMMS_BENCHMARK_CHUNK_MS);
+	b->ticks += now - start;
+	return b->bits == 32 * command.length;
+}
+
+// Flash row size of a target, from the device ID in its IDCODE (bits 27:20 of it,
+// without the version and the manufacturer ID). 0 for the families not listed,
+// which are refused rather than programmed with a guessed row.
+static uint32_t COMMS_rowSize(uint32_t idcode){
+	switch ((idcode >> 20) & 0xFF){
+		case 0x4A:	// MX1/2, 28/44 pins
+		case 0x4D:
+		case 0x66:	// MX1/2, 28/44 pins, 256KB
+			return 128;
+		case 0x09:	// MX3/4
+		case 0x43:	// MX5/6/7
+		case 0x44:
+		case 0x56:	// MX330/350/430/450
+		case 0x58:	// MX370/470
+			return 512;
+		default:
+			return 0;
+	}
+}
+
+// The row size of COMMS_PE_PROGRAM and COMMS_HEX_PROGRAM (param) has to be the
+// target's. If not, the error goes in the reply, with value = the target's row.
+static bool COMMS_checkRow(struct comms_reply *r){
+	if (targetRow != 0 && command.param == targetRow){
+		return true;
+	}
+	if (targetRow != 0){
+		r->status = COMMS_ERR_LENGTH;
+	}
+	else{
+		r->status = ICSPDrv_PeIsLoaded() ? COMMS_ERR_FAMILY : COMMS_ERR_NO_PE;
+	}
+	r->value = targetRow;
+	return false;
+}
+
+// Take a payload of total bytes. The reply status is kept through it: once it's an
+// error, the rest is only read and dropped, so the host can send it without waiting.
+static void COMMS_startStream(uint32_t total, uint32_t chunkSize){
+	stream.total = total;
+	stream.chunkSize = chunkSize;
+	stream.chunks = (total + chunkSize - 1) / chunkSize;
+	stream.requested = 0;
+	stream.received = 0;
+	stream.ended = false;
+	stream.handled = 0;
+	stream.offset = 0;
+	stream.waiting = false;
+	stream.regionLength = 0;
+	stream.address = command.address;
+}
+
+// Have COMMS_stream() wait for the target, for at most ms
+static void COMMS_startWait(uint32_t ms){
+	stream.waiting = true;
+	stream.waitStart = GetCP0Count();
+	stream.waitMs = ms;
+}
+
+// A flash row to the PE
+static ICSPDrvStatus COMMS_programRow(const uint32_t *data, size_t len, uint32_t address){
+	uint32_t header[2] = { (PE_ROW_PROGRAM << 16) | (len / 4), address };
+	ICSPDrvStatus s;
+
+	s = ICSPDrv_PeSend(header, 2);
+	if (s == ICSP_Ok){
+		s = ICSPDrv_PeSend(data, len / 4);
+	}
+	if (s == ICSP_Ok){
+		stream.expect = PE_ROW_PROGRAM;
+		COMMS_startWait(ICSP_PE_TIMEOUT_MS);	// The PE programs it while the next row comes in
+	}
+	if (s == ICSP_Ok && (command.flags & COMMS_FLAG_VERIFY)){
+		if (stream.regionLength == 0){
+			stream.regionAddress = address;
+			stream.regionCrc = PE_CRC_SEED;
+		}
+		stream.regionCrc = ICSPDrv_PeCrc(stream.regionCrc, data, len);
+		stream.regionLength += len;
+	}
+	return s;
+}
+
+// Verify: a row that doesn't carry on the region ends it
+static bool COMMS_regionEnds(uint32_t address){
+	return stream.regionLength != 0 && address != stream.regionAddress + stream.regionLength;
+}
+
+// Verify, or COMMS_PE_CRC: have the PE work out the CRC of the region, answered like a row
+static ICSPDrvStatus COMMS_checkRegion(){
+	uint32_t request[3] = { PE_GET_CRC << 16, stream.regionAddress, stream.regionLength };
+	ICSPDrvStatus s;
+
+	s = ICSPDrv_PeSend(request, 3);
+	if (s == ICSP_Ok){
+		stream.expect = PE_GET_CRC;
+		COMMS_startWait(ICSP_PE_CRC_TIMEOUT_MS);
+	}
+	return s;
+}
+
+// A chunk of payload to the target
+static void COMMS_handleChunk(const uint32_t *data, size_t len){
+	struct comms_reply *r = &reply.header;
+	ICSPDrvStatus s;
+
+	if (command.command == COMMS_PE_LOAD){
+		s = ICSPDrv_PeSend(data, len / 4);
+	}
+	else{	// COMMS_PE_PROGRAM, a row
+		s = COMMS_programRow(data, len, stream.address);
+		stream.address += len;
+	}
+	if (s != ICSP_Ok){
+		r->status = COMMS_icspStatus(s);
+	}
+}
+
+// COMMS_HEX_PROGRAM: parse the chunks as they come in, a row to the PE whenever
+// one is ready. Parsing goes on while the PE programs the last row.
+static void COMMS_hexStep(){
+	struct comms_reply *r = &reply.header;
+	const uint8_t *chunk;
+	const uint32_t *data;
+	uint32_t address;
+	ICSPDrvStatus s;
+
+	if (r->status != COMMS_OK){
+		if (stream.handled < stream.received){
+			stream.handled++;	// Drop it
+		}
+		return;
+	}
+
+	if (!stream.waiting && HEX_rowReady()){
+		if (COMMS_regionEnds(HEX_getRowAddress())){
+			s = COMMS_checkRegion();	// The row waits for it
+		}
+		else{
+			data = HEX_takeRow(&address);
+			s = COMMS_programRow(data, command.param, address);
+		}
+		if (s != ICSP_Ok){
+			r->status = COMMS_icspStatus(s);
+		}
+	}
+	else if (stream.handled < stream.received){
+		chunk = (const uint8_t *)streamBuf[stream.handled & 1];
+		stream.offset += HEX_parse(chunk + stream.offset, streamLen[stream.handled & 1] - stream.offset);
+		if (HEX_getStatus() != HEX_Ok){
+			r->status = COMMS_ERR_HEX;
+			r->value = HEX_getLine();
+		}
+		if (stream.offset == streamLen[stream.handled & 1]){
+			stream.offset = 0;
+			stream.handled++;
+		}
+	}
+}
+
+// The PE's answer to a row, or to a region's GET_CRC
+static void COMMS_handleResponse(uint32_t response){
+	struct comms_reply *r = &reply.header;
+	ICSPDrvStatus s = ICSP_Ok;
+	uint32_t crc = 0;
+
+	if (stream.expect == PE_GET_CRC){
+		s = ICSPDrv_PeGetResponse(&crc);	// The CRC follows, take it whatever happens
+		stream.regionLength = 0;
+	}
+	if (r->status != COMMS_OK){
+		return;	// Keep the first error and its value
+	}
+	if (response != (stream.expect << 16)){
+		r->status = COMMS_ERR_PE;
+		r->value = response;
+	}
+	else if (s != ICSP_Ok){
+		r->status = COMMS_icspStatus(s);
+	}
+	else if (stream.expect == PE_ROW_PROGRAM){
+		r->value += command.param;	// Bytes programmed
+	}
+	else if (command.command == COMMS_PE_CRC){
+		r->value = crc & 0xFFFF;
+	}
+	else if ((crc & 0xFFFF) != stream.regionCrc){
+		r->status = COMMS_ERR_VERIFY;
+		r->value = stream.regionAddress;
+	}
+}
+
+// End of the payload, finish the command
+static void COMMS_finishStream(){
+	struct comms_reply *r = &reply.header;
+	uint16_t version;
+	ICSPDrvStatus s;
+
+	if (r->status == COMMS_OK && stream.handled < stream.chunks){
+		r->status = COMMS_ERR_LENGTH;	// Cut short by the host
+	}
+	if (r->status == COMMS_OK && command.command == COMMS_HEX_PROGRAM && !HEX_isDone()){
+		r->status = COMMS_ERR_HEX;	// No EOF record, the last row wasn't programmed
+		r->value = HEX_getLine();
+	}
+	if (r->status == COMMS_OK && command.command == COMMS_PE_LOAD){
+		s = ICSPDrv_PeLoadFinish(&version);
+		r->status = COMMS_icspStatus(s);
+		r->value = version;
+	}
+	if (command.command == COMMS_ICSP_ERASE && ICSPDrv_IsEntered()){
+		r->value = ICSPDrv_ReadStatus();
+	}
+}
+
+// Run the command, fill in the reply. Returns false when it takes a payload first,
+// or has to wait for the target: COMMS_stream() goes on with it from the main loop.
+static bool COMMS_execute(){
+	struct comms_reply *r = &reply.header;
+	ICSPDrvStatus s;
+	uint32_t i;
+
+	r->command = command.command;
+	r->status = COMMS_OK;
+	r->reserved = 0;
+	r->value = 0;
+	r->length = 0;
+
+	if (commandLength < sizeof(command)){
+		r->status = COMMS_ERR_COMMAND;
+		return true;
+	}
+
+	switch (command.command){
+		case COMMS_PING:
+			r->value = COMMS_PROTOCOL_VERSION;
+			break;
+		case COMMS_ICSP_ENTER:
+			ICSPDrv_Enter((command.flags & 0x01) ? Transport_JTAG : Transport_2Wire);
+			r->value = ICSPDrv_ReadStatus();
+			targetRow = ICSPDrv_IsEntered() ? COMMS_rowSize(ICSPDrv_ReadIdCode()) : 0;
+			break;
+		case COMMS_ICSP_EXIT:
+			ICSPDrv_Exit();
+			targetRow = 0;
+			break;
+		case COMMS_ICSP_IDCODE:
+		case COMMS_ICSP_STATUS:
+			if (!ICSPDrv_IsEntered()){
+				r->status = COMMS_ERR_NOT_ENTERED;
+			}
+			else if (command.command == COMMS_ICSP_IDCODE){
+				r->value = ICSPDrv_ReadIdCode();
+			}
+			else{
+				r->value = ICSPDrv_ReadStatus();
+			}
+			break;
+		case COMMS_ICSP_ERASE:
+			COMMS_startStream(0, COMMS_MAX_ROW);	// No payload, only the wait
+			if ((s = ICSPDrv_EraseStart()) != ICSP_Ok){
+				r->status = COMMS_icspStatus(s);
+			}
+			else{
+				COMMS_startWait(ICSP_ERASE_TIMEOUT_MS);
+			}
+			return false;
+		case COMMS_ICSP_SERIAL_EXEC:
+			r->status = COMMS_icspStatus(ICSPDrv_EnterSerialExecution(command.flags & 0x01));
+			break;
+		case COMMS_ICSP_READ:
+			if (command.length > COMMS_MAX_DATA || (command.length & 3) != 0){
+				r->status = COMMS_ERR_LENGTH;
+				break;
+			}
+			for (i = 0; i < command.length; i += 4){
+				s = ICSPDrv_ReadWord(command.address + i, (uint32_t *)&reply.data[i]);
+				if (s != ICSP_Ok){
+					r->status = COMMS_icspStatus(s);
+					break;
+				}
+			}
+			r->length = i;	// Up to the failed word
+			break;
+		case COMMS_SHIFT_BENCHMARK:
+			COMMS_startStream(0, COMMS_MAX_ROW);
+			if (!ICSPDrv_IsEntered()){
+				r->status = COMMS_ERR_NOT_ENTERED;
+			}
+			else if (command.length == 0 || command.length > COMMS_BENCHMARK_MAX_WORDS){
+				r->status = COMMS_ERR_LENGTH;
+			}
+			else{
+				COMMS_benchmarkStart();
+				stream.waiting = true;	// Until COMMS_benchmarkStep() is through
+				r->length = sizeof(struct comms_shift_benchmark);
+			}
+			return false;
+		case COMMS_PE_CRC:
+			COMMS_startStream(0, COMMS_MAX_ROW);
+			if (!ICSPDrv_PeIsLoaded()){
+				r->status = COMMS_ERR_NO_PE;
+			}
+			else if (command.length == 0){
+				r->status = COMMS_ERR_LENGTH;
+			}
+			else{
+				stream.regionAddress = command.address;
+				stream.regionLength = command.length;
+				if ((s = COMMS_checkRegion()) != ICSP_Ok){
+					r->status = COMMS_icspStatus(s);
+				}
+			}
+			return false;
+		case COMMS_PE_LOAD:
+			COMMS_startStream(command.length, COMMS_MAX_ROW);
+			if (command.length == 0 || (command.length & 3) != 0){
+				r->status = COMMS_ERR_LENGTH;
+			}
+			else if ((s = ICSPDrv_PeLoadStart(command.length / 4)) != ICSP_Ok){
+				r->status = COMMS_icspStatus(s);
+			}
+			return false;
+		case COMMS_PE_PROGRAM:
+			if (!COMMS_checkRow(r)){
+				COMMS_startStream(command.length, COMMS_MAX_ROW);	// Only to drop the payload
+				return false;
+			}
+			COMMS_startStream(command.length, command.param);
+			if ((command.length % command.param) != 0 || (command.address % command.param) != 0){
+				r->status = COMMS_ERR_LENGTH;
+			}
+			else if (!ICSPDrv_PeIsLoaded()){
+				r->status = COMMS_ERR_NO_PE;
+			}
+			return false;
+		case COMMS_HEX_PROGRAM:
+			COMMS_startStream(command.length, COMMS_MAX_ROW);
+			HEX_init(command.param);
+			if (COMMS_checkRow(r) && !ICSPDrv_PeIsLoaded()){
+				r->status = COMMS_ERR_NO_PE;
+			}
+			return false;
+		default:
+			r->status = COMMS_ERR_COMMAND;
+			break;
+	}
+	return true;
+}
+
+static void COMMS_sendReply(){
+	state = State_Replying;
+	if (usb_start_in_transfer(COMMS_EP, &reply, sizeof(reply.header) + reply.header.length, COMMS_replySent, NULL) != 0){
+		state = State_Idle;	// Endpoint reset or halted under us, start over
+	}
+}
+
+// One step of taking a payload, or of waiting for the target to finish a command
+// (COMMS_ICSP_ERASE, COMMS_PE_CRC, COMMS_SHIFT_BENCHMARK). Doesn't wait on the
+// target, so the rest of the main loop keeps going.
+static void COMMS_stream(){
+	struct comms_reply *r = &reply.header;
+	ICSPDrvStatus s;
+
+	// Target side
+	if (command.command == COMMS_SHIFT_BENCHMARK){
+		if (stream.waiting && COMMS_benchmarkStep()){
+			stream.waiting = false;	// Only shifts, never times out
+		}
+	}
+	else if (stream.waiting){
+		if (command.command == COMMS_ICSP_ERASE ? ICSPDrv_EraseDone() : ICSPDrv_PeResponseReady()){
+			stream.waiting = false;
+			if (command.command != COMMS_ICSP_ERASE){
+				COMMS_handleResponse(ICSPDrv_PeReadResponse());
+			}
+		}
+		else if ((GetCP0Count() - stream.waitStart) >= ticksPerMs * stream.waitMs){
+			stream.waiting = false;
+			r->status = COMMS_ERR_TIMEOUT;
+		}
+	}
+	if (command.command == COMMS_HEX_PROGRAM){
+		COMMS_hexStep();
+	}
+	else if (!stream.waiting && stream.handled < stream.received){
+		uint8_t b = stream.handled & 1;
+		if (r->status == COMMS_OK){
+			if (streamLen[b] == stream.chunkSize || stream.handled == stream.chunks - 1){
+				COMMS_handleChunk(streamBuf[b], streamLen[b] & ~3);
+			}
+			else{
+				r->status = COMMS_ERR_LENGTH;
+			}
+		}
+		stream.handled++;
+	}
+
+	// USB side, up to one chunk ahead
+	if (stream.requested == stream.received && !stream.ended &&
+		stream.requested < stream.chunks && stream.requested < stream.handled + 2){
+		uint32_t len = MIN(stream.chunkSize, stream.total - stream.requested * stream.chunkSize);
+		if (usb_start_out_transfer(COMMS_EP, streamBuf[stream.requested & 1], len, COMMS_chunkReceived, NULL) != 0){
+			state = State_Idle;	// Endpoint reset or halted, the command is gone
+			return;
+		}
+		stream.requested++;
+	}
+
+	if (!stream.waiting && stream.handled == stream.received &&
+		!(command.command == COMMS_HEX_PROGRAM && r->status == COMMS_OK && HEX_rowReady()) &&
+		(stream.handled == stream.chunks || (stream.ended && stream.requested == stream.received))){
+		if (r->status == COMMS_OK && stream.regionLength != 0){
+			if ((s = COMMS_checkRegion()) != ICSP_Ok){	// The last region, before the reply
+				r->status = COMMS_icspStatus(s);
+			}
+			return;
+		}
+		COMMS_finishStream();
+		COMMS_sendReply();
+	}
+}
+
+void COMMS_init(){
+	ticksPerMs = GetSystemClock() / 2000;
+	ICSPDrv_Init();
+	state = State_Idle;
+}
+
+// USB reset or SET_CONFIGURATION. The stack drops the endpoint's transfers.
+// Runs in the USB interrupt, which may have cut COMMS_service() off midway:
+// it would then overwrite the state. Left for COMMS_service() to do.
+void COMMS_reset(){
+	resetPending = true;
+}
+
+// From the main loop. ICSP work runs here, outside the USB interrupt.
+void COMMS_service(){
+	if (resetPending){
+		resetPending = false;
+		state = State_Idle;
+	}
+	if (!usb_is_configured()){
+		return;
+	}
+
+	if (state == State_Idle){
+		COMMS_startReceive();
+	}
+	else if (state == State_Ready){
+		if (COMMS_execute()){
+			COMMS_sendReply();
+		}
+		else{
+			state = State_Streaming;
+			COMMS_stream();
+		}
+	}
+	else if (state == State_Streaming){
+		COMMS_stream();
+	}
+}
@@ -0,0 +1,244 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <HEX.h>
+
+// Record types
+#define HEX_DATA			0x00
+#define HEX_EOF				0x01
+#define HEX_SEGMENT			0x02	// Extended segment address, base = value << 4
+#define HEX_START_SEGMENT	0x03
+#define HEX_LINEAR			0x04	// Extended linear address, base = value << 16
+#define HEX_START_LINEAR	0x05
+
+#define HEX_MAX_RECORD		(5 + 255)	// Count, address, type, data, checksum
+#define HEX_NO_ROW			0xFFFFFFFF	// Never a physical row address
+
+static struct {
+	uint32_t rowSize;
+	uint32_t base;			// From the last extended address record
+	uint8_t record[HEX_MAX_RECORD];
+	uint16_t count;			// Record bytes in so far
+	bool inRecord;			// Past the ':'
+	bool lowNibble;			// Next digit is the low half of a byte
+	uint8_t sum;
+	uint16_t placed;		// Data bytes of the record put in rows
+	bool placing;			// The record is in, not all of it is in rows yet
+	bool done;				// EOF record in, the rest of the input is dropped
+	HEXStatus status;
+	uint32_t line;
+} hex;
+
+static struct {
+	uint32_t address;		// Physical, HEX_NO_ROW when there's no row
+	bool used;				// Some data in it
+	bool ready;				// Complete, to be taken
+	uint32_t data[HEX_MAX_ROW/4];
+} row;
+
+// Rows handed out, by HEX_MIN_ROW block of program flash then boot flash
+static uint8_t rowsTaken[(HEX_FLASH_SIZE + HEX_BOOT_SIZE) / HEX_MIN_ROW / 8];
+
+static int8_t HEX_digit(uint8_t c){
+	if (c >= '0' && c <= '9'){
+		return c - '0';
+	}
+	c |= 0x20;	// Lower case
+	if (c >= 'a' && c <= 'f'){
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+// Block of a row in rowsTaken[], or -1 outside flash
+static int32_t HEX_rowIndex(uint32_t address){
+	if (address >= HEX_FLASH_BASE && address < HEX_FLASH_BASE + HEX_FLASH_SIZE){
+		return (address - HEX_FLASH_BASE) / HEX_MIN_ROW;
+	}
+	if (address >= HEX_BOOT_BASE && address < HEX_BOOT_BASE + HEX_BOOT_SIZE){
+		return (HEX_FLASH_SIZE + address - HEX_BOOT_BASE) / HEX_MIN_ROW;
+	}
+	return -1;
+}
+
+// Put the data of the record in rows. Returns false when it stopped for a full
+// row, or on an error: call again once the row is taken.
+static bool HEX_place(){
+	uint32_t address;
+	uint32_t rowAddress;
+	int32_t index;
+
+	while (hex.placed < hex.record[0]){
+		address = (hex.base + ((hex.record[1] << 8) | hex.record[2]) + hex.placed) & 0x1FFFFFFF;	// Physical
+		rowAddress = address & ~(hex.rowSize - 1);
+		if (rowAddress != row.address){
+			if (row.used){
+				row.ready = true;	// The record moved on, the row is done
+				return false;
+			}
+			index = HEX_rowIndex(rowAddress);
+			if (index < 0){
+				hex.status = HEX_ErrAddress;
+				return false;
+			}
+			if (rowsTaken[index / 8] & (1 << (index % 8))){
+				hex.status = HEX_ErrRowAgain;
+				return false;
+			}
+			memset(row.data, 0xFF, hex.rowSize);
+			row.address = rowAddress;
+		}
+		((uint8_t *)row.data)[address - rowAddress] = hex.record[4 + hex.placed];
+		row.used = true;
+		hex.placed++;
+	}
+	hex.placing = false;
+	return true;
+}
+
+// A whole record is in. Returns false as HEX_place().
+static bool HEX_record(){
+	uint8_t type = hex.record[3];
+
+	if (hex.sum != 0){
+		hex.status = HEX_ErrChecksum;
+		return false;
+	}
+	switch (type){
+		case HEX_DATA:
+			hex.placed = 0;
+			hex.placing = true;
+			return HEX_place();
+		case HEX_EOF:
+			hex.done = true;
+			row.ready = row.used;
+			break;
+		case HEX_SEGMENT:
+		case HEX_LINEAR:
+			if (hex.record[0] != 2){
+				hex.status = HEX_ErrSyntax;
+				return false;
+			}
+			hex.base = (hex.record[4] << 8) | hex.record[5];
+			hex.base <<= (type == HEX_SEGMENT) ? 4 : 16;
+			break;
+		case HEX_START_SEGMENT:
+		case HEX_START_LINEAR:
+			break;	// Nothing to run, the target is reset after programming
+		default:
+			hex.status = HEX_ErrSyntax;
+			return false;
+	}
+	return true;
+}
+
+// Start a new file, rowSize a power of two from HEX_MIN_ROW to HEX_MAX_ROW
+void HEX_init(uint32_t rowSize){
+	memset(&hex, 0, sizeof(hex));
+	hex.rowSize = rowSize;
+	hex.line = 1;
+	row.address = HEX_NO_ROW;
+	row.used = false;
+	row.ready = false;
+	memset(rowsTaken, 0, sizeof(rowsTaken));
+}
+
+// Feed it the next len bytes of the file. Stops early when a row is ready or on an
+// error, returns the bytes used. Once the file is done or has failed, all input is
+// used and dropped.
+size_t HEX_parse(const uint8_t *data, size_t len){
+	size_t i;
+	int8_t digit;
+
+	if (hex.status != HEX_Ok || hex.done){
+		return len;
+	}
+	if (row.ready || (hex.placing && !HEX_place())){
+		return (hex.status != HEX_Ok) ? len : 0;
+	}
+
+	for (i = 0; i < len; i++){
+		if (!hex.inRecord){
+			if (data[i] == ':'){
+				hex.inRecord = true;
+				hex.count = 0;
+				hex.lowNibble = false;
+				hex.sum = 0;
+			}
+			else if (data[i] == '\n'){
+				hex.line++;
+			}
+			else if (data[i] != '\r' && data[i] != ' ' && data[i] != '\t'){
+				hex.status = HEX_ErrSyntax;
+				return len;
+			}
+			continue;
+		}
+
+		digit = HEX_digit(data[i]);
+		if (digit < 0){
+			hex.status = HEX_ErrSyntax;	// Also a record cut short by a line end
+			return len;
+		}
+		if (!hex.lowNibble){
+			hex.record[hex.count] = digit << 4;
+			hex.lowNibble = true;
+			continue;
+		}
+		hex.record[hex.count] |= digit;
+		hex.sum += hex.record[hex.count];
+		hex.lowNibble = false;
+		hex.count++;
+
+		if (hex.count == hex.record[0] + 5){
+			hex.inRecord = false;
+			if (!HEX_record()){
+				return (hex.status != HEX_Ok) ? len : i + 1;
+			}
+			if (hex.done){
+				return len;
+			}
+		}
+	}
+	return len;
+}
+
+bool HEX_rowReady(){
+	return row.ready;
+}
+
+// Physical address of the ready row
+uint32_t HEX_getRowAddress(){
+	return row.address;
+}
+
+// The ready row, rowSize bytes from address. Valid until the next HEX_parse().
+const uint32_t *HEX_takeRow(uint32_t *address){
+	int32_t index;
+
+	if (!row.ready){
+		return NULL;
+	}
+	index = HEX_rowIndex(row.address);
+	rowsTaken[index / 8] |= 1 << (index % 8);
+	*address = row.address;
+	row.address = HEX_NO_ROW;
+	row.used = false;
+	row.ready = false;
+	return row.data;
+}
+
+// EOF record in. Its row may still be ready to take.
+bool HEX_isDone(){
+	return hex.done;
+}
+
+HEXStatus HEX_getStatus(){
+	return hex.status;
+}
+
+// Line of the record being read, or the failed one
+uint32_t HEX_getLine(){
+	return hex.line;
+}
@@ -9,7 +9,7 @@
 		| (0b0 << _DEVCFG3_FUSBIDIO_POSITION)	// USBID controlled by PORT function
 		| (0b0 << _DEVCFG3_IOL1WAY_POSITION)		// Allow multiple reconfigurations of Peripheral Pins
 		| (0b0 << _DEVCFG3_PMDL1WAY_POSITION)	// Allow multiple reconfigurations of Peripheral Module Disable
-		| (0xF0C5 << _DEVCFG3_USERID_POSITION);	// UserID is F0C5
+		| (CONFIG_USERID << _DEVCFG3_USERID_POSITION);	// UserID, see configBits.h
 
 	const uint32_t __attribute__((section (".SECTION_DEVCFG2"))) temp2 =
 		0xFFF87888
@@ -29,7 +29,7 @@
 		| (0b1 << _DEVCFG1_OSCIOFNC_POSITION)	// CLOCK output disabled
 		| (0b01 << _DEVCFG1_POSCMOD_POSITION)	// XT oscillator mode
 		| (0b0 << _DEVCFG1_IESO_POSITION)		// Internal-External switchover disabled (Two-speed start-up disabled)
-		| (0b1 << _DEVCFG1_FSOSCEN_POSITION)		// Enable secondary oscillator (WARNING; CHECK IF PORTING)
+		| (0b0 << _DEVCFG1_FSOSCEN_POSITION)		// Secondary oscillator off, SOSCI/SOSCO (RB4/RA4) are the aux UART
 		| (0b011 << _DEVCFG1_FNOSC_POSITION);		// POSC (XT) + PLL selected
 
 	const uint32_t __attribute__((section (".SECTION_DEVCFG0"))) temp0 =
@@ -48,7 +48,7 @@
 
 #elif defined (__32MX440F256H__)
 
-	const uint32_t __attribute__((section (".SECTION_DEVCFG3"))) temp3 = 0xFFFFBEEF;   // DEVCFG3
+	const uint32_t __attribute__((section (".SECTION_DEVCFG3"))) temp3 = 0xFFFF0000 | CONFIG_USERID;   // DEVCFG3, UserID in the low half
 	const uint32_t __attribute__((section (".SECTION_DEVCFG2"))) temp2 =
 		0xFFF87888
 		| (0b000<<_DEVCFG2_FPLLODIV_POSITION)
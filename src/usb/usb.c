@@ -25,14 +25,19 @@
  *  with this software.  If not, see <http://www.apache.org/licenses/>.
  */
 
-#include <p32xxxx.h>
-#include <sys/kmem.h>	// Hm. TODO. KSEG address translation Why sys/kmem.h? Is included, should work without!!
-
 #include <string.h>
 
 #include "usb_config.h"
 #include "usb.h"
-#include "usb_hal.h"
+#include "usb_priv.h"
+/* All the hardware access (SFRs, BDT layout, address translation, cycle
+ * counter) goes through the HAL. Build with -D USB_HAL_HEADER='"file.h"'
+ * to put another one in its place, eg: a simulated SIE for a host build. */
+#ifdef USB_HAL_HEADER
+	#include USB_HAL_HEADER
+#else
+	#include "usb_hal.h"
+#endif
 #include "usb_ch9.h"
 #include "usb_microsoft.h"
 #include "usb_winusb.h"
@@ -88,7 +93,7 @@ STATIC_SIZE_CHECK_EQUAL(sizeof(struct microsoft_extended_compat_header), 16);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct microsoft_extended_compat_function), 24);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct microsoft_extended_properties_header), 10);
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct microsoft_extended_property_section_header), 8);
-#ifdef __XC32__
+#if defined(__XC32__) || defined(__PIC32MX__)
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct buffer_descriptor), 8);
 #else
 STATIC_SIZE_CHECK_EQUAL(sizeof(struct buffer_descriptor), 4);
@@ -142,6 +147,10 @@ STATIC_SIZE_CHECK_EQUAL(sizeof(struct buffer_descriptor), 4);
 #error "Must select a valid PPB_MODE"
 #endif
 
+#ifndef USB_SERVICE_TOKEN_BUDGET
+	#define USB_SERVICE_TOKEN_BUDGET 4 /* Depth of the USTAT FIFO */
+#endif
+
 #if defined(AUTOMATIC_WINUSB_SUPPORT) && !defined(MICROSOFT_OS_DESC_VENDOR_CODE)
 #error "Must define a MICROSOFT_OS_DESC_VENDOR_CODE for Automatic WinUSB"
 #endif
@@ -161,6 +170,115 @@ STATIC_SIZE_CHECK_EQUAL(sizeof(struct buffer_descriptor), 4);
 	#define MICROSOFT_CUSTOM_PROPERTY_DESCRIPTOR_FUNC m_stack_winusb_get_microsoft_property
 #endif
 
+/* Endpoints with EP_n_IN_DIRECT defined get no static IN buffers. The
+ * application gives the buffer per transaction with usb_send_in_buffer_at()
+ * or usb_start_in_transfer(). */
+#if NUM_ENDPOINT_NUMBERS >= 1
+	#ifdef EP_1_IN_DIRECT
+		#define EP_1_IN_BUF_LEN 0
+	#else
+		#define EP_1_IN_BUF_LEN EP_1_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 2
+	#ifdef EP_2_IN_DIRECT
+		#define EP_2_IN_BUF_LEN 0
+	#else
+		#define EP_2_IN_BUF_LEN EP_2_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 3
+	#ifdef EP_3_IN_DIRECT
+		#define EP_3_IN_BUF_LEN 0
+	#else
+		#define EP_3_IN_BUF_LEN EP_3_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 4
+	#ifdef EP_4_IN_DIRECT
+		#define EP_4_IN_BUF_LEN 0
+	#else
+		#define EP_4_IN_BUF_LEN EP_4_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 5
+	#ifdef EP_5_IN_DIRECT
+		#define EP_5_IN_BUF_LEN 0
+	#else
+		#define EP_5_IN_BUF_LEN EP_5_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 6
+	#ifdef EP_6_IN_DIRECT
+		#define EP_6_IN_BUF_LEN 0
+	#else
+		#define EP_6_IN_BUF_LEN EP_6_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 7
+	#ifdef EP_7_IN_DIRECT
+		#define EP_7_IN_BUF_LEN 0
+	#else
+		#define EP_7_IN_BUF_LEN EP_7_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 8
+	#ifdef EP_8_IN_DIRECT
+		#define EP_8_IN_BUF_LEN 0
+	#else
+		#define EP_8_IN_BUF_LEN EP_8_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 9
+	#ifdef EP_9_IN_DIRECT
+		#define EP_9_IN_BUF_LEN 0
+	#else
+		#define EP_9_IN_BUF_LEN EP_9_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 10
+	#ifdef EP_10_IN_DIRECT
+		#define EP_10_IN_BUF_LEN 0
+	#else
+		#define EP_10_IN_BUF_LEN EP_10_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 11
+	#ifdef EP_11_IN_DIRECT
+		#define EP_11_IN_BUF_LEN 0
+	#else
+		#define EP_11_IN_BUF_LEN EP_11_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 12
+	#ifdef EP_12_IN_DIRECT
+		#define EP_12_IN_BUF_LEN 0
+	#else
+		#define EP_12_IN_BUF_LEN EP_12_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 13
+	#ifdef EP_13_IN_DIRECT
+		#define EP_13_IN_BUF_LEN 0
+	#else
+		#define EP_13_IN_BUF_LEN EP_13_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 14
+	#ifdef EP_14_IN_DIRECT
+		#define EP_14_IN_BUF_LEN 0
+	#else
+		#define EP_14_IN_BUF_LEN EP_14_IN_LEN
+	#endif
+#endif
+#if NUM_ENDPOINT_NUMBERS >= 15
+	#ifdef EP_15_IN_DIRECT
+		#define EP_15_IN_BUF_LEN 0
+	#else
+		#define EP_15_IN_BUF_LEN EP_15_IN_LEN
+	#endif
+#endif
+
 // TODO OOOOOOOOO
 // #define BD_ATTR_TAG __attribute__((aligned(512), coherent))
 static struct buffer_descriptor bds[NUM_BD] BD_ATTR_TAG;
@@ -192,11 +310,11 @@ static struct {
 #ifdef PPB_EPn
 	#define EP_BUF(n) \
 		unsigned char ep_##n##_out_buf[2][EP_##n##_OUT_LEN]; \
-		unsigned char ep_##n##_in_buf[2][EP_##n##_IN_LEN];
+		unsigned char ep_##n##_in_buf[2][EP_##n##_IN_BUF_LEN];
 #else
 	#define EP_BUF(n) \
 		unsigned char ep_##n##_out_buf[1][EP_##n##_OUT_LEN]; \
-		unsigned char ep_##n##_in_buf[1][EP_##n##_IN_LEN];
+		unsigned char ep_##n##_in_buf[1][EP_##n##_IN_BUF_LEN];
 #endif
 
 #if NUM_ENDPOINT_NUMBERS >= 1
@@ -248,6 +366,7 @@ static struct {
 #undef EP_BUF
 } ep_buffers;
 
+/* Flags of endpoints 1-n are in ep_flags[], see EP_* below */
 struct ep_buf {
 	unsigned char * const out; /* buffers for the even buffer descriptor */
 	unsigned char * const in;  /* ie: ppbi = 0 */
@@ -265,7 +384,8 @@ struct ep_buf {
 #define EP_RX_PPBI 0x10 /* Represents the next buffer which will be need to be
                            reset and given back to the SIE. */
 #define EP_TX_PPBI 0x20 /* Represents the _next_ buffer to write into. */
-	uint8_t flags;
+#define EP_TX_ZLP 0x40  /* The last IN packet was full length, so the transfer
+                           needs a zero-length packet to end. */
 };
 
 struct ep0_buf {
@@ -302,27 +422,30 @@ struct ep0_buf {
 #endif
 
 
+/* NULL IN buffers for EP_n_IN_DIRECT endpoints */
+#define EP_IN_BUF(n, ppbi) (EP_##n##_IN_BUF_LEN? ep_buffers.ep_##n##_in_buf[ppbi]: NULL)
+
 #ifdef PPB_EPn
 	#define EP_BUFS(n) { ep_buffers.ep_##n##_out_buf[0], \
-	                     ep_buffers.ep_##n##_in_buf[0], \
+	                     EP_IN_BUF(n, 0), \
 	                     ep_buffers.ep_##n##_out_buf[1], \
-	                     ep_buffers.ep_##n##_in_buf[1], \
+	                     EP_IN_BUF(n, 1), \
 	                     EP_##n##_OUT_LEN, \
 	                     EP_##n##_IN_LEN },
 #else
 	#define EP_BUFS(n) { ep_buffers.ep_##n##_out_buf[0], \
-	                     ep_buffers.ep_##n##_in_buf[0], \
+	                     EP_IN_BUF(n, 0), \
 	                     EP_##n##_OUT_LEN, \
 	                     EP_##n##_IN_LEN },
 #endif
 
 static struct ep0_buf ep0_buf = EP_BUFS0();
 
-static struct ep_buf ep_buf[NUM_ENDPOINT_NUMBERS+1] = {
-#if NUM_ENDPOINT_NUMBERS >= 0
-	{ NULL, NULL },
-	/* TODO wasted space here */
-#endif
+/* Per-endpoint tables have no entry for endpoint 0, which uses ep0_buf */
+#define EP_IDX(n) ((n) - 1)
+
+/* Constant, so it stays in flash. The flags are kept apart, in ep_flags. */
+static const struct ep_buf ep_buf[NUM_ENDPOINT_NUMBERS] = {
 #if NUM_ENDPOINT_NUMBERS >= 1
 	EP_BUFS(1)
 #endif
@@ -370,6 +493,7 @@ static struct ep_buf ep_buf[NUM_ENDPOINT_NUMBERS+1] = {
 #endif
 
 };
+static uint8_t ep_flags[NUM_ENDPOINT_NUMBERS];
 #undef EP_BUFS
 #undef EP_BUFS0
 
@@ -381,6 +505,20 @@ static bool control_need_zlp;
 static bool returning_short;
 
 /* Data associated with multi-packet control transfers */
+/* U1STAT of the token being handled, read once per token in usb_service() */
+static struct {
+	uint8_t ep;
+	uint8_t dir;  /* 1=IN, 0=OUT */
+	uint8_t ppbi;
+} ustat;
+
+/* Per-endpoint transaction handlers, see usb_set_endpoint_handlers().
+ * Indexed with EP_IDX(). */
+static struct {
+	usb_transaction_callback in;
+	usb_transaction_callback out;
+} ep_handlers[NUM_ENDPOINT_NUMBERS];
+
 static usb_ep0_data_stage_callback ep0_data_stage_callback;
 static char   *ep0_data_stage_in_buffer; /* XC8 v1.12 fails if this is const on PIC16 */
 static char   *ep0_data_stage_out_buffer;
@@ -388,6 +526,28 @@ static size_t  ep0_data_stage_buf_remaining;
 static void   *ep0_data_stage_context;
 static uint8_t ep0_data_stage_direc; /*1=IN, 0=OUT, Same as USB spec.*/
 
+/* Multi-packet transfers, one per endpoint and direction.
+ * See usb_start_in_transfer() and usb_start_out_transfer(). */
+struct ep_transfer {
+	unsigned char *next;    /* Next byte to give to, or take from, the SIE */
+	size_t remaining;       /* Bytes not given/taken yet */
+	size_t done;            /* Bytes in completed transactions */
+	usb_transfer_callback callback;
+	void *context;
+	uint8_t in_flight;      /* IN: BDs loaded with this transfer's data */
+	bool zlp;               /* IN: zero-length packet still to be loaded */
+	bool active;
+};
+static struct ep_transfer in_transfer[NUM_ENDPOINT_NUMBERS];
+static struct ep_transfer out_transfer[NUM_ENDPOINT_NUMBERS];
+
+#ifdef USB_STATS
+static struct usb_stats stats;
+#define STATS(x) x
+#else
+#define STATS(x)
+#endif
+
 static void reset_ep0_data_stage()
 {
 	ep0_data_stage_in_buffer = NULL;
@@ -418,16 +578,20 @@ static void init_endpoints(void)
 	SFR_USB_PING_PONG_RESET = 1;
 	/* Reset the flags */
 	ep0_buf.flags = 0;
-	for (i = 0; i <= NUM_ENDPOINT_NUMBERS; i++) {
+	for (i = 1; i <= NUM_ENDPOINT_NUMBERS; i++) {
 #ifdef PPB_EPn
-		ep_buf[i].flags = 0;
+		ep_flags[EP_IDX(i)] = 0;
 #else
-		ep_buf[i].flags = EP_RX_DTS;
+		ep_flags[EP_IDX(i)] = EP_RX_DTS;
 #endif
 	}
 
-	/* Clear all the buffer-descriptors and re-initialize */
-	memset(bds, 0x0, sizeof(bds));
+	/* Abandon transfers in progress, the callbacks aren't called */
+	memset(in_transfer, 0x0, sizeof(in_transfer));
+	memset(out_transfer, 0x0, sizeof(out_transfer));
+
+	/* Re-initialize all the buffer-descriptors. Each one gets both its
+	   address and its status written below, so there is no memset. */
 
 	/* Setup endpoint 0 Output buffer descriptor.
 	   Input and output are from the HOST perspective. */
@@ -451,21 +615,21 @@ static void init_endpoints(void)
 	for (i = 1; i <= NUM_ENDPOINT_NUMBERS; i++) {
 		/* Setup endpoint 1 Output buffer descriptor.
 		   Input and output are from the HOST perspective. */
-		BDSnOUT(i,0).BDnADR = (BDNADR_TYPE) PHYS_ADDR(ep_buf[i].out);
-		SET_BDN(BDSnOUT(i,0), BDNSTAT_UOWN|BDNSTAT_DTSEN, ep_buf[i].out_len);
+		BDSnOUT(i,0).BDnADR = (BDNADR_TYPE) PHYS_ADDR(ep_buf[EP_IDX(i)].out);
+		SET_BDN(BDSnOUT(i,0), BDNSTAT_UOWN|BDNSTAT_DTSEN, ep_buf[EP_IDX(i)].out_len);
 #ifdef PPB_EPn
 		/* Initialize EVEN buffers when in ping-pong mode. */
-		BDSnOUT(i,1).BDnADR = (BDNADR_TYPE) PHYS_ADDR(ep_buf[i].out1);
-		SET_BDN(BDSnOUT(i,1), BDNSTAT_UOWN|BDNSTAT_DTSEN|BDNSTAT_DTS, ep_buf[i].out_len);
+		BDSnOUT(i,1).BDnADR = (BDNADR_TYPE) PHYS_ADDR(ep_buf[EP_IDX(i)].out1);
+		SET_BDN(BDSnOUT(i,1), BDNSTAT_UOWN|BDNSTAT_DTSEN|BDNSTAT_DTS, ep_buf[EP_IDX(i)].out_len);
 #endif
 		/* Setup endpoint 1 Input buffer descriptor.
 		   Input and output are from the HOST perspective. */
-		BDSnIN(i,0).BDnADR = (BDNADR_TYPE) PHYS_ADDR(ep_buf[i].in);
-		SET_BDN(BDSnIN(i,0), 0, ep_buf[i].in_len);
+		BDSnIN(i,0).BDnADR = (BDNADR_TYPE) PHYS_ADDR(ep_buf[EP_IDX(i)].in);
+		SET_BDN(BDSnIN(i,0), 0, ep_buf[EP_IDX(i)].in_len);
 #ifdef PPB_EPn
 		/* Initialize EVEN buffers when in ping-pong mode. */
-		BDSnIN(i,1).BDnADR = (BDNADR_TYPE) PHYS_ADDR(ep_buf[i].in1);
-		SET_BDN(BDSnIN(i,1), 0, ep_buf[i].in_len);
+		BDSnIN(i,1).BDnADR = (BDNADR_TYPE) PHYS_ADDR(ep_buf[EP_IDX(i)].in1);
+		SET_BDN(BDSnIN(i,1), 0, ep_buf[EP_IDX(i)].in_len);
 #endif
 	}
 
@@ -537,7 +701,7 @@ void usb_init(void)
 		void *ptr;
 	};
 	union WORD w;
-	w.w = KVA_TO_PA(bds);
+	w.w = PHYS_ADDR(bds);
 
 	SFR_BD_ADDR_REG1 = w.hb & 0xFE;
 	SFR_BD_ADDR_REG2 = w.ub;
@@ -616,7 +780,7 @@ static void reset_bd0_out(void)
 	 * Set the length and hand it back to the SIE.
 	 * The Address stays the same. */
 #ifdef PPB_EP0_OUT
-	SET_BDN(BDS0OUT(SFR_USB_STATUS_PPBI), BDNSTAT_UOWN, EP_0_LEN);
+	SET_BDN(BDS0OUT(ustat.ppbi), BDNSTAT_UOWN, EP_0_LEN);
 #else
 	SET_BDN(BDS0OUT(0), BDNSTAT_UOWN, EP_0_LEN);
 #endif
@@ -654,9 +818,9 @@ static void stall_ep_in(uint8_t ep)
 	/* Stall Endpoint. It's important that DTSEN and DTS are zero.
 	 * Although the datasheet doesn't stay it, the only safe way to do this
 	 * is to set BSTALL on BOTH buffers when in ping-pong mode. */
-	SET_BDN(BDSnIN(ep, 0), BDNSTAT_UOWN|BDNSTAT_BSTALL, ep_buf[ep].in_len);
+	SET_BDN(BDSnIN(ep, 0), BDNSTAT_UOWN|BDNSTAT_BSTALL, ep_buf[EP_IDX(ep)].in_len);
 #ifdef PPB_EPn
-	SET_BDN(BDSnIN(ep, 1), BDNSTAT_UOWN|BDNSTAT_BSTALL, ep_buf[ep].in_len);
+	SET_BDN(BDSnIN(ep, 1), BDNSTAT_UOWN|BDNSTAT_BSTALL, ep_buf[EP_IDX(ep)].in_len);
 #endif
 }
 
@@ -690,7 +854,7 @@ static void send_zero_length_packet_ep0()
 
 static void usb_send_in_buffer_0(size_t len)
 {
-	if (!usb_in_endpoint_halted(0)) {
+	if (!(ep0_buf.flags & EP_IN_HALT_FLAG)) {
 #ifdef PPB_EP0_IN
 		struct buffer_descriptor *bd;
 		uint8_t ppbi = (ep0_buf.flags & EP_TX_PPBI)? 1: 0;
@@ -782,7 +946,7 @@ static inline int8_t handle_standard_control_request()
 	int8_t res = 0;
 
 #ifdef PPB_EP0_OUT
-	if (SFR_USB_STATUS_PPBI)
+	if (ustat.ppbi)
 		setup = (struct setup_packet*) ep0_buf.out1;
 	else
 		setup = (struct setup_packet*) ep0_buf.out;
@@ -927,7 +1091,8 @@ static inline int8_t handle_standard_control_request()
 			/* Status of endpoint */
 			uint8_t ep_num = setup->wIndex & 0x0f;
 			if (ep_num <= NUM_ENDPOINT_NUMBERS) {
-				uint8_t flags = ep_buf[ep_num].flags;
+				/* Endpoint 0 can't stay halted */
+				uint8_t flags = (ep_num == 0)? 0: ep_flags[EP_IDX(ep_num)];
 				uint8_t ret[2];
 				ret[0] = ((setup->wIndex & 0x80) ?
 					flags & EP_IN_HALT_FLAG :
@@ -1013,37 +1178,38 @@ static inline int8_t handle_standard_control_request()
 							usb_halt_ep_out(ep_num);
 						}
 					}
-					else {
+					else if (ep_num > 0) {
 						/* Clear Endpoint Halt Feature.
 						   Clear the STALL on the affected endpoint. */
 						if (ep_dir) {
 #ifdef PPB_EPn
-							SET_BDN(BDSnIN(ep_num, 0), 0, ep_buf[ep_num].in_len);
-							SET_BDN(BDSnIN(ep_num, 1), 0, ep_buf[ep_num].in_len);
+							SET_BDN(BDSnIN(ep_num, 0), 0, ep_buf[EP_IDX(ep_num)].in_len);
+							SET_BDN(BDSnIN(ep_num, 1), 0, ep_buf[EP_IDX(ep_num)].in_len);
 #else
-							SET_BDN(BDSnIN(ep_num, 0), 0, ep_buf[ep_num].in_len);
+							SET_BDN(BDSnIN(ep_num, 0), 0, ep_buf[EP_IDX(ep_num)].in_len);
 #endif
 							/* Clear DTS. Next packet to be sent will be DATA0. */
-							ep_buf[ep_num].flags &= ~EP_TX_DTS;
+							ep_flags[EP_IDX(ep_num)] &= ~EP_TX_DTS;
+							ep_flags[EP_IDX(ep_num)] &= ~EP_TX_ZLP;
 
-							ep_buf[ep_num].flags &= ~(EP_IN_HALT_FLAG);
+							ep_flags[EP_IDX(ep_num)] &= ~(EP_IN_HALT_FLAG);
 						}
 						else {
 #ifdef PPB_EPn
-							uint8_t ppbi = (ep_buf[ep_num].flags & EP_RX_PPBI)? 1 : 0;
+							uint8_t ppbi = (ep_flags[EP_IDX(ep_num)] & EP_RX_PPBI)? 1 : 0;
 							/* Put the current buffer at DTS 0, and the next (opposite) buffer at DTS 1 */
-							SET_BDN(BDSnOUT(ep_num, ppbi), BDNSTAT_UOWN|BDNSTAT_DTSEN, ep_buf[ep_num].out_len);
-							SET_BDN(BDSnOUT(ep_num, !ppbi), BDNSTAT_UOWN|BDNSTAT_DTSEN|BDNSTAT_DTS, ep_buf[ep_num].out_len);
+							SET_BDN(BDSnOUT(ep_num, ppbi), BDNSTAT_UOWN|BDNSTAT_DTSEN, ep_buf[EP_IDX(ep_num)].out_len);
+							SET_BDN(BDSnOUT(ep_num, !ppbi), BDNSTAT_UOWN|BDNSTAT_DTSEN|BDNSTAT_DTS, ep_buf[EP_IDX(ep_num)].out_len);
 
 							/* Clear DTS */
-							ep_buf[ep_num].flags &= ~EP_RX_DTS;
+							ep_flags[EP_IDX(ep_num)] &= ~EP_RX_DTS;
 #else
-							SET_BDN(BDSnOUT(ep_num, 0), BDNSTAT_UOWN|BDNSTAT_DTSEN, ep_buf[ep_num].out_len);
+							SET_BDN(BDSnOUT(ep_num, 0), BDNSTAT_UOWN|BDNSTAT_DTSEN, ep_buf[EP_IDX(ep_num)].out_len);
 
 							/* Set DTS */
-							ep_buf[ep_num].flags |= EP_RX_DTS;
+							ep_flags[EP_IDX(ep_num)] |= EP_RX_DTS;
 #endif
-							ep_buf[ep_num].flags &= ~(EP_OUT_HALT_FLAG);
+							ep_flags[EP_IDX(ep_num)] &= ~(EP_OUT_HALT_FLAG);
 						}
 					}
 #ifdef ENDPOINT_HALT_CALLBACK
@@ -1077,7 +1243,7 @@ static inline void handle_ep0_setup()
 {
 	FAR struct setup_packet *setup;
 #ifdef PPB_EP0_OUT
-	if (SFR_USB_STATUS_PPBI)
+	if (ustat.ppbi)
 		setup = (struct setup_packet*) ep0_buf.out1;
 	else
 		setup = (struct setup_packet*) ep0_buf.out;
@@ -1190,7 +1356,7 @@ out:
 static inline void handle_ep0_out()
 {
 #ifdef PPB_EP0_OUT
-	uint8_t pkt_len = BDN_LENGTH(BDS0OUT(SFR_USB_STATUS_PPBI));
+	uint8_t pkt_len = BDN_LENGTH(BDS0OUT(ustat.ppbi));
 #else
 	uint8_t pkt_len = BDN_LENGTH(BDS0OUT(0));
 #endif
@@ -1215,7 +1381,7 @@ static inline void handle_ep0_out()
 		if (ep0_data_stage_out_buffer) {
 			uint8_t bytes_to_copy = MIN(pkt_len, ep0_data_stage_buf_remaining);
 #ifdef PPB_EP0_OUT
-			if (SFR_USB_STATUS_PPBI)
+			if (ustat.ppbi)
 				memcpy(ep0_data_stage_out_buffer, ep0_buf.out1, bytes_to_copy);
 			else
 				memcpy(ep0_data_stage_out_buffer, ep0_buf.out, bytes_to_copy);
@@ -1315,8 +1481,169 @@ static inline void handle_ep0_in()
 
 /* checkUSB() is called repeatedly to check for USB interrupts
    and service USB requests */
-void usb_service(void)
+/* Whether the SIE still owns the next IN BD of the endpoint. The stack
+ * uses this, so its own checks don't count in the stats. */
+static bool in_bd_busy(uint8_t endpoint)
+{
+#ifdef PPB_EPn
+	uint8_t ppbi = (ep_flags[EP_IDX(endpoint)] & EP_TX_PPBI)? 1: 0;
+	return BDSnIN(endpoint, ppbi).STAT.UOWN;
+#else
+	return BDSnIN(endpoint,0).STAT.UOWN;
+#endif
+}
+
+/* Hand one IN packet at buf to the SIE, in the next BD of the endpoint.
+ * BDnADR is set every time, since transfers point it outside of the
+ * endpoint's own buffers. */
+static void load_in_bd(uint8_t endpoint, const unsigned char *buf, size_t len)
+{
+	uint8_t pid;
+	struct buffer_descriptor *bd;
+#ifdef PPB_EPn
+	uint8_t ppbi = (ep_flags[EP_IDX(endpoint)] & EP_TX_PPBI)? 1 : 0;
+
+	bd = &BDSnIN(endpoint,ppbi);
+	bd->BDnADR = (BDNADR_TYPE) PHYS_ADDR(buf);
+	pid = (ep_flags[EP_IDX(endpoint)] & EP_TX_DTS)? 1 : 0;
+	bd->STAT.BDnSTAT = 0;
+
+	if (pid)
+		SET_BDN(BDSnIN(endpoint,ppbi),
+			BDNSTAT_UOWN|BDNSTAT_DTS|BDNSTAT_DTSEN, len);
+	else
+		SET_BDN(BDSnIN(endpoint,ppbi),
+			BDNSTAT_UOWN|BDNSTAT_DTSEN, len);
+
+	ep_flags[EP_IDX(endpoint)] ^= EP_TX_PPBI;
+	ep_flags[EP_IDX(endpoint)] ^= EP_TX_DTS;
+#else
+	bd = &BDSnIN(endpoint,0);
+	bd->BDnADR = (BDNADR_TYPE) PHYS_ADDR(buf);
+	pid = (ep_flags[EP_IDX(endpoint)] & EP_TX_DTS)? 1 : 0;
+	bd->STAT.BDnSTAT = 0;
+
+	if (pid)
+		SET_BDN(*bd,
+			BDNSTAT_UOWN|BDNSTAT_DTS|BDNSTAT_DTSEN, len);
+	else
+		SET_BDN(*bd,
+			BDNSTAT_UOWN|BDNSTAT_DTSEN, len);
+
+	ep_flags[EP_IDX(endpoint)] ^= EP_TX_DTS;
+#endif
+
+	/* A full-length packet doesn't end a transfer, so remember
+	 * that a zero-length packet is owed if no more data follows. */
+	if (len == ep_buf[EP_IDX(endpoint)].in_len)
+		ep_flags[EP_IDX(endpoint)] |= EP_TX_ZLP;
+	else
+		ep_flags[EP_IDX(endpoint)] &= ~EP_TX_ZLP;
+}
+
+/* Feed an IN transfer to the SIE: load every free BD (both, with
+ * ping-pong) with its next packet. Packets go straight from the caller's
+ * buffer when the USB module can reach it, else through the endpoint's
+ * own buffer. */
+static void in_transfer_load(uint8_t endpoint)
+{
+	struct ep_transfer *t = &in_transfer[EP_IDX(endpoint)];
+
+	while ((t->remaining > 0 || t->zlp) && !in_bd_busy(endpoint)) {
+		const unsigned char *src = t->next;
+		size_t len = t->remaining;
+
+		if (len > ep_buf[EP_IDX(endpoint)].in_len)
+			len = ep_buf[EP_IDX(endpoint)].in_len;
+
+		if (!USB_DMA_ADDRESSABLE(src)) {
+			unsigned char *buf = usb_get_in_buffer(endpoint);
+			memcpy(buf, src, len);
+			src = buf;
+		}
+		load_in_bd(endpoint, src, len);
+
+		t->next += len;
+		t->remaining -= len;
+		t->in_flight++;
+		t->zlp = false;
+	}
+}
+
+/* An IN transaction of a transfer has completed. Refill the BD right
+ * away, so the next IN token doesn't get a NAK. */
+static void in_transfer_transaction_done(uint8_t endpoint)
+{
+	struct ep_transfer *t = &in_transfer[EP_IDX(endpoint)];
+
+#ifdef PPB_EPn
+	t->done += BDN_LENGTH(BDSnIN(endpoint, ustat.ppbi));
+#else
+	t->done += BDN_LENGTH(BDSnIN(endpoint, 0));
+#endif
+	t->in_flight--;
+
+	in_transfer_load(endpoint);
+
+	if (t->in_flight == 0) {
+		t->active = false;
+		t->callback(endpoint, t->done, t->context);
+	}
+}
+
+/* Move received packets of an OUT transfer to the caller's buffer and give
+ * the BDs straight back to the SIE. A short packet ends the transfer. */
+static void out_transfer_take(uint8_t endpoint)
 {
+	struct ep_transfer *t = &out_transfer[EP_IDX(endpoint)];
+
+	while (t->active && usb_out_endpoint_has_data(endpoint)) {
+		const unsigned char *buf;
+		size_t len = usb_get_out_buffer(endpoint, &buf);
+		size_t n = (len < t->remaining)? len: t->remaining;
+
+		memcpy(t->next, buf, n);
+		t->next += n;
+		t->remaining -= n;
+		t->done += n;
+
+		usb_arm_out_endpoint(endpoint);
+
+		if (len < ep_buf[EP_IDX(endpoint)].out_len || t->remaining == 0) {
+			t->active = false;
+			t->callback(endpoint, t->done, t->context);
+		}
+	}
+}
+
+#ifdef USB_STATS
+/* Count the transaction in the U1STAT snapshot. PIC32 only has PPB_ALL, so endpoint 0
+ * is reached through BDSnIN()/BDSnOUT() with ping-pong like the others. */
+static void count_transaction(void)
+{
+	uint8_t ep = ustat.ep;
+
+	if (ep > NUM_ENDPOINT_NUMBERS)
+		return;
+
+	if (ustat.dir == 1 /*1=IN*/) {
+		stats.ep[ep].in_transactions++;
+		stats.ep[ep].in_bytes += BDN_LENGTH(BDSnIN(ep, ustat.ppbi));
+	}
+	else {
+		stats.ep[ep].out_transactions++;
+		stats.ep[ep].out_bytes += BDN_LENGTH(BDSnOUT(ep, ustat.ppbi));
+	}
+}
+#endif
+
+uint8_t usb_service(void)
+{
+	uint8_t tokens = 0;
+#ifdef USB_STATS
+	uint32_t start = USB_TICKS();
+#endif
+
 	if (SFR_USB_RESET_IF) {
 		/* A Reset was detected on the wire. Re-init the SIE. */
 #ifdef USB_RESET_CALLBACK
@@ -1324,6 +1651,7 @@ void usb_service(void)
 #endif
 		usb_init();
 		CLEAR_USB_RESET_IF();
+		STATS(stats.resets++);
 		SERIAL("USB Reset");
 	}
 	
@@ -1340,72 +1668,97 @@ void usb_service(void)
 		}
 
 		CLEAR_USB_STALL_IF();
+		STATS(stats.stalls++);
 	}
 
 	_nop();
 
+	/* Handle every completed token in the USTAT FIFO (up to
+	 * USB_SERVICE_TOKEN_BUDGET), not just one. Clearing TRNIF moves the
+	 * next one into U1STAT. */
 #ifdef USB_USE_INTERRUPTS
-	if (SFR_USB_TOKEN_IF && SFR_TRANSFER_IE) {
+	while (SFR_USB_TOKEN_IF && SFR_TRANSFER_IE && tokens < USB_SERVICE_TOKEN_BUDGET) {
 #else
-	if (SFR_USB_TOKEN_IF) {
+	while (SFR_USB_TOKEN_IF && tokens < USB_SERVICE_TOKEN_BUDGET) {
 #endif
 
-		//struct ustat_bits ustat = *((struct ustat_bits*)&USTAT);
+		/* One read of U1STAT. Its fields stay valid until TRNIF is
+		 * cleared, but the SFR is volatile, so don't re-read it. */
+		uint8_t stat = SFR_USB_STATUS;
+		ustat.ep = USTAT_EP(stat);
+		ustat.dir = USTAT_DIR(stat);
+		ustat.ppbi = USTAT_PPBI(stat);
+
+#ifdef USB_STATS
+		count_transaction();
+#endif
 
-		if (SFR_USB_STATUS_EP == 0 && SFR_USB_STATUS_DIR == 0/*OUT*/) {
-			/* An OUT or SETUP transaction has completed on
-			 * Endpoint 0.  Handle the data that was received.
-			 */
+		if (ustat.ep == 0) {
+			if (ustat.dir == 0/*OUT*/) {
+				/* An OUT or SETUP transaction has completed on
+				 * Endpoint 0.  Handle the data that was received.
+				 */
 #ifdef PPB_EP0_OUT
-			uint8_t pid = BDS0OUT(SFR_USB_STATUS_PPBI).STAT.PID;
+				uint8_t pid = BDS0OUT(ustat.ppbi).STAT.PID;
 #else
-			uint8_t pid = BDS0OUT(0).STAT.PID;
+				uint8_t pid = BDS0OUT(0).STAT.PID;
 #endif
-			if (pid == PID_SETUP) {
-				handle_ep0_setup();
-			}
-			else if (pid == PID_IN) {
-				/* Nonsense condition:
-				   (PID IN on SFR_USB_STATUS_DIR == OUT) */
-			}
-			else if (pid == PID_OUT) {
-				handle_ep0_out();
+				if (pid == PID_SETUP) {
+					handle_ep0_setup();
+				}
+				else if (pid == PID_IN) {
+					/* Nonsense condition:
+					   (PID IN on ustat.dir == OUT) */
+				}
+				else if (pid == PID_OUT) {
+					handle_ep0_out();
+				}
+				else {
+					/* Unsupported PID. Stall the Endpoint. */
+					SERIAL("Unsupported PID. Stall.");
+					stall_ep0();
+				}
+
+				reset_bd0_out();
 			}
 			else {
-				/* Unsupported PID. Stall the Endpoint. */
-				SERIAL("Unsupported PID. Stall.");
-				stall_ep0();
+				/* An IN transaction has completed. The endpoint
+				 * needs to be re-loaded with the next transaction's
+				 * data if there is any.
+				 */
+				handle_ep0_in();
 			}
-
-			reset_bd0_out();
-		}
-		else if (SFR_USB_STATUS_EP == 0 && SFR_USB_STATUS_DIR == 1/*1=IN*/) {
-			/* An IN transaction has completed. The endpoint
-			 * needs to be re-loaded with the next transaction's
-			 * data if there is any.
-			 */
-			handle_ep0_in();
 		}
-		else if (SFR_USB_STATUS_EP > 0 && SFR_USB_STATUS_EP <= NUM_ENDPOINT_NUMBERS) {
-			if (SFR_USB_STATUS_DIR == 1 /*1=IN*/) {
+		else if (ustat.ep <= NUM_ENDPOINT_NUMBERS) {
+			uint8_t ep = ustat.ep;
+
+			if (ustat.dir == 1 /*1=IN*/) {
 				/* An IN transaction has completed. */
 				SERIAL("IN transaction completed on non-EP0.");
-				if (ep_buf[SFR_USB_STATUS_EP].flags & EP_IN_HALT_FLAG)
-					stall_ep_in(SFR_USB_STATUS_EP);
+				if (ep_flags[EP_IDX(ep)] & EP_IN_HALT_FLAG)
+					stall_ep_in(ep);
+				else if (in_transfer[EP_IDX(ep)].active)
+					in_transfer_transaction_done(ep);
+				else if (ep_handlers[EP_IDX(ep)].in)
+					ep_handlers[EP_IDX(ep)].in(ep);
 				else {
 #ifdef IN_TRANSACTION_COMPLETE_CALLBACK
-					IN_TRANSACTION_COMPLETE_CALLBACK(SFR_USB_STATUS_EP);
+					IN_TRANSACTION_COMPLETE_CALLBACK(ep);
 #endif
 				}
 			}
 			else {
 				/* An OUT transaction has completed. */
 				SERIAL("OUT transaction received on non-EP0");
-				if (ep_buf[SFR_USB_STATUS_EP].flags & EP_OUT_HALT_FLAG)
-					stall_ep_out(SFR_USB_STATUS_EP);
+				if (ep_flags[EP_IDX(ep)] & EP_OUT_HALT_FLAG)
+					stall_ep_out(ep);
+				else if (out_transfer[EP_IDX(ep)].active)
+					out_transfer_take(ep);
+				else if (ep_handlers[EP_IDX(ep)].out)
+					ep_handlers[EP_IDX(ep)].out(ep);
 				else {
 #ifdef OUT_TRANSACTION_CALLBACK
-					OUT_TRANSACTION_CALLBACK(SFR_USB_STATUS_EP);
+					OUT_TRANSACTION_CALLBACK(ep);
 #endif
 				}
 			}
@@ -1417,6 +1770,7 @@ void usb_service(void)
 		}
 
 		CLEAR_USB_TOKEN_IF();
+		tokens++;
 	}
 	
 	/* Check for Start-of-Frame interrupt. */
@@ -1425,12 +1779,30 @@ void usb_service(void)
 		START_OF_FRAME_CALLBACK();
 #endif
 		CLEAR_USB_SOF_IF();
+		STATS(stats.sofs++);
 	}
 
 	/* Check for USB Interrupt. */
 	if (SFR_USB_IF) {
 		SFR_USB_IF = 0;
 	}
+
+#ifdef USB_USE_INTERRUPTS
+	/* Out of budget with tokens left. Clearing the CPU flag above
+	 * dropped them, so come right back. */
+	if (SFR_USB_TOKEN_IF && SFR_TRANSFER_IE)
+		SFR_USB_IF = 1;
+#endif
+
+#ifdef USB_STATS
+	{
+		uint32_t ticks = USB_TICKS() - start;
+		if (ticks > stats.max_service_ticks)
+			stats.max_service_ticks = ticks;
+	}
+#endif
+
+	return tokens;
 }
 
 uint8_t usb_get_configuration(void)
@@ -1441,12 +1813,12 @@ uint8_t usb_get_configuration(void)
 unsigned char *usb_get_in_buffer(uint8_t endpoint)
 {
 #ifdef PPB_EPn
-	if (ep_buf[endpoint].flags & EP_TX_PPBI /*odd*/)
-		return ep_buf[endpoint].in1;
+	if (ep_flags[EP_IDX(endpoint)] & EP_TX_PPBI /*odd*/)
+		return ep_buf[EP_IDX(endpoint)].in1;
 	else
-		return ep_buf[endpoint].in;
+		return ep_buf[EP_IDX(endpoint)].in;
 #else
-	return ep_buf[endpoint].in;
+	return ep_buf[EP_IDX(endpoint)].in;
 #endif
 }
 
@@ -1456,50 +1828,34 @@ void usb_send_in_buffer(uint8_t endpoint, size_t len)
 	if (endpoint == 0)
 		error();
 #endif
-	if (g_configuration > 0 && !usb_in_endpoint_halted(endpoint)) {
-		uint8_t pid;
-		struct buffer_descriptor *bd;
-#ifdef PPB_EPn
-		uint8_t ppbi = (ep_buf[endpoint].flags & EP_TX_PPBI)? 1 : 0;
-
-		bd = &BDSnIN(endpoint,ppbi);
-		pid = (ep_buf[endpoint].flags & EP_TX_DTS)? 1 : 0;
-		bd->STAT.BDnSTAT = 0;
-
-		if (pid)
-			SET_BDN(BDSnIN(endpoint,ppbi),
-				BDNSTAT_UOWN|BDNSTAT_DTS|BDNSTAT_DTSEN, len);
-		else
-			SET_BDN(BDSnIN(endpoint,ppbi),
-				BDNSTAT_UOWN|BDNSTAT_DTSEN, len);
-
-		ep_buf[endpoint].flags ^= EP_TX_PPBI;
-		ep_buf[endpoint].flags ^= EP_TX_DTS;
-#else
-		bd = &BDSnIN(endpoint,0);
-		pid = (ep_buf[endpoint].flags & EP_TX_DTS)? 1 : 0;
-		bd->STAT.BDnSTAT = 0;
-
-		if (pid)
-			SET_BDN(*bd,
-				BDNSTAT_UOWN|BDNSTAT_DTS|BDNSTAT_DTSEN, len);
-		else
-			SET_BDN(*bd,
-				BDNSTAT_UOWN|BDNSTAT_DTSEN, len);
+	if (g_configuration > 0 && !usb_in_endpoint_halted(endpoint))
+		load_in_bd(endpoint, usb_get_in_buffer(endpoint), len);
+}
 
-		ep_buf[endpoint].flags ^= EP_TX_DTS;
+void usb_send_in_buffer_at(uint8_t endpoint, const void *buffer, size_t len)
+{
+#ifdef DEBUG
+	if (endpoint == 0 || !USB_DMA_ADDRESSABLE(buffer))
+		error();
 #endif
-	}
+	if (g_configuration > 0 && !usb_in_endpoint_halted(endpoint))
+		load_in_bd(endpoint, buffer, len);
+}
+
+bool usb_in_endpoint_needs_zlp(uint8_t endpoint)
+{
+	return ep_flags[EP_IDX(endpoint)] & EP_TX_ZLP;
 }
 
 bool usb_in_endpoint_busy(uint8_t endpoint)
 {
-#ifdef PPB_EPn
-	uint8_t ppbi = (ep_buf[endpoint].flags & EP_TX_PPBI)? 1: 0;
-	return BDSnIN(endpoint, ppbi).STAT.UOWN;
-#else
-	return BDSnIN(endpoint,0).STAT.UOWN;
+	bool busy = in_bd_busy(endpoint);
+
+#ifdef USB_STATS
+	if (busy)
+		stats.ep[endpoint].in_busy++;
 #endif
+	return busy;
 }
 
 uint8_t usb_halt_ep_in(uint8_t ep)
@@ -1507,7 +1863,8 @@ uint8_t usb_halt_ep_in(uint8_t ep)
 	if (ep == 0 || ep > NUM_ENDPOINT_NUMBERS)
 		return -1;
 
-	ep_buf[ep].flags |= EP_IN_HALT_FLAG;
+	ep_flags[EP_IDX(ep)] |= EP_IN_HALT_FLAG;
+	in_transfer[EP_IDX(ep)].active = false;
 	stall_ep_in(ep);
 
 	return 0;
@@ -1515,22 +1872,22 @@ uint8_t usb_halt_ep_in(uint8_t ep)
 
 bool usb_in_endpoint_halted(uint8_t endpoint)
 {
-	return ep_buf[endpoint].flags & EP_IN_HALT_FLAG;
+	return ep_flags[EP_IDX(endpoint)] & EP_IN_HALT_FLAG;
 }
 
 uint8_t usb_get_out_buffer(uint8_t endpoint, const unsigned char **buf)
 {
 #ifdef PPB_EPn
-	uint8_t ppbi = (ep_buf[endpoint].flags & EP_RX_PPBI)? 1: 0;
+	uint8_t ppbi = (ep_flags[EP_IDX(endpoint)] & EP_RX_PPBI)? 1: 0;
 
 	if (ppbi /*odd*/)
-		*buf = ep_buf[endpoint].out1;
+		*buf = ep_buf[EP_IDX(endpoint)].out1;
 	else
-		*buf = ep_buf[endpoint].out;
+		*buf = ep_buf[EP_IDX(endpoint)].out;
 
 	return BDN_LENGTH(BDSnOUT(endpoint, ppbi));
 #else
-	*buf = ep_buf[endpoint].out;
+	*buf = ep_buf[EP_IDX(endpoint)].out;
 	return BDN_LENGTH(BDSnOUT(endpoint, 0));
 #endif
 }
@@ -1538,7 +1895,7 @@ uint8_t usb_get_out_buffer(uint8_t endpoint, const unsigned char **buf)
 bool usb_out_endpoint_has_data(uint8_t endpoint)
 {
 #ifdef PPB_EPn
-	uint8_t ppbi = (ep_buf[endpoint].flags & EP_RX_PPBI)? 1: 0;
+	uint8_t ppbi = (ep_flags[EP_IDX(endpoint)] & EP_RX_PPBI)? 1: 0;
 	return !BDSnOUT(endpoint,ppbi).STAT.UOWN;
 #else
 	return !BDSnOUT(endpoint,0).STAT.UOWN;
@@ -1548,34 +1905,34 @@ bool usb_out_endpoint_has_data(uint8_t endpoint)
 void usb_arm_out_endpoint(uint8_t endpoint)
 {
 #ifdef PPB_EPn
-	uint8_t ppbi = (ep_buf[endpoint].flags & EP_RX_PPBI)? 1: 0;
-	uint8_t pid = (ep_buf[endpoint].flags & EP_RX_DTS)? 1: 0;
+	uint8_t ppbi = (ep_flags[EP_IDX(endpoint)] & EP_RX_PPBI)? 1: 0;
+	uint8_t pid = (ep_flags[EP_IDX(endpoint)] & EP_RX_DTS)? 1: 0;
 
 	if (pid)
 		SET_BDN(BDSnOUT(endpoint,ppbi),
 			BDNSTAT_UOWN|BDNSTAT_DTSEN|BDNSTAT_DTS,
-			ep_buf[endpoint].out_len);
+			ep_buf[EP_IDX(endpoint)].out_len);
 	else
 		SET_BDN(BDSnOUT(endpoint,ppbi),
 			BDNSTAT_UOWN|BDNSTAT_DTSEN,
-			ep_buf[endpoint].out_len);
+			ep_buf[EP_IDX(endpoint)].out_len);
 
 	/* Alternate the PPBI */
-	ep_buf[endpoint].flags ^= EP_RX_PPBI;
-	ep_buf[endpoint].flags ^= EP_RX_DTS;
+	ep_flags[EP_IDX(endpoint)] ^= EP_RX_PPBI;
+	ep_flags[EP_IDX(endpoint)] ^= EP_RX_DTS;
 
 #else
-	uint8_t pid = (ep_buf[endpoint].flags & EP_RX_DTS)? 1: 0;
+	uint8_t pid = (ep_flags[EP_IDX(endpoint)] & EP_RX_DTS)? 1: 0;
 	if (pid)
 		SET_BDN(BDSnOUT(endpoint,0),
 			BDNSTAT_UOWN|BDNSTAT_DTS|BDNSTAT_DTSEN,
-			ep_buf[endpoint].out_len);
+			ep_buf[EP_IDX(endpoint)].out_len);
 	else
 		SET_BDN(BDSnOUT(endpoint,0),
 			BDNSTAT_UOWN|BDNSTAT_DTSEN,
-			ep_buf[endpoint].out_len);
+			ep_buf[EP_IDX(endpoint)].out_len);
 
-	ep_buf[endpoint].flags ^= EP_RX_DTS;
+	ep_flags[EP_IDX(endpoint)] ^= EP_RX_DTS;
 #endif
 
 }
@@ -1585,7 +1942,8 @@ uint8_t usb_halt_ep_out(uint8_t ep)
 	if (ep == 0 || ep > NUM_ENDPOINT_NUMBERS)
 		return -1;
 
-	ep_buf[ep].flags |= EP_OUT_HALT_FLAG;
+	ep_flags[EP_IDX(ep)] |= EP_OUT_HALT_FLAG;
+	out_transfer[EP_IDX(ep)].active = false;
 	stall_ep_out(ep);
 
 	return 0;
@@ -1593,7 +1951,7 @@ uint8_t usb_halt_ep_out(uint8_t ep)
 
 bool usb_out_endpoint_halted(uint8_t endpoint)
 {
-	return ep_buf[endpoint].flags & EP_OUT_HALT_FLAG;
+	return ep_flags[EP_IDX(endpoint)] & EP_OUT_HALT_FLAG;
 }
 
 void usb_start_receive_ep0_data_stage(char *buffer, size_t len,
@@ -1617,6 +1975,113 @@ void usb_send_data_stage(char *buffer, size_t len,
 	start_control_return(buffer, len, len);
 }
 
+int8_t usb_start_in_transfer(uint8_t endpoint, const void *buffer, size_t len,
+                              usb_transfer_callback callback, void *context)
+{
+	struct ep_transfer *t = &in_transfer[EP_IDX(endpoint)];
+	int8_t ret = -1;
+#ifdef USB_USE_INTERRUPTS
+	bool ie = SFR_TRANSFER_IE;
+	SFR_TRANSFER_IE = 0;
+#endif
+
+	/* Both BDs must be free, so each completed IN transaction from
+	 * here on belongs to this transfer. */
+	if (endpoint > 0 && endpoint <= NUM_ENDPOINT_NUMBERS &&
+	    g_configuration > 0 && !usb_in_endpoint_halted(endpoint) &&
+	    !t->active &&
+	    (USB_DMA_ADDRESSABLE(buffer) || ep_buf[EP_IDX(endpoint)].in) &&
+#ifdef PPB_EPn
+	    !BDSnIN(endpoint,1).STAT.UOWN &&
+#endif
+	    !BDSnIN(endpoint,0).STAT.UOWN) {
+		t->next = (unsigned char *) buffer;
+		t->remaining = len;
+		t->done = 0;
+		t->callback = callback;
+		t->context = context;
+		t->in_flight = 0;
+		t->zlp = (len == 0);
+		t->active = true;
+
+		in_transfer_load(endpoint);
+		ret = 0;
+	}
+
+#ifdef USB_USE_INTERRUPTS
+	if (ie)
+		usb_enable_transaction_interrupt();
+#endif
+	return ret;
+}
+
+int8_t usb_start_out_transfer(uint8_t endpoint, void *buffer, size_t len,
+                               usb_transfer_callback callback, void *context)
+{
+	struct ep_transfer *t = &out_transfer[EP_IDX(endpoint)];
+	int8_t ret = -1;
+#ifdef USB_USE_INTERRUPTS
+	bool ie = SFR_TRANSFER_IE;
+	SFR_TRANSFER_IE = 0;
+#endif
+
+	if (endpoint > 0 && endpoint <= NUM_ENDPOINT_NUMBERS &&
+	    g_configuration > 0 && !usb_out_endpoint_halted(endpoint) &&
+	    !t->active) {
+		t->next = buffer;
+		t->remaining = len;
+		t->done = 0;
+		t->callback = callback;
+		t->context = context;
+		t->active = true;
+
+		/* Packets received before the transfer was started are
+		 * the first part of it. */
+		out_transfer_take(endpoint);
+		ret = 0;
+	}
+
+#ifdef USB_USE_INTERRUPTS
+	if (ie)
+		usb_enable_transaction_interrupt();
+#endif
+	return ret;
+}
+
+void usb_set_endpoint_handlers(uint8_t endpoint,
+                               usb_transaction_callback in,
+                               usb_transaction_callback out)
+{
+	if (endpoint == 0 || endpoint > NUM_ENDPOINT_NUMBERS)
+		return;
+
+	ep_handlers[EP_IDX(endpoint)].in = in;
+	ep_handlers[EP_IDX(endpoint)].out = out;
+}
+
+bool usb_in_transfer_active(uint8_t endpoint)
+{
+	return in_transfer[EP_IDX(endpoint)].active;
+}
+
+bool usb_out_transfer_active(uint8_t endpoint)
+{
+	return out_transfer[EP_IDX(endpoint)].active;
+}
+
+#ifdef USB_STATS
+void usb_get_stats(struct usb_stats *copy_to)
+{
+	/* Each counter is one word, they are not a consistent set */
+	*copy_to = stats;
+}
+
+void usb_clear_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+#endif
+
 /* Private Functions */
 
 #ifdef USB_USE_INTERRUPTS
@@ -1630,24 +2095,30 @@ void usb_disable_transaction_interrupt()
 void usb_enable_transaction_interrupt()
 {
 	SFR_TRANSFER_IE = 1;
+	/* A token that completed meanwhile only raises the CPU interrupt
+	 * on a new event. Don't let it wait for one. */
+	if (SFR_USB_TOKEN_IF)
+		SFR_USB_IF = 1;
 }
-#endif
 
+void usb_disable_interrupt()
+{
+	USB_IE_DISABLE();
+}
 
-#ifdef USB_USE_INTERRUPTS
-/* No parameter for interrupt() means to use IPL=RIPL and to detect whether
-   to use shadow registers or not. This is the safest option, but if a user
-   wanted maximum performance, they could use IPL7SRS and set the USBIP to 7.
-   IPL 7 is the only time the shadow register set can be used on PIC32MX. */
-/*
-void __attribute__((vector(_USB_1_VECTOR), interrupt(), nomips16)) _USB1Interrupt()
+void usb_enable_interrupt()
 {
-	usb_service();
+	/* USBIF stays set while masked, the ISR runs on re-enable */
+	USB_IE_ENABLE();
 }
-*/
-// TODO, just added the interrupt from isrwrapper.c. Above also supports SHADOW registers, which aren't supported yet.s
-// TODO2, get this working later.
-void USBInterrupt(){
+#endif
+
+
+#if defined(USB_USE_INTERRUPTS) && !defined(USB_HAL_HEADER)
+/* The USB interrupt runs at IPL7 (see USBIP in main.c), above the UARTs.
+   INTERRUPT() binds it through the vector wrapper, which saves the registers
+   like for the other handlers. */
+INTERRUPT(USBInterrupt){
 	usb_service();
 }
 
@@ -18,6 +18,8 @@
  * Signal 11 Software
  */
 
+#include <p32xxxx.h>
+#include <configBits.h>	// temp3, DEVCFG3 with the USERID
 #include "usb_config.h"
 #include "usb.h"
 #include "usb_ch9.h"
@@ -67,6 +69,21 @@ struct configuration_1_packet {
 	struct endpoint_descriptor       data_ep_in;
 	struct endpoint_descriptor       data_ep_out;
 
+	/* Second CDC ACM function, for the auxiliary UART */
+	struct interface_association_descriptor iad_aux;
+	struct interface_descriptor      cdc_class_interface_aux;
+	struct cdc_functional_descriptor_header cdc_func_header_aux;
+	struct cdc_acm_functional_descriptor cdc_acm_aux;
+	struct cdc_union_functional_descriptor cdc_union_aux;
+	struct endpoint_descriptor       cdc_ep_aux;
+	struct interface_descriptor      cdc_data_interface_aux;
+	struct endpoint_descriptor       data_ep_in_aux;
+	struct endpoint_descriptor       data_ep_out_aux;
+
+	/* Programmer command channel, vendor specific */
+	struct interface_descriptor      comms_interface;
+	struct endpoint_descriptor       comms_ep_in;
+	struct endpoint_descriptor       comms_ep_out;
 };
 
 
@@ -89,7 +106,7 @@ const ROMPTR struct device_descriptor this_device_descriptor =
 											// automatically in Windows - https://docs.microsoft.com/en-us/windows-hardware/drivers/usbcon/usb-driver-installation-based-on-compatible-ids
 											// TODO CHECK!
 	0x01, 									// Protocol. Unsure what to set
-	EP_0_LEN, 								// bMaxPacketSize0 - Could be bigger? Check.
+	EP_0_LEN, 								// bMaxPacketSize0, see usb_config.h
 	0x1209, 								// VID - Vendor ID, from pid.codes
 	0x4E52, 								// PID - Product - "NR" - not set in stone, need to submit to pid.codes for approval.
 	0x0001, // device release (1.0)
@@ -115,7 +132,7 @@ static const ROMPTR struct configuration_1_packet configuration_1 =
 	sizeof(struct configuration_descriptor),
 	DESC_CONFIGURATION,
 	sizeof(configuration_1), // wTotalLength (length of the whole packet)
-	2, // bNumInterfaces
+	5, // bNumInterfaces
 	1, // bConfigurationValue
 	2, // iConfiguration (index of string descriptor)
 	0b10000000,
@@ -218,6 +235,136 @@ static const ROMPTR struct configuration_1_packet configuration_1 =
 	EP_2_OUT_LEN, // wMaxPacketSize
 	1, // bInterval in ms.
 	},
+
+	/* Second CDC ACM function - same as the first, on interfaces 2 and 3,
+	 * endpoints 3 and 4. */
+
+	/* Interface Association Descriptor */
+	{
+	sizeof(struct interface_association_descriptor),
+	DESC_INTERFACE_ASSOCIATION,
+	2, /* bFirstInterface */
+	2, /* bInterfaceCount */
+	CDC_COMMUNICATION_INTERFACE_CLASS,
+	CDC_COMMUNICATION_INTERFACE_CLASS_ACM_SUBCLASS,
+	0, /* bFunctionProtocol */
+	6, /* iFunction (string descriptor index) */
+	},
+
+	/* CDC Class Interface */
+	{
+	sizeof(struct interface_descriptor), // bLength;
+	DESC_INTERFACE,
+	0x2, // InterfaceNumber
+	0x0, // AlternateSetting
+	0x1, // bNumEndpoints
+	CDC_COMMUNICATION_INTERFACE_CLASS, // bInterfaceClass
+	CDC_COMMUNICATION_INTERFACE_CLASS_ACM_SUBCLASS, // bInterfaceSubclass
+	0x00, // bInterfaceProtocol
+	0x03, // iInterface (index of string describing interface)
+	},
+
+	/* CDC Functional Descriptor Header */
+	{
+	sizeof(struct cdc_functional_descriptor_header),
+	DESC_CS_INTERFACE,
+	CDC_FUNCTIONAL_DESCRIPTOR_SUBTYPE_HEADER,
+	0x0110, /* bcdCDC (version in BCD) */
+	},
+
+	/* CDC ACM Functional Descriptor */
+	{
+	sizeof(struct cdc_acm_functional_descriptor),
+	DESC_CS_INTERFACE,
+	CDC_FUNCTIONAL_DESCRIPTOR_SUBTYPE_ACM,
+	CDC_ACM_CAPABILITY_LINE_CODINGS | CDC_ACM_CAPABILITY_SEND_BREAK,
+	},
+
+	/* CDC Union Functional Descriptor */
+	{
+	sizeof (struct cdc_union_functional_descriptor),
+	DESC_CS_INTERFACE,
+	CDC_FUNCTIONAL_DESCRIPTOR_SUBTYPE_UNION,
+	2, /* bMasterInterface */
+	3, /* bSlaveInterface0 */
+	},
+
+	/* CDC ACM Notification Endpoint (Endpoint 3 IN) */
+	{
+	sizeof(struct endpoint_descriptor),
+	DESC_ENDPOINT,
+	0x03 | 0x80, // endpoint #3 0x80=IN
+	EP_INTERRUPT, // bmAttributes
+	EP_3_IN_LEN, // wMaxPacketSize
+	1, // bInterval in ms.
+	},
+
+	/* CDC Data Interface */
+	{
+	sizeof(struct interface_descriptor), // bLength;
+	DESC_INTERFACE,
+	0x3, // InterfaceNumber
+	0x0, // AlternateSetting
+	0x2, // bNumEndpoints
+	CDC_DATA_INTERFACE_CLASS, // bInterfaceClass
+	0, // bInterfaceSubclass (no subclass)
+	CDC_DATA_INTERFACE_CLASS_PROTOCOL_NONE, // bInterfaceProtocol
+	0x04, // iInterface (index of string describing interface)
+	},
+
+	/* CDC Data IN Endpoint */
+	{
+	sizeof(struct endpoint_descriptor),
+	DESC_ENDPOINT,
+	0x04 | 0x80, // endpoint #4 0x80=IN
+	EP_BULK, // bmAttributes
+	EP_4_IN_LEN, // wMaxPacketSize
+	1, // bInterval in ms.
+	},
+
+	/* CDC Data OUT Endpoint */
+	{
+	sizeof(struct endpoint_descriptor),
+	DESC_ENDPOINT,
+	0x04 /*| 0x00*/, // endpoint #4 0x00=OUT
+	EP_BULK, // bmAttributes
+	EP_4_OUT_LEN, // wMaxPacketSize
+	1, // bInterval in ms.
+	},
+
+	/* Programmer command channel, on its own interface. Vendor class, no
+	 * association descriptor needed. */
+	{
+	sizeof(struct interface_descriptor), // bLength;
+	DESC_INTERFACE,
+	0x4, // InterfaceNumber
+	0x0, // AlternateSetting
+	0x2, // bNumEndpoints
+	0xFF, // bInterfaceClass (vendor specific)
+	0x00, // bInterfaceSubclass
+	0x00, // bInterfaceProtocol
+	0x07, // iInterface (index of string describing interface)
+	},
+
+	/* Command reply IN Endpoint */
+	{
+	sizeof(struct endpoint_descriptor),
+	DESC_ENDPOINT,
+	0x05 | 0x80, // endpoint #5 0x80=IN
+	EP_BULK, // bmAttributes
+	EP_5_IN_LEN, // wMaxPacketSize
+	1, // bInterval in ms.
+	},
+
+	/* Command OUT Endpoint */
+	{
+	sizeof(struct endpoint_descriptor),
+	DESC_ENDPOINT,
+	0x05 /*| 0x00*/, // endpoint #5 0x00=OUT
+	EP_BULK, // bmAttributes
+	EP_5_OUT_LEN, // wMaxPacketSize
+	1, // bInterval in ms.
+	},
 };
 
 /* String Descriptors
@@ -262,62 +409,83 @@ static const ROMPTR struct {uint8_t bLength;uint8_t bDescriptorType; uint16_t ch
 	{'C','D','C',' ','D','a','t','a',' ','I','n','t','e','r','f','a','c','e'}
 };
 
-static const ROMPTR struct {uint8_t bLength;uint8_t bDescriptorType; uint16_t chars[59]; } fake_serial_num = {
-	sizeof(fake_serial_num),
+static const ROMPTR struct {uint8_t bLength;uint8_t bDescriptorType; uint16_t chars[17]; } aux_function_string = {
+	sizeof(aux_function_string),
+	DESC_STRING,
+	{'D','e','b','u','g',' ','t','o','o','l',' ','v','1',' ','A','u','x'}
+};
+
+static const ROMPTR struct {uint8_t bLength;uint8_t bDescriptorType; uint16_t chars[24]; } comms_interface_string = {
+	sizeof(comms_interface_string),
+	DESC_STRING,
+	{'D','e','b','u','g',' ','t','o','o','l',' ','v','1',' ','P','r','o','g','r','a','m','m','e','r'}
+};
+
+/* Serial number, "DDDDDDDD-UUUU": DEVID, then the DEVCFG3 USERID, in hex.
+   DEVID only tells the part and revision apart, the USERID makes it unique
+   per board (see configBits.h). Filled in once by usb_application_init_serial(),
+   so it lives in RAM. */
+static struct {uint8_t bLength;uint8_t bDescriptorType; uint16_t chars[13]; } serial_string = {
+	sizeof(serial_string),
 	DESC_STRING,
-	{'S', 'e', 'r', 'i', 'a', 'l', ' ', 'n', 'u', 'm', 'b', 'e', 'r' }
 };
 
 
+/* String descriptors by string number. All of them are laid out ahead of
+ * time (the serial number once at boot), so a GET_DESCRIPTOR(STRING) is a
+ * table lookup returning a pointer. Keep in sync with the string indexes in
+ * the descriptors above.
+ */
+static const ROMPTR struct {
+	const void *ptr;
+	uint8_t len;
+} string_descriptors[] = {
+	{ &str00, sizeof(str00) },
+	{ &vendor_string, sizeof(vendor_string) },
+	{ &product_string, sizeof(product_string) },
+	{ &cdc_interface_string, sizeof(cdc_interface_string) },
+	{ &cdc_data_string, sizeof(cdc_data_string) },
+	{ &serial_string, sizeof(serial_string) },	// Built at boot
+	{ &aux_function_string, sizeof(aux_function_string) },
+	{ &comms_interface_string, sizeof(comms_interface_string) },
+};
+
+static uint16_t hex_char(uint8_t nibble)
+{
+	return (nibble < 10)? '0' + nibble: 'A' + nibble - 10;
+}
+
+/* Build the serial number string. Call once at boot, before usb_init(). */
+void usb_application_init_serial(void)
+{
+	uint32_t devid = DEVID;
+	uint16_t userid = (*(volatile const uint32_t *)&temp3 & _DEVCFG3_USERID_MASK) >> _DEVCFG3_USERID_POSITION;
+	uint8_t i;
+
+	for (i = 0; i < 8; i++) {
+		serial_string.chars[i] = hex_char((devid >> (28 - 4*i)) & 0xF);
+	}
+	serial_string.chars[8] = '-';
+	for (i = 0; i < 4; i++) {
+		serial_string.chars[9 + i] = hex_char((userid >> (12 - 4*i)) & 0xF);
+	}
+}
+
 /* Get String function
  *
  * This function is called by the USB stack to get a pointer to a string
  * descriptor.  If using strings, USB_STRING_DESCRIPTOR_FUNC must be defined
  * to the name of this function in usb_config.h.  See
  * USB_STRING_DESCRIPTOR_FUNC in usb.h for information about this function.
- * This is a function, and not simply a list or map, because it is useful,
- * and advisable, to have a serial number string which may be read from
- * EEPROM or somewhere that's not part of static program memory.
  */
 int16_t usb_application_get_string(uint8_t string_number, const void **ptr)
 {
-	if (string_number == 0) {
-		*ptr = &str00;
-		return sizeof(str00);
-	}
-	else if (string_number == 1) {
-		*ptr = &vendor_string;
-		return sizeof(vendor_string);
-	}
-	else if (string_number == 2) {
-		*ptr = &product_string;
-		return sizeof(product_string);
-	}
-	else if (string_number == 3) {
-		*ptr = &cdc_interface_string;
-		return sizeof(cdc_interface_string);
-	}
-	else if (string_number == 4) {
-		*ptr = &cdc_data_string;
-		return sizeof(cdc_data_string);
-	}
-	else if (string_number == 5) {
-		/* This is where you will have code to do something like read
-		 * a serial number out of EEPROM and return it. For CDC
-		 * devices, this is a MUST.
-		 *
-		 * However, since this is a demo, we will return a fake,
-		 * hard-coded serial number here. PLEASE don't ship products
-		 * like this. If you do, your customers will be mad as soon
-		 * as they plug two of your devices in at the same time. */
-
-		// On PIC32MX, there isn't anywhere to get ay sort of UUID...
-		// Keep the fake serial for now.
-		*ptr = &fake_serial_num;
-		return sizeof(fake_serial_num);
+	if (string_number >= USB_ARRAYLEN(string_descriptors)) {
+		return -1;
 	}
 
-	return -1;
+	*ptr = string_descriptors[string_number].ptr;
+	return string_descriptors[string_number].len;
 }
 
 /* Configuration Descriptor List
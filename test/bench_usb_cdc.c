@@ -0,0 +1,118 @@
+// Benchmarks of the USB stack in the adapter firmware: src/main.c (the CDC
+// bridge) with usb.c and usb_cdc.c, on the simulated SIE in usb/. The table
+// goes to stdout, the Makefile compares it with bench_usb_cdc.txt, so a
+// change in what the stack costs shows up in review. Run with -t for the
+// host time columns ("make bench"), see usb/bench.h.
+// The Makefile also builds it with an 8 byte EP0 and BENCH_ENUMERATION_ONLY,
+// for bench_usb_cdc_ep0_8.txt. The bulk cases don't use EP0.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <mock.h>
+#include <usb.h>
+#include <usb_ch9.h>
+#include <usb_cdc.h>
+#include "sie.h"
+#include "host.h"
+#include "uart_sim.h"
+#include "firmware.h"
+#include "bench.h"
+
+#define MB				(1024*1024)
+#define CHUNK			4096		// Bytes per host bulk transfer
+#define BRIDGE_BAUD		12000000	// As fast as the wire, so the stack is the limit
+
+#ifdef BENCH_ENUMERATION_ONLY
+#define BENCH_BULK		false
+#else
+#define BENCH_BULK		true
+#endif
+
+static uint8_t chunk[CHUNK];
+
+// Enumerate, and open port 0 at BRIDGE_BAUD
+static void start(){
+	struct cdc_line_coding coding = { BRIDGE_BAUD, CDC_CHAR_FORMAT_1_STOP_BIT, CDC_PARITY_NONE, 8 };
+	HostEnum e;
+
+	firmware_start();
+	CHECK(host_enumerate(&e), "enumeration failed");
+	CHECK(host_control(0x21, CDC_SET_LINE_CODING, 0, 0, sizeof(coding), &coding) == sizeof(coding),
+		"SET_LINE_CODING failed");
+}
+
+static void bench_enumeration(){
+	SieStats mark;
+	HostEnum e;
+	char name[32];
+
+	firmware_start();
+	bench_begin(&mark);
+	CHECK(host_enumerate(&e), "enumeration failed");
+	snprintf(name, sizeof(name), "enumeration, EP0 %u", EP_0_LEN);
+	bench_row(name, "enum", 1, &mark);
+}
+
+// Host to UART: the host streams, the bridge NAKs while the TX ring is full
+static void bench_bulk_out(){
+	SieStats mark;
+	uint32_t sent = 0;
+	uint32_t i;
+
+	start();
+	bench_begin(&mark);
+	while (sent < MB){
+		for (i = 0; i < CHUNK; i++){
+			chunk[i] = sent + i;
+		}
+		if (host_bulk_out(FIRMWARE_BRIDGE_EP(Port_Console), chunk, CHUNK, FIRMWARE_BRIDGE_LEN, false) != CHUNK){
+			CHECK(false, "bulk OUT failed after %u bytes", sent);
+			return;
+		}
+		sent += CHUNK;
+	}
+	bench_row("bulk OUT, EP2 to UART", "MB", 1, &mark);
+	bench_row("bulk OUT, EP2 to UART", "token", bench_tokens(&mark), &mark);
+
+	sie_idle(SIE_BITS_PER_FRAME);	// The last bytes leave the TX ring
+	CHECK(uartSim[Port_Console].txWire == MB, "%u bytes out of the UART", uartSim[Port_Console].txWire);
+	CHECK(uartSim[Port_Console].txErrors == 0, "%u bytes out of order", uartSim[Port_Console].txErrors);
+}
+
+// UART to host: the host keeps an IN request going, like a CDC driver does
+static void bench_bulk_in(){
+	SieStats mark;
+	uint32_t got = 0;
+	uint32_t errors = 0;
+	int32_t n;
+	int32_t i;
+
+	start();
+	uart_sim_receive(Port_Console, MB);
+	bench_begin(&mark);
+	while (got < MB){
+		n = host_bulk_in(FIRMWARE_BRIDGE_EP(Port_Console), chunk, CHUNK, FIRMWARE_BRIDGE_LEN);
+		if (n < 0){
+			CHECK(false, "bulk IN failed after %u bytes", got);
+			return;
+		}
+		for (i = 0; i < n; i++){
+			errors += (chunk[i] != (uint8_t)(got + i));
+		}
+		got += n;
+	}
+	bench_row("bulk IN, UART to EP2", "MB", 1, &mark);
+	bench_row("bulk IN, UART to EP2", "token", bench_tokens(&mark), &mark);
+	CHECK(got == MB && errors == 0, "%u bytes in, %u wrong", got, errors);
+}
+
+int main(int argc, char *argv[]){
+	bench_start(getopt(argc, argv, "t") == 't');
+	bench_enumeration();
+	if (BENCH_BULK){
+		bench_bulk_out();
+		bench_bulk_in();
+	}
+	return MOCK_RESULT();
+}
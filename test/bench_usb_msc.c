@@ -0,0 +1,110 @@
+// Benchmarks of usb_msc.c and usb_hid.c, on the MSC + HID test device in
+// usb/msc_device.c (a RAM disk) and the simulated SIE. Like bench_usb_cdc.c,
+// the table is compared with bench_usb_msc.txt, and -t adds host times.
+
+#include <string.h>
+#include <unistd.h>
+#include <mock.h>
+#include <usb_config.h>	// usb/msc/usb_config.h, ahead of the one next to usb.h
+#include <usb.h>
+#include <usb_ch9.h>
+#include <usb_hid.h>
+#include <usb_msc.h>
+#include "sie.h"
+#include "host.h"
+#include "msc_device.h"
+#include "bench.h"
+
+#define SECTORS		(MSC_DEVICE_BLOCKS/2)	// Per case
+
+static uint8_t data[SECTORS][MSC_DEVICE_BLOCK_SIZE];
+
+// What a host reads of a HID + MSC device after enumeration
+static bool probe(){
+	uint8_t buf[255];
+	uint8_t maxLun;
+
+	if (host_control(0xA1, MSC_GET_MAX_LUN, 0, 0, 1, &maxLun) != 1
+		|| host_control(0x81, GET_DESCRIPTOR, DESC_REPORT << 8, 1, sizeof(buf), buf) <= 0){
+		return false;
+	}
+	return maxLun == 0;
+}
+
+// Enumerated, and the disk looked at, as a host does before it reads it.
+// READ CAPACITY also tells usb_msc.c the block size.
+static void start(){
+	static const uint8_t inquiry[6] = { MSC_SCSI_INQUIRY, 0, 0, 0, 36, 0 };
+	static const uint8_t capacity[10] = { MSC_SCSI_READ_CAPACITY_10 };
+	static const uint8_t ready[6] = { MSC_SCSI_TEST_UNIT_READY };
+	uint8_t buf[36];
+	HostEnum e;
+
+	msc_device_start();
+	CHECK(host_enumerate(&e) && probe(), "enumeration failed");
+	CHECK(host_msc_command(MSC_DEVICE_EP, inquiry, sizeof(inquiry), true, buf, 36) == 0, "INQUIRY failed");
+	CHECK(host_msc_command(MSC_DEVICE_EP, capacity, sizeof(capacity), true, buf, 8) == 0
+		&& buf[6] == MSC_DEVICE_BLOCK_SIZE >> 8 && buf[3] == (uint8_t)(MSC_DEVICE_BLOCKS-1), "READ CAPACITY failed");
+	CHECK(host_msc_command(MSC_DEVICE_EP, ready, sizeof(ready), false, NULL, 0) == 0, "TEST UNIT READY failed");
+}
+
+static int32_t rw10(uint8_t op, uint32_t lba, uint16_t blocks, void *buf){
+	uint8_t cdb[10] = { op, 0, lba >> 24, lba >> 16, lba >> 8, lba, 0, blocks >> 8, blocks, 0 };
+	return host_msc_command(MSC_DEVICE_EP, cdb, sizeof(cdb), op == MSC_SCSI_READ_10, buf, blocks * MSC_DEVICE_BLOCK_SIZE);
+}
+
+static void bench_enumeration(){
+	SieStats mark;
+	HostEnum e;
+
+	msc_device_start();
+	bench_begin(&mark);
+	CHECK(host_enumerate(&e) && probe(), "enumeration failed");
+	bench_row("enumeration, MSC + HID", "enum", 1, &mark);
+}
+
+static void bench_read(const char *name, uint16_t perCommand){
+	SieStats mark;
+	uint32_t i;
+
+	start();
+	for (i = 0; i < MSC_DEVICE_BLOCKS*MSC_DEVICE_BLOCK_SIZE; i++){
+		mscDisk[i / MSC_DEVICE_BLOCK_SIZE][i % MSC_DEVICE_BLOCK_SIZE] = i * 7 + (i >> 9);
+	}
+	memset(data, 0, sizeof(data));
+	bench_begin(&mark);
+	for (i = 0; i < SECTORS; i += perCommand){
+		CHECK(rw10(MSC_SCSI_READ_10, i, perCommand, data[i]) == 0, "READ(10) of %u at %u failed", perCommand, i);
+	}
+	bench_row(name, "sector", SECTORS, &mark);
+	bench_row(name, "token", bench_tokens(&mark), &mark);
+	CHECK(memcmp(data, mscDisk, sizeof(data)) == 0, "read data doesn't match the disk");
+}
+
+static void bench_write(const char *name, uint16_t perCommand){
+	SieStats mark;
+	uint32_t i;
+
+	start();
+	memset(mscDisk, 0, sizeof(mscDisk));
+	for (i = 0; i < sizeof(data); i++){
+		data[i / MSC_DEVICE_BLOCK_SIZE][i % MSC_DEVICE_BLOCK_SIZE] = i * 13 + (i >> 9);
+	}
+	bench_begin(&mark);
+	for (i = 0; i < SECTORS; i += perCommand){
+		CHECK(rw10(MSC_SCSI_WRITE_10, i, perCommand, data[i]) == 0, "WRITE(10) of %u at %u failed", perCommand, i);
+	}
+	bench_row(name, "sector", SECTORS, &mark);
+	bench_row(name, "token", bench_tokens(&mark), &mark);
+	CHECK(memcmp(data, mscDisk, sizeof(data)) == 0, "written data isn't on the disk");
+}
+
+int main(int argc, char *argv[]){
+	bench_start(getopt(argc, argv, "t") == 't');
+	bench_enumeration();
+	bench_read("READ(10), 1 sector", 1);
+	bench_read("READ(10), 64 sectors", 64);
+	bench_write("WRITE(10), 1 sector", 1);
+	bench_write("WRITE(10), 64 sectors", 64);
+	return MOCK_RESULT();
+}
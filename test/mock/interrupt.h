@@ -0,0 +1,8 @@
+#ifndef INTERRUPT_H_mock_7a3f19c2e6d84b05a1c7e2f9d4b86035
+#define INTERRUPT_H_mock_7a3f19c2e6d84b05a1c7e2f9d4b86035
+
+// On the chip INTERRUPT(x) defines the ISR behind the vector wrapper. Here it
+// is a plain function, the tests call it where the interrupt would fire.
+#define INTERRUPT(x)	void x(void)
+
+#endif
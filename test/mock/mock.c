@@ -0,0 +1,75 @@
+#include <string.h>
+#include <mock.h>
+#include <system.h>
+
+#define MOCK_SFR(name)		MockSfr mock_##name;
+#define MOCK_SFRS(name, n)	MockSfr mock_##name[n];
+#include "mock_sfrs.h"
+#undef MOCK_SFR
+#undef MOCK_SFRS
+
+#define MOCK_SFR(name)		{ &mock_##name, 1 },
+#define MOCK_SFRS(name, n)	{ mock_##name, n },
+static const struct {
+	MockSfr *sfr;
+	uint32_t count;
+} mockSfrs[] = {
+#include "mock_sfrs.h"
+};
+#undef MOCK_SFR
+#undef MOCK_SFRS
+
+uint32_t mock_pbClk = 48000000;
+uint32_t mock_cp0Count = 0;
+uint32_t mock_cp0Step = 0;
+uint32_t mock_failures = 0;
+
+// Apply the CLR, SET and INV writes since the last call, in that order
+void mock_settle(){
+	uint32_t i;
+	uint32_t j;
+
+	for (i = 0; i < sizeof(mockSfrs)/sizeof(mockSfrs[0]); i++){
+		for (j = 0; j < mockSfrs[i].count; j++){
+			MockSfr *r = &mockSfrs[i].sfr[j];
+			r->reg = ((r->reg & ~r->clr) | r->set) ^ r->inv;
+			r->clr = 0;
+			r->set = 0;
+			r->inv = 0;
+		}
+	}
+}
+
+// All SFRs 0, as after a reset (near enough)
+void mock_reset(){
+	uint32_t i;
+
+	for (i = 0; i < sizeof(mockSfrs)/sizeof(mockSfrs[0]); i++){
+		memset((void *)mockSfrs[i].sfr, 0, mockSfrs[i].count * sizeof(MockSfr));
+	}
+	mock_cp0Count = 0;
+}
+
+// DEVCFG3, as configBits.c places it. The USERID ends up in the USB serial number.
+const uint32_t temp3 = 0x0000F0C5;
+
+// Both targets run PBCLK at the CPU clock
+void SystemConfig(uint32_t cpuCoreFrequency, uint32_t peripheralFreqDiv){
+	mock_pbClk = cpuCoreFrequency / peripheralFreqDiv;
+}
+
+uint32_t GetSystemClock(){
+	return mock_pbClk;
+}
+
+uint32_t GetPeripheralClock(){
+	return mock_pbClk;
+}
+
+void INTEnableSystemMultiVectoredInt(){
+}
+
+uint32_t GetCP0Count(){
+	mock_cp0Count += mock_cp0Step;
+	return mock_cp0Count;
+}
@@ -0,0 +1,29 @@
+#ifndef MOCK_H_c41e7d0a9b2f4c6e85d3a17f0e29b4c8
+#define MOCK_H_c41e7d0a9b2f4c6e85d3a17f0e29b4c8
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <p32xxxx.h>
+
+// What system.c would read from the chip
+extern uint32_t mock_pbClk;
+extern uint32_t mock_cp0Count;		// Advanced by mock_cp0Step on every GetCP0Count()
+extern uint32_t mock_cp0Step;
+
+void mock_reset();
+
+// Test result keeping. CHECK() reports a failure on stderr and carries on.
+extern uint32_t mock_failures;
+
+#define CHECK(cond, ...) do{ \
+	if (!(cond)){ \
+		mock_failures++; \
+		fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #cond); \
+		fprintf(stderr, __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+	} \
+} while(0)
+
+#define MOCK_RESULT()	(mock_failures ? (fprintf(stderr, "%u failed\n", mock_failures), 1) : 0)
+
+#endif
@@ -0,0 +1,69 @@
+// SFRs of the mock, see p32xxxx.h. Include with MOCK_SFR(name) and
+// MOCK_SFRS(name, n) defined. MOCK_SFRS() is n SFRs in a row, like U1EP0-15.
+
+MOCK_SFR(IFS0)
+MOCK_SFR(IFS1)
+MOCK_SFR(IEC0)
+MOCK_SFR(IEC1)
+MOCK_SFR(IPC2)
+MOCK_SFR(IPC7)
+MOCK_SFR(IPC8)
+MOCK_SFR(IPC9)
+MOCK_SFR(TRISA)
+MOCK_SFR(CNPUA)
+MOCK_SFR(ANSELB)
+MOCK_SFR(TRISB)
+MOCK_SFR(LATB)
+MOCK_SFR(PORTB)
+MOCK_SFR(ANSELC)
+MOCK_SFR(TRISC)
+MOCK_SFR(LATC)
+MOCK_SFR(PORTC)
+MOCK_SFR(CNPUC)
+MOCK_SFR(RPB4R)
+MOCK_SFR(RPC9R)
+MOCK_SFR(RPB13R)
+MOCK_SFR(SDI2R)
+MOCK_SFR(U1RXR)
+MOCK_SFR(U2RXR)
+MOCK_SFR(U1MODE)
+MOCK_SFR(U1STA)
+MOCK_SFR(U1TXREG)
+MOCK_SFR(U1RXREG)
+MOCK_SFR(U1BRG)
+MOCK_SFR(U2MODE)
+MOCK_SFR(U2STA)
+MOCK_SFR(U2TXREG)
+MOCK_SFR(U2RXREG)
+MOCK_SFR(U2BRG)
+MOCK_SFR(T2CON)
+MOCK_SFR(TMR2)
+MOCK_SFR(PR2)
+MOCK_SFR(DMACON)
+MOCK_SFR(DCH0CON)
+MOCK_SFR(DCH0ECON)
+MOCK_SFR(DCH0INT)
+MOCK_SFR(DCH0SSA)
+MOCK_SFR(DCH0DSA)
+MOCK_SFR(DCH0SSIZ)
+MOCK_SFR(DCH0DSIZ)
+MOCK_SFR(DCH0DPTR)
+MOCK_SFR(DCH0CSIZ)
+MOCK_SFR(SPI2CON)
+MOCK_SFR(SPI2STAT)
+MOCK_SFR(SPI2BRG)
+MOCK_SFR(SPI2BUF)
+MOCK_SFR(BMXCON)
+MOCK_SFR(DEVID)
+MOCK_SFR(U1IR)
+MOCK_SFR(U1IE)
+MOCK_SFR(U1EIR)
+MOCK_SFR(U1EIE)
+MOCK_SFR(U1STAT)
+MOCK_SFR(U1CON)
+MOCK_SFR(U1ADDR)
+MOCK_SFR(U1PWRC)
+MOCK_SFR(U1BDTP1)
+MOCK_SFR(U1BDTP2)
+MOCK_SFR(U1BDTP3)
+MOCK_SFRS(U1EP, 16)
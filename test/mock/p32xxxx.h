@@ -0,0 +1,525 @@
+#ifndef P32XXXX_H_mock_5d0c1e8a7b2f4e36a9d14c7f02b8e6a1
+#define P32XXXX_H_mock_5d0c1e8a7b2f4e36a9d14c7f02b8e6a1
+
+#include <inttypes.h>
+
+// Host stand-in for the PIC32 SFR header, for the tests in test/. Only the
+// registers the tested code touches are here.
+//
+// Each SFR is followed by its CLR, SET and INV registers, like on the chip,
+// so code writing reg[SFR_CLR] or FOOCLR lands in the right place. Those
+// writes are only applied to the register by mock_settle(), which the tests
+// call after each step of the code under test.
+//
+// Bit positions are the mock's own, where the chip's weren't needed. The code
+// only relies on the _MASK/_POSITION values and the bit-fields agreeing.
+
+typedef struct MockSfrStruct {
+	volatile uint32_t reg;
+	volatile uint32_t clr;
+	volatile uint32_t set;
+	volatile uint32_t inv;
+} MockSfr;
+
+void mock_settle();
+
+#define MOCK_SFR(name)		extern MockSfr mock_##name;
+#define MOCK_SFRS(name, n)	extern MockSfr mock_##name[n];
+#include "mock_sfrs.h"
+#undef MOCK_SFR
+#undef MOCK_SFRS
+
+#define _nop()		__asm__ volatile("nop")
+
+////////
+// Interrupts
+////////
+typedef struct {
+	unsigned :9;
+	unsigned T2IF:1;
+	unsigned :22;
+} __IFS0bits_t;
+
+typedef struct {
+	unsigned :3;
+	unsigned USBIF:1;
+	unsigned :4;
+	unsigned U1EIF:1;
+	unsigned U1RXIF:1;
+	unsigned U1TXIF:1;
+	unsigned :3;
+	unsigned U2EIF:1;
+	unsigned U2RXIF:1;
+	unsigned U2TXIF:1;
+	unsigned :11;
+	unsigned DMA0IF:1;
+	unsigned :3;
+} __IFS1bits_t;
+
+typedef struct {
+	unsigned :9;
+	unsigned T2IE:1;
+	unsigned :22;
+} __IEC0bits_t;
+
+typedef struct {
+	unsigned :3;
+	unsigned USBIE:1;
+	unsigned :4;
+	unsigned U1EIE:1;
+	unsigned U1RXIE:1;
+	unsigned U1TXIE:1;
+	unsigned :3;
+	unsigned U2EIE:1;
+	unsigned U2RXIE:1;
+	unsigned U2TXIE:1;
+	unsigned :11;
+	unsigned DMA0IE:1;
+	unsigned :3;
+} __IEC1bits_t;
+
+#define _IFS0_T2IF_MASK			0x00000200
+#define _IEC0_T2IE_MASK			0x00000200
+#define _IFS1_USBIF_MASK		0x00000008
+#define _IEC1_USBIE_MASK		0x00000008
+#define _IEC1_U1RXIE_MASK		0x00000200
+#define _IEC1_U1TXIE_MASK		0x00000400
+#define _IEC1_U2RXIE_MASK		0x00008000
+#define _IEC1_U2TXIE_MASK		0x00010000
+#define _IEC1_DMA0IE_MASK		0x10000000
+
+typedef struct {
+	unsigned T2IS:2;
+	unsigned T2IP:3;
+	unsigned :27;
+} __IPC2bits_t;
+
+typedef struct {
+	unsigned :16;
+	unsigned USBIS:2;
+	unsigned USBIP:3;
+	unsigned :11;
+} __IPC7bits_t;
+
+typedef struct {
+	unsigned U1IS:2;
+	unsigned U1IP:3;
+	unsigned :27;
+} __IPC8bits_t;
+
+typedef struct {
+	unsigned U2IS:2;
+	unsigned U2IP:3;
+	unsigned :3;
+	unsigned DMA0IS:2;
+	unsigned DMA0IP:3;
+	unsigned :19;
+} __IPC9bits_t;
+
+#define _IPC8_U1IS_POSITION		0
+#define _IPC9_U2IS_POSITION		0
+
+#define IFS0		mock_IFS0.reg
+#define IFS0CLR		mock_IFS0.clr
+#define IFS0SET		mock_IFS0.set
+#define IFS0bits	(*(volatile __IFS0bits_t *)&mock_IFS0.reg)
+#define IFS1		mock_IFS1.reg
+#define IFS1CLR		mock_IFS1.clr
+#define IFS1SET		mock_IFS1.set
+#define IFS1bits	(*(volatile __IFS1bits_t *)&mock_IFS1.reg)
+#define IEC0		mock_IEC0.reg
+#define IEC0CLR		mock_IEC0.clr
+#define IEC0SET		mock_IEC0.set
+#define IEC0bits	(*(volatile __IEC0bits_t *)&mock_IEC0.reg)
+#define IEC1		mock_IEC1.reg
+#define IEC1CLR		mock_IEC1.clr
+#define IEC1SET		mock_IEC1.set
+#define IEC1bits	(*(volatile __IEC1bits_t *)&mock_IEC1.reg)
+#define IPC2		mock_IPC2.reg
+#define IPC2bits	(*(volatile __IPC2bits_t *)&mock_IPC2.reg)
+#define IPC7		mock_IPC7.reg
+#define IPC7bits	(*(volatile __IPC7bits_t *)&mock_IPC7.reg)
+#define IPC8		mock_IPC8.reg
+#define IPC8bits	(*(volatile __IPC8bits_t *)&mock_IPC8.reg)
+#define IPC9		mock_IPC9.reg
+#define IPC9bits	(*(volatile __IPC9bits_t *)&mock_IPC9.reg)
+
+////////
+// Ports. RA4, RB4 and RC0-RC9 are all the UART and LED pins use.
+////////
+typedef struct {
+	unsigned :4;
+	unsigned TRISA4:1;
+	unsigned :27;
+} __TRISAbits_t;
+
+typedef struct {
+	unsigned :4;
+	unsigned TRISB4:1;
+	unsigned :27;
+} __TRISBbits_t;
+
+typedef struct {
+	unsigned :4;
+	unsigned LATB4:1;
+	unsigned :27;
+} __LATBbits_t;
+
+typedef struct {
+	unsigned TRISC0:1, TRISC1:1, TRISC2:1, TRISC3:1, TRISC4:1;
+	unsigned TRISC5:1, TRISC6:1, TRISC7:1, TRISC8:1, TRISC9:1;
+	unsigned :22;
+} __TRISCbits_t;
+
+typedef struct {
+	unsigned LATC0:1, LATC1:1, LATC2:1, LATC3:1, LATC4:1;
+	unsigned LATC5:1, LATC6:1, LATC7:1, LATC8:1, LATC9:1;
+	unsigned :22;
+} __LATCbits_t;
+
+typedef struct {
+	unsigned RC0:1, RC1:1, RC2:1, RC3:1, RC4:1;
+	unsigned RC5:1, RC6:1, RC7:1, RC8:1, RC9:1;
+	unsigned :22;
+} __PORTCbits_t;
+
+#define TRISA		mock_TRISA.reg
+#define TRISAbits	(*(volatile __TRISAbits_t *)&mock_TRISA.reg)
+#define CNPUA		mock_CNPUA.reg
+#define TRISB		mock_TRISB.reg
+#define TRISBbits	(*(volatile __TRISBbits_t *)&mock_TRISB.reg)
+#define LATB		mock_LATB.reg
+#define LATBbits	(*(volatile __LATBbits_t *)&mock_LATB.reg)
+#define PORTB		mock_PORTB.reg
+#define ANSELB		mock_ANSELB.reg
+#define ANSELC		mock_ANSELC.reg
+#define TRISC		mock_TRISC.reg
+#define TRISCbits	(*(volatile __TRISCbits_t *)&mock_TRISC.reg)
+#define LATC		mock_LATC.reg
+#define LATCINV		mock_LATC.inv
+#define LATCbits	(*(volatile __LATCbits_t *)&mock_LATC.reg)
+#define PORTC		mock_PORTC.reg
+#define PORTCbits	(*(volatile __PORTCbits_t *)&mock_PORTC.reg)
+#define CNPUC		mock_CNPUC.reg
+#define RPB4R		mock_RPB4R.reg
+#define RPC9R		mock_RPC9R.reg
+#define RPB13R		mock_RPB13R.reg
+#define SDI2R		mock_SDI2R.reg
+#define U1RXR		mock_U1RXR.reg
+#define U2RXR		mock_U2RXR.reg
+
+////////
+// SPI, the JTAG shifter in ICSPDrv.c
+////////
+typedef struct {
+	unsigned :5;
+	unsigned MSTEN:1;
+	unsigned CKP:1;
+	unsigned :1;
+	unsigned CKE:1;
+	unsigned SMP:1;
+	unsigned MODE16:1;
+	unsigned MODE32:1;
+	unsigned :3;
+	unsigned ON:1;
+	unsigned :16;
+} __SPI2CONbits_t;
+
+typedef struct {
+	unsigned SPIRBF:1;
+	unsigned :31;
+} __SPI2STATbits_t;
+
+#define SPI2CON		mock_SPI2CON.reg
+#define SPI2CONbits	(*(volatile __SPI2CONbits_t *)&mock_SPI2CON.reg)
+#define SPI2STAT	mock_SPI2STAT.reg
+#define SPI2STATbits	(*(volatile __SPI2STATbits_t *)&mock_SPI2STAT.reg)
+#define SPI2BRG		mock_SPI2BRG.reg
+#define SPI2BUF		mock_SPI2BUF.reg
+
+////////
+// UART
+////////
+typedef struct {
+	unsigned STSEL:1;
+	unsigned PDSEL:2;
+	unsigned BRGH:1;
+	unsigned RXINV:1;
+	unsigned ABAUD:1;
+	unsigned LPBACK:1;
+	unsigned WAKE:1;
+	unsigned UEN:2;
+	unsigned :1;
+	unsigned RTSMD:1;
+	unsigned IREN:1;
+	unsigned SIDL:1;
+	unsigned :1;
+	unsigned ON:1;
+	unsigned :16;
+} __U1MODEbits_t;
+
+typedef struct {
+	unsigned URXDA:1;
+	unsigned OERR:1;
+	unsigned FERR:1;
+	unsigned PERR:1;
+	unsigned RIDLE:1;
+	unsigned ADDEN:1;
+	unsigned URXISEL:2;
+	unsigned TRMT:1;
+	unsigned UTXBF:1;
+	unsigned UTXEN:1;
+	unsigned UTXBRK:1;
+	unsigned URXEN:1;
+	unsigned UTXINV:1;
+	unsigned UTXISEL:2;
+	unsigned ADDR:8;
+	unsigned ADM_EN:1;
+	unsigned :7;
+} __U1STAbits_t;
+
+typedef __U1MODEbits_t __U2MODEbits_t;
+typedef __U1STAbits_t __U2STAbits_t;
+
+#define _UART1_RX_IRQ			40
+#define _UART2_RX_IRQ			54
+
+#define U1MODE		mock_U1MODE.reg
+#define U1MODEbits	(*(volatile __U1MODEbits_t *)&mock_U1MODE.reg)
+#define U1STA		mock_U1STA.reg
+#define U1STAbits	(*(volatile __U1STAbits_t *)&mock_U1STA.reg)
+#define U1TXREG		mock_U1TXREG.reg
+#define U1RXREG		mock_U1RXREG.reg
+#define U1BRG		mock_U1BRG.reg
+#define U2MODE		mock_U2MODE.reg
+#define U2MODEbits	(*(volatile __U2MODEbits_t *)&mock_U2MODE.reg)
+#define U2STA		mock_U2STA.reg
+#define U2STAbits	(*(volatile __U2STAbits_t *)&mock_U2STA.reg)
+#define U2TXREG		mock_U2TXREG.reg
+#define U2RXREG		mock_U2RXREG.reg
+#define U2BRG		mock_U2BRG.reg
+
+////////
+// Timer 2
+////////
+typedef struct {
+	unsigned :1;
+	unsigned TCS:1;
+	unsigned :1;
+	unsigned T32:1;
+	unsigned TCKPS:3;
+	unsigned TGATE:1;
+	unsigned :5;
+	unsigned SIDL:1;
+	unsigned :1;
+	unsigned ON:1;
+	unsigned :16;
+} __T2CONbits_t;
+
+#define T2CON		mock_T2CON.reg
+#define T2CONbits	(*(volatile __T2CONbits_t *)&mock_T2CON.reg)
+#define T2CONCLR	mock_T2CON.clr
+#define T2CONSET	mock_T2CON.set
+#define _T2CON_ON_MASK			0x00008000
+#define TMR2		mock_TMR2.reg
+#define PR2			mock_PR2.reg
+
+////////
+// DMA, controller and channel 0
+////////
+typedef struct {
+	unsigned :11;
+	unsigned DMABUSY:1;
+	unsigned SUSPEND:1;
+	unsigned :2;
+	unsigned ON:1;
+	unsigned :16;
+} __DMACONbits_t;
+
+typedef struct {
+	unsigned CHPRI:2;
+	unsigned CHEDET:1;
+	unsigned :1;
+	unsigned CHAEN:1;
+	unsigned CHCHN:1;
+	unsigned CHAED:1;
+	unsigned CHEN:1;
+	unsigned CHCHNS:1;
+	unsigned :6;
+	unsigned CHBUSY:1;
+	unsigned :16;
+} __DCH0CONbits_t;
+
+typedef struct {
+	unsigned :3;
+	unsigned AIRQEN:1;
+	unsigned SIRQEN:1;
+	unsigned PATEN:1;
+	unsigned CABORT:1;
+	unsigned CFORCE:1;
+	unsigned CHSIRQ:8;
+	unsigned CHAIRQ:8;
+	unsigned :8;
+} __DCH0ECONbits_t;
+
+typedef struct {
+	unsigned CHERIF:1;
+	unsigned CHTAIF:1;
+	unsigned CHCCIF:1;
+	unsigned CHBCIF:1;
+	unsigned CHDHIF:1;
+	unsigned CHDDIF:1;
+	unsigned CHSHIF:1;
+	unsigned CHSDIF:1;
+	unsigned :8;
+	unsigned CHERIE:1;
+	unsigned CHTAIE:1;
+	unsigned CHCCIE:1;
+	unsigned CHBCIE:1;
+	unsigned CHDHIE:1;
+	unsigned CHDDIE:1;
+	unsigned CHSHIE:1;
+	unsigned CHSDIE:1;
+	unsigned :8;
+} __DCH0INTbits_t;
+
+#define _DCH0INT_CHBCIF_MASK	0x00000008
+#define _DCH0INT_CHDHIF_MASK	0x00000010
+
+#define DMACON		mock_DMACON.reg
+#define DMACONbits	(*(volatile __DMACONbits_t *)&mock_DMACON.reg)
+#define DCH0CON		mock_DCH0CON.reg
+#define DCH0CONbits	(*(volatile __DCH0CONbits_t *)&mock_DCH0CON.reg)
+#define DCH0ECON	mock_DCH0ECON.reg
+#define DCH0ECONbits	(*(volatile __DCH0ECONbits_t *)&mock_DCH0ECON.reg)
+#define DCH0INT		mock_DCH0INT.reg
+#define DCH0INTCLR	mock_DCH0INT.clr
+#define DCH0INTbits	(*(volatile __DCH0INTbits_t *)&mock_DCH0INT.reg)
+#define DCH0SSA		mock_DCH0SSA.reg
+#define DCH0DSA		mock_DCH0DSA.reg
+#define DCH0SSIZ	mock_DCH0SSIZ.reg
+#define DCH0DSIZ	mock_DCH0DSIZ.reg
+#define DCH0DPTR	mock_DCH0DPTR.reg
+#define DCH0CSIZ	mock_DCH0CSIZ.reg
+
+////////
+// Bus matrix, device ID and DEVCFG3 (main.c, usb_descriptors.c)
+////////
+typedef struct {
+	unsigned :6;
+	unsigned BMXWSDRM:1;
+	unsigned :25;
+} __BMXCONbits_t;
+
+#define BMXCON		mock_BMXCON.reg
+#define BMXCONbits	(*(volatile __BMXCONbits_t *)&mock_BMXCON.reg)
+#define DEVID		mock_DEVID.reg
+
+#define _DEVCFG3_USERID_POSITION	0
+#define _DEVCFG3_USERID_MASK		0x0000FFFF
+
+////////
+// USB, for the simulated SIE in usb/. Chip bit positions, usb.c relies on them.
+////////
+typedef struct {
+	unsigned URSTIF:1;
+	unsigned UERRIF:1;
+	unsigned SOFIF:1;
+	unsigned TRNIF:1;
+	unsigned IDLEIF:1;
+	unsigned RESUMEIF:1;
+	unsigned ATTACHIF:1;
+	unsigned STALLIF:1;
+	unsigned :24;
+} __U1IRbits_t;
+
+typedef struct {
+	unsigned URSTIE:1;
+	unsigned UERRIE:1;
+	unsigned SOFIE:1;
+	unsigned TRNIE:1;
+	unsigned IDLEIE:1;
+	unsigned RESUMEIE:1;
+	unsigned ATTACHIE:1;
+	unsigned STALLIE:1;
+	unsigned :24;
+} __U1IEbits_t;
+
+typedef struct {
+	unsigned :2;
+	unsigned PPBI:1;
+	unsigned DIR:1;
+	unsigned ENDPT:4;
+	unsigned :24;
+} __U1STATbits_t;
+
+typedef struct {
+	unsigned USBEN:1;
+	unsigned PPBRST:1;
+	unsigned RESUME:1;
+	unsigned HOSTEN:1;
+	unsigned USBRST:1;
+	unsigned PKTDIS:1;
+	unsigned SE0:1;
+	unsigned JSTATE:1;
+	unsigned :24;
+} __U1CONbits_t;
+
+typedef struct {
+	unsigned USBPWR:1;
+	unsigned USUSPEND:1;
+	unsigned :30;
+} __U1PWRCbits_t;
+
+typedef struct {
+	unsigned EPHSHK:1;
+	unsigned EPSTALL:1;
+	unsigned EPTXEN:1;
+	unsigned EPRXEN:1;
+	unsigned EPCONDIS:1;
+	unsigned :1;
+	unsigned RETRYDIS:1;
+	unsigned LSPD:1;
+	unsigned :24;
+} __U1EP1bits_t;
+
+#define _U1IR_URSTIF_MASK		0x00000001
+#define _U1IR_SOFIF_MASK		0x00000004
+#define _U1IR_TRNIF_MASK		0x00000008
+#define _U1IR_STALLIF_MASK		0x00000080
+
+#define U1IR		mock_U1IR.reg
+#define U1IRbits	(*(volatile __U1IRbits_t *)&mock_U1IR.reg)
+#define U1IE		mock_U1IE.reg
+#define U1IEbits	(*(volatile __U1IEbits_t *)&mock_U1IE.reg)
+#define U1EIR		mock_U1EIR.reg
+#define U1EIE		mock_U1EIE.reg
+#define U1STAT		mock_U1STAT.reg
+#define U1STATbits	(*(volatile __U1STATbits_t *)&mock_U1STAT.reg)
+#define U1CON		mock_U1CON.reg
+#define U1CONbits	(*(volatile __U1CONbits_t *)&mock_U1CON.reg)
+#define U1ADDR		mock_U1ADDR.reg
+#define U1PWRC		mock_U1PWRC.reg
+#define U1PWRCbits	(*(volatile __U1PWRCbits_t *)&mock_U1PWRC.reg)
+#define U1BDTP1		mock_U1BDTP1.reg
+#define U1BDTP2		mock_U1BDTP2.reg
+#define U1BDTP3		mock_U1BDTP3.reg
+// In a row, 4 words apart, as SFR_EP_MGMT() in usb_hal.h expects
+#define U1EP0		mock_U1EP[0].reg
+#define U1EP1		mock_U1EP[1].reg
+#define U1EP2		mock_U1EP[2].reg
+#define U1EP3		mock_U1EP[3].reg
+#define U1EP4		mock_U1EP[4].reg
+#define U1EP5		mock_U1EP[5].reg
+#define U1EP6		mock_U1EP[6].reg
+#define U1EP7		mock_U1EP[7].reg
+#define U1EP8		mock_U1EP[8].reg
+#define U1EP9		mock_U1EP[9].reg
+#define U1EP10		mock_U1EP[10].reg
+#define U1EP11		mock_U1EP[11].reg
+#define U1EP12		mock_U1EP[12].reg
+#define U1EP13		mock_U1EP[13].reg
+#define U1EP14		mock_U1EP[14].reg
+#define U1EP15		mock_U1EP[15].reg
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef KMEM_H_mock_0e5b7c2d9a134f6e8b21c4d7f9a03e58
+#define KMEM_H_mock_0e5b7c2d9a134f6e8b21c4d7f9a03e58
+
+#include <inttypes.h>
+
+// Host memory has no KSEG mapping, the "physical" address is the pointer
+#define KVA_TO_PA(v)	((uint32_t)(uintptr_t)(v))
+
+#endif
@@ -0,0 +1,86 @@
+// Baud rate error of UARTDrv_Configure(), for the standard rates at the
+// PBCLK of both targets. The table goes to stdout, the Makefile compares it
+// with baud_table.txt, so a change in the divisor choice shows up in review.
+
+#include <math.h>
+#include <mock.h>
+#include "../src/drivers/UARTDrv.c"
+
+static const uint32_t rates[] = {
+	300, 600, 1200, 2400, 4800, 9600, 14400, 19200, 38400, 57600,
+	115200, 230400, 460800, 921600, 1000000, 1500000, 2000000,
+	2500000, 3000000, 4000000, 5000000, 6000000,
+};
+
+// PBCLK of the MX270 (48MHz) and the MX440 (80MHz), both at PBCLK/1
+static const uint32_t clocks[] = { 48000000, 80000000 };
+
+#define NUM_RATES	(sizeof(rates)/sizeof(rates[0]))
+#define NUM_CLOCKS	(sizeof(clocks)/sizeof(clocks[0]))
+
+// Exact rate of a BRGH/BRG setting. The driver reports it rounded down.
+static double rate(uint32_t pbClk, uint32_t brgh, uint32_t brg){
+	return (double)pbClk / ((brgh ? 4 : 16) * (brg+1.0));
+}
+
+// Smallest error any BRGH/BRG setting gives, by trying them all
+static double best_error(uint32_t pbClk, uint32_t baud){
+	double best = baud;
+	uint32_t brg;
+
+	for (brg = 0; brg <= 0xFFFF; brg++){
+		best = fmin(best, fabs(rate(pbClk, 0, brg) - baud));
+		best = fmin(best, fabs(rate(pbClk, 1, brg) - baud));
+	}
+	return best;
+}
+
+int main(){
+	uint32_t c;
+	uint32_t r;
+
+	printf("%8s", "baud");
+	for (c = 0; c < NUM_CLOCKS; c++){
+		printf(" | PBCLK %2uMHz: BRGH   BRG    actual  error", clocks[c]/1000000);
+	}
+	printf("\n");
+
+	for (r = 0; r < NUM_RATES; r++){
+		printf("%8u", rates[r]);
+		for (c = 0; c < NUM_CLOCKS; c++){
+			uint32_t actual;
+			uint32_t idle;
+			double exact;
+
+			mock_reset();
+			mock_pbClk = clocks[c];
+			UARTDrv_Init(Port_Console, 115200, RxMode_Direct);
+			mock_settle();
+			actual = UARTDrv_Configure(Port_Console, rates[r], 8, Parity_None, 1);
+			mock_settle();
+
+			if (actual == 0){
+				printf(" | %39s", "not supported");
+				CHECK(rates[r] > clocks[c]/4, "%u baud refused at %uHz", rates[r], clocks[c]);
+				continue;
+			}
+			exact = rate(clocks[c], U2MODEbits.BRGH, U2BRG);
+			printf(" | %16u %5u %9u %+6.2f%%", U2MODEbits.BRGH, U2BRG, actual,
+				100.0 * (exact - rates[r]) / rates[r]);
+
+			// Register values give the rate that was reported
+			CHECK(actual == (uint32_t)exact, "%u baud at %uHz: BRG doesn't give %u", rates[r], clocks[c], actual);
+			CHECK(U2MODEbits.ON, "UART left off");
+			// Idle timer, 1:8 prescaler: UART_RX_IDLE_CHARS at this rate, 1ms at most
+			idle = (uint64_t)clocks[c]/8 * 10*UART_RX_IDLE_CHARS / actual;
+			idle = fmin(idle, clocks[c]/8/1000);
+			CHECK(idle >= 1 && PR2 == idle-1, "%u baud at %uHz: idle timer period %u, expected %u",
+				rates[r], clocks[c], PR2+1, idle);
+			CHECK(fabs(exact - rates[r]) <= best_error(clocks[c], rates[r]) + 1e-6,
+				"%u baud at %uHz: %.3f is off by %.3f, could be %.3f",
+				rates[r], clocks[c], exact, fabs(exact - rates[r]), best_error(clocks[c], rates[r]));
+		}
+		printf("\n");
+	}
+	return MOCK_RESULT();
+}
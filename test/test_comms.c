@@ -0,0 +1,170 @@
+// The programmer command channel (src/peripherals/COMMS.c) in the adapter
+// firmware, on the simulated SIE. Commands that are already in the endpoint
+// when COMMS.c starts the transfer for them must not get lost: the one sent
+// before the main loop first runs after SET_CONFIGURATION, and the one sent
+// right behind another, before its reply was read.
+// Commands that wait on the target must not hold up the main loop: the
+// bridges keep going until the reply comes. No target answers here, so an
+// erase runs into its timeout.
+
+#include <string.h>
+#include <mock.h>
+#include <usb.h>
+#include <usb_ch9.h>
+#include <vendor.h>
+#include <COMMS.h>
+#include <ICSPDrv.h>
+#include <system.h>
+#include "sie.h"
+#include "host.h"
+#include "uart_sim.h"
+#include "firmware.h"
+
+#define COMMS_LEN		64
+#define CP0_STEP		240		// CP0 Count ticks per read, 10us at 48MHz
+
+static struct {
+	struct comms_reply header;
+	uint8_t data[COMMS_LEN];
+} reply;
+
+static void send_command(uint8_t command, uint32_t length){
+	struct comms_command c;
+
+	memset(&c, 0, sizeof(c));
+	c.command = command;
+	c.length = length;
+	CHECK(host_bulk_out(COMMS_EP, &c, sizeof(c), COMMS_LEN, false) == sizeof(c), "command %u not taken", command);
+}
+
+static void send_ping(){
+	send_command(COMMS_PING, 0);
+}
+
+// The reply to a command, however long it takes
+static bool get_reply(uint8_t command){
+	int32_t n;
+
+	memset(&reply, 0xFF, sizeof(reply));
+	n = host_bulk_in(COMMS_EP, &reply, sizeof(reply), COMMS_LEN);
+	CHECK(n >= (int32_t)sizeof(reply.header) && reply.header.command == command,
+		"no reply to command %u (%d bytes)", command, n);
+	return n >= (int32_t)sizeof(reply.header) && reply.header.command == command;
+}
+
+// The reply isn't there yet
+static void check_no_reply(uint8_t command){
+	hostNakLimit = 1;
+	CHECK(host_bulk_in(COMMS_EP, &reply, sizeof(reply), COMMS_LEN) < 0, "command %u answered at once", command);
+	hostNakLimit = 100000;
+}
+
+// Bytes from the console UART get through
+static void check_bridge(){
+	uint8_t in[FIRMWARE_BRIDGE_LEN];
+	uint32_t got = 0;
+	int32_t n;
+
+	uart_sim_receive(Port_Console, 10);
+	while (got < 10){	// The bytes trickle in, so maybe in more than one packet
+		n = host_bulk_in(FIRMWARE_BRIDGE_EP(Port_Console), in + got, sizeof(in) - got, FIRMWARE_BRIDGE_LEN);
+		if (n < 0){
+			CHECK(false, "EP2 IN failed while a command was running");
+			return;
+		}
+		got += n;
+	}
+}
+
+static void check_pong(){
+	struct comms_reply r;
+
+	memset(&r, 0xFF, sizeof(r));
+	CHECK(host_bulk_in(COMMS_EP, &r, sizeof(r), COMMS_LEN) == sizeof(r), "no reply to PING");
+	CHECK(r.command == COMMS_PING && r.status == COMMS_OK && r.value == COMMS_PROTOCOL_VERSION,
+		"PING reply: command %u, status %u, value %u", r.command, r.status, r.value);
+}
+
+// SET_CONFIGURATION and the command come in while the main loop is held up
+static void test_command_before_loop(){
+	HostEnum e;
+
+	firmware_start();
+	sieMainLoop = NULL;
+	CHECK(host_enumerate(&e), "enumeration failed");
+	send_ping();
+	sieMainLoop = firmware_pass;
+	check_pong();
+
+	send_ping();	// And the channel goes on
+	check_pong();
+}
+
+// The second command waits in the endpoint until the first reply has been read
+static void test_command_behind_reply(){
+	HostEnum e;
+	uint32_t i;
+
+	firmware_start();
+	CHECK(host_enumerate(&e), "enumeration failed");
+	for (i = 0; i < 3; i++){
+		send_ping();
+		send_ping();
+		check_pong();
+		check_pong();
+	}
+}
+
+static void enter(){
+	HostEnum e;
+
+	firmware_start();
+	CHECK(host_enumerate(&e), "enumeration failed");
+	send_command(COMMS_ICSP_ENTER, 0);
+	if (get_reply(COMMS_ICSP_ENTER)){
+		CHECK(reply.header.status == COMMS_OK, "ICSP_ENTER: status %u", reply.header.status);
+	}
+}
+
+// The erase waits for the target from the main loop, up to ICSP_ERASE_TIMEOUT_MS
+static void test_erase(){
+	uint32_t start;
+
+	enter();
+	send_command(COMMS_ICSP_ERASE, 0);
+	start = mock_cp0Count;
+	check_no_reply(COMMS_ICSP_ERASE);
+	check_bridge();
+	check_no_reply(COMMS_ICSP_ERASE);
+	if (get_reply(COMMS_ICSP_ERASE)){
+		CHECK(reply.header.status == COMMS_ERR_TIMEOUT, "ICSP_ERASE: status %u", reply.header.status);
+		CHECK(mock_cp0Count - start >= ICSP_ERASE_TIMEOUT_MS * (GetSystemClock()/2000),
+			"ICSP_ERASE: gave up after %u ticks", mock_cp0Count - start);
+	}
+}
+
+// The benchmark shifts a chunk per main loop pass, the total is the same
+static void test_benchmark(){
+	struct comms_shift_benchmark *b = (struct comms_shift_benchmark *)reply.data;
+
+	enter();
+	send_command(COMMS_SHIFT_BENCHMARK, COMMS_BENCHMARK_MAX_WORDS);
+	check_no_reply(COMMS_SHIFT_BENCHMARK);
+	check_bridge();
+	if (get_reply(COMMS_SHIFT_BENCHMARK)){
+		CHECK(reply.header.status == COMMS_OK && reply.header.length == sizeof(*b),
+			"SHIFT_BENCHMARK: status %u, %u bytes", reply.header.status, reply.header.length);
+		CHECK(b->bits == 32*COMMS_BENCHMARK_MAX_WORDS, "SHIFT_BENCHMARK: %u bits", b->bits);
+		CHECK(b->ticks >= COMMS_BENCHMARK_MAX_WORDS*CP0_STEP, "SHIFT_BENCHMARK: %u ticks", b->ticks);
+	}
+}
+
+int main(){
+	test_command_before_loop();
+	test_command_behind_reply();
+
+	mock_cp0Step = CP0_STEP;
+	test_erase();
+	test_benchmark();
+	return MOCK_RESULT();
+}
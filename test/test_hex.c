@@ -0,0 +1,264 @@
+// The Intel HEX parser (src/peripherals/HEX.c). The files are made up here,
+// fed in pieces of different sizes, and the rows taken as they come out.
+
+#include <stdio.h>
+#include <string.h>
+#include <mock.h>
+#include <HEX.h>
+
+// Record types
+#define REC_DATA		0x00
+#define REC_EOF			0x01
+#define REC_SEGMENT		0x02
+#define REC_LINEAR		0x04
+
+#define MAX_ROWS		16
+#define ARRAYLEN(a)		(sizeof(a)/sizeof((a)[0]))
+
+static char file[4096];
+static size_t fileLength;
+
+static struct {
+	uint32_t address;
+	uint8_t data[HEX_MAX_ROW];
+} rows[MAX_ROWS];
+static uint32_t rowCount;
+
+// Byte the files put at a physical address
+static uint8_t pattern(uint32_t address){
+	return (address ^ (address >> 8)) & 0xFF;
+}
+
+static void start(){
+	fileLength = 0;
+}
+
+static void record(uint8_t type, uint16_t address, const uint8_t *data, uint8_t n){
+	uint8_t sum = n + (address >> 8) + address + type;
+	uint32_t i;
+
+	fileLength += sprintf(file + fileLength, ":%02X%04X%02X", n, address, type);
+	for (i = 0; i < n; i++){
+		fileLength += sprintf(file + fileLength, "%02X", data[i]);
+		sum += data[i];
+	}
+	fileLength += sprintf(file + fileLength, "%02X\r\n", (uint8_t)-sum);
+}
+
+static void extended(uint8_t type, uint16_t value){
+	uint8_t data[2] = { value >> 8, value };
+
+	record(type, 0, data, 2);
+}
+
+// n bytes of the pattern from physical address, the top half already set by an extended record
+static void data(uint32_t address, uint8_t n){
+	uint8_t bytes[255];
+	uint32_t i;
+
+	for (i = 0; i < n; i++){
+		bytes[i] = pattern(address + i);
+	}
+	record(REC_DATA, address, bytes, n);
+}
+
+static void eof(){
+	record(REC_EOF, 0, NULL, 0);
+}
+
+// Parse the file in pieces of chunk bytes, taking the rows as they come out
+static HEXStatus parse(uint32_t rowSize, size_t chunk){
+	const uint32_t *row;
+	size_t offset = 0;
+	size_t used;
+	size_t n;
+
+	HEX_init(rowSize);
+	rowCount = 0;
+	while (offset < fileLength || HEX_rowReady()){
+		if (HEX_rowReady()){
+			if (rowCount == MAX_ROWS){
+				CHECK(false, "too many rows");
+				break;
+			}
+			row = HEX_takeRow(&rows[rowCount].address);
+			memcpy(rows[rowCount].data, row, rowSize);
+			rowCount++;
+			continue;
+		}
+		n = (fileLength - offset < chunk) ? fileLength - offset : chunk;
+		used = HEX_parse((const uint8_t *)file + offset, n);
+		CHECK(used <= n, "%u of %u bytes used", (uint32_t)used, (uint32_t)n);
+		if (used == 0 && !HEX_rowReady()){
+			CHECK(false, "parser stuck at byte %u", (uint32_t)offset);
+			break;
+		}
+		offset += used;
+	}
+	return HEX_getStatus();
+}
+
+// Row i: at address, with the pattern from first to last (physical), 0xFF around it
+static void check_row(uint32_t i, uint32_t rowSize, uint32_t address, uint32_t first, uint32_t last){
+	uint32_t a;
+	uint8_t expected;
+
+	if (i >= rowCount){
+		CHECK(false, "row %u missing, %u rows", i, rowCount);
+		return;
+	}
+	CHECK(rows[i].address == address, "row %u at %08X, expected %08X", i, rows[i].address, address);
+	for (a = address; a < address + rowSize; a++){
+		expected = (a >= first && a <= last) ? pattern(a) : 0xFF;
+		if (rows[i].data[a - address] != expected){
+			CHECK(false, "row %u, %08X: %02X, expected %02X", i, a, rows[i].data[a - address], expected);
+			return;
+		}
+	}
+}
+
+// Any piece size, the same rows
+static const size_t chunks[] = { 1, 7, 64, sizeof(file) };
+
+static void test_checksum(){
+	uint32_t c;
+
+	start();
+	extended(REC_LINEAR, 0x1D00);
+	data(0x1D000000, 16);
+	eof();
+	for (c = 0; c < ARRAYLEN(chunks); c++){
+		CHECK(parse(128, chunks[c]) == HEX_Ok, "status %u", HEX_getStatus());
+		CHECK(HEX_isDone(), "no EOF");
+		CHECK(rowCount == 1, "%u rows", rowCount);
+		check_row(0, 128, 0x1D000000, 0x1D000000, 0x1D00000F);
+	}
+
+	// One bit off in the second data record
+	start();
+	extended(REC_LINEAR, 0x1D00);
+	data(0x1D000000, 16);
+	data(0x1D000010, 16);
+	file[fileLength - 3] = (file[fileLength - 3] == '0') ? '1' : '0';	// Checksum, low digit
+	eof();
+	for (c = 0; c < ARRAYLEN(chunks); c++){
+		CHECK(parse(128, chunks[c]) == HEX_ErrChecksum, "status %u, expected HEX_ErrChecksum", HEX_getStatus());
+		CHECK(HEX_getLine() == 3, "failed on line %u, expected 3", HEX_getLine());
+		CHECK(!HEX_isDone(), "EOF after a bad record");
+	}
+}
+
+static void test_extended(){
+	uint32_t c;
+
+	// Linear, by kseg0 and kseg1 addresses: the top bits go
+	start();
+	extended(REC_LINEAR, 0x9FC0);
+	data(0x1FC00100, 32);
+	extended(REC_LINEAR, 0xBD00);
+	data(0x1D000200, 32);
+	eof();
+	for (c = 0; c < ARRAYLEN(chunks); c++){
+		CHECK(parse(512, chunks[c]) == HEX_Ok, "status %u", HEX_getStatus());
+		CHECK(rowCount == 2, "%u rows", rowCount);
+		check_row(0, 512, 0x1FC00000, 0x1FC00100, 0x1FC0011F);
+		check_row(1, 512, 0x1D000200, 0x1D000200, 0x1D00021F);
+	}
+
+	// Segment replaces the linear base: 0x1000 << 4 isn't flash
+	start();
+	extended(REC_LINEAR, 0x1D00);
+	data(0x1D000000, 16);
+	extended(REC_SEGMENT, 0x1000);
+	data(0x00000000, 16);
+	eof();
+	CHECK(parse(128, sizeof(file)) == HEX_ErrAddress, "status %u, expected HEX_ErrAddress", HEX_getStatus());
+	CHECK(HEX_getLine() == 4, "failed on line %u, expected 4", HEX_getLine());
+
+	// An extended record has 2 data bytes
+	start();
+	record(REC_LINEAR, 0, (const uint8_t *)"\x1D\x00\x00", 3);
+	CHECK(parse(128, sizeof(file)) == HEX_ErrSyntax, "status %u, expected HEX_ErrSyntax", HEX_getStatus());
+}
+
+// A record across rows fills the end of one and the start of the next
+static void test_across_rows(){
+	uint32_t c;
+
+	start();
+	extended(REC_LINEAR, 0x1D00);
+	data(0x1D000070, 32);	// 0x70..0x8F
+	data(0x1D000090, 255);	// To 0x18E, through a whole row
+	eof();
+	for (c = 0; c < ARRAYLEN(chunks); c++){
+		CHECK(parse(128, chunks[c]) == HEX_Ok, "status %u", HEX_getStatus());
+		CHECK(rowCount == 4, "%u rows", rowCount);
+		check_row(0, 128, 0x1D000000, 0x1D000070, 0x1D00007F);
+		check_row(1, 128, 0x1D000080, 0x1D000080, 0x1D0000FF);
+		check_row(2, 128, 0x1D000100, 0x1D000100, 0x1D00017F);
+		check_row(3, 128, 0x1D000180, 0x1D000180, 0x1D00018E);
+	}
+}
+
+// A row gets data again after it was handed out
+static void test_row_again(){
+	uint32_t c;
+
+	start();
+	extended(REC_LINEAR, 0x1D00);
+	data(0x1D000000, 16);
+	data(0x1D000200, 16);
+	data(0x1D000010, 16);
+	eof();
+	for (c = 0; c < ARRAYLEN(chunks); c++){
+		CHECK(parse(512, chunks[c]) == HEX_ErrRowAgain, "status %u, expected HEX_ErrRowAgain", HEX_getStatus());
+		CHECK(HEX_getLine() == 4, "failed on line %u, expected 4", HEX_getLine());
+		CHECK(rowCount == 2, "%u rows", rowCount);
+	}
+
+	// In the same row, out of order, is fine
+	start();
+	extended(REC_LINEAR, 0x1D00);
+	data(0x1D000010, 16);
+	data(0x1D000000, 16);
+	eof();
+	CHECK(parse(512, sizeof(file)) == HEX_Ok, "status %u", HEX_getStatus());
+	check_row(0, 512, 0x1D000000, 0x1D000000, 0x1D00001F);
+}
+
+// Data just outside program and boot flash
+static void test_outside(){
+	static const struct {
+		uint32_t address;
+		HEXStatus status;
+	} cases[] = {
+		{ HEX_FLASH_BASE - 16,					HEX_ErrAddress },
+		{ HEX_FLASH_BASE,						HEX_Ok },
+		{ HEX_FLASH_BASE + HEX_FLASH_SIZE - 16,	HEX_Ok },
+		{ HEX_FLASH_BASE + HEX_FLASH_SIZE,		HEX_ErrAddress },
+		{ HEX_BOOT_BASE - 16,					HEX_ErrAddress },
+		{ HEX_BOOT_BASE,						HEX_Ok },
+		{ HEX_BOOT_BASE + HEX_BOOT_SIZE - 16,	HEX_Ok },
+		{ HEX_BOOT_BASE + HEX_BOOT_SIZE,		HEX_ErrAddress },
+	};
+	uint32_t i;
+
+	for (i = 0; i < ARRAYLEN(cases); i++){
+		start();
+		extended(REC_LINEAR, cases[i].address >> 16);
+		data(cases[i].address, 16);
+		eof();
+		CHECK(parse(128, sizeof(file)) == cases[i].status, "%08X: status %u, expected %u",
+			cases[i].address, HEX_getStatus(), cases[i].status);
+		CHECK(rowCount == (cases[i].status == HEX_Ok), "%08X: %u rows", cases[i].address, rowCount);
+	}
+}
+
+int main(){
+	test_checksum();
+	test_extended();
+	test_across_rows();
+	test_row_again();
+	test_outside();
+	return MOCK_RESULT();
+}
@@ -0,0 +1,155 @@
+// RxMode_DMA receive ring, against the SFR mock. The test plays the DMA
+// channel: it writes into the ring at DCH0DPTR, and raises the half/block
+// events the way the auto-enabled channel does.
+
+#include <string.h>
+#include <mock.h>
+#include "../src/drivers/UARTDrv.c"
+
+static uint8_t nextIn;		// Next byte "received"
+static uint8_t nextOut;		// Next byte expected out of the ring
+static uint32_t bytesOut;
+
+static void dma_interrupt(){
+	if (DCH0INT & 0xFF){
+		IFS1bits.DMA0IF = 1;
+	}
+	if (IFS1bits.DMA0IF && IEC1bits.DMA0IE){
+		DMA0Interrupt();
+		mock_settle();
+	}
+}
+
+// The channel moves n bytes. If deliver is set, the ISR runs at each half and
+// block event. Otherwise its flags stay pending until the next call, like
+// when the main loop gets in first (less than a ring then, or a block end
+// would be missed, as on the chip).
+static void dma_receive(uint32_t n, int deliver){
+	UARTDrvState *p = &uartPorts[Port_Console];
+
+	dma_interrupt();
+	while (n--){
+		p->receiveArray[DCH0DPTR] = nextIn++;
+		DCH0DPTR++;
+		if (DCH0DPTR == UART_RX_BUFFER_SIZE/2){
+			DCH0INTbits.CHDHIF = 1;
+		}
+		if (DCH0DPTR == UART_RX_BUFFER_SIZE){
+			DCH0DPTR = 0;	// Auto-enable, the block starts over
+			DCH0INTbits.CHBCIF = 1;
+		}
+		if (deliver){
+			dma_interrupt();
+		}
+	}
+	if (DCH0INT & 0xFF){
+		IFS1bits.DMA0IF = 1;
+	}
+}
+
+// Read up to max bytes and check they carry on from the last ones
+static uint32_t read_check(uint32_t max){
+	uint8_t buf[UART_RX_BUFFER_SIZE];
+	uint32_t n = UARTDrv_GetReceiveData(Port_Console, buf, max);
+	uint32_t i;
+
+	mock_settle();
+	for (i = 0; i < n; i++){
+		if (buf[i] != nextOut){
+			CHECK(buf[i] == nextOut, "byte %u: got %u, expected %u", bytesOut, buf[i], nextOut);
+			nextOut = buf[i];
+		}
+		nextOut++;
+		bytesOut++;
+	}
+	return n;
+}
+
+static void start(){
+	mock_reset();
+	UARTDrv_Init(Port_Console, 3000000, RxMode_DMA);
+	mock_settle();
+	nextIn = 0;
+	nextOut = 0;
+	bytesOut = 0;
+}
+
+// Many laps, the reader never more than a ring behind. Some of the block ends
+// are still pending when the reader looks. Nothing may be lost or doubled.
+static void test_wrap(){
+	UARTDrvErrors errors;
+	uint32_t seed = 1;
+	uint32_t in = 0;
+	uint32_t i;
+
+	start();
+	for (i = 0; i < 20000; i++){
+		uint32_t unread = in - bytesOut;
+		uint32_t n;
+
+		seed = seed*1103515245 + 12345;
+		n = (seed >> 16) % 300;
+		if (n > (UART_RX_BUFFER_SIZE-1) - unread){
+			n = (UART_RX_BUFFER_SIZE-1) - unread;
+		}
+		dma_receive(n, (seed >> 8) & 1);
+		in += n;
+
+		CHECK(UARTDrv_GetCount(Port_Console) == in - bytesOut,
+			"count %u, expected %u", UARTDrv_GetCount(Port_Console), in - bytesOut);
+		read_check((seed >> 4) & 0xFF);
+	}
+	while (read_check(255) > 0){
+	}
+
+	UARTDrv_GetErrors(Port_Console, &errors);
+	CHECK(bytesOut == in, "%u bytes out of %u", bytesOut, in);
+	CHECK(errors.dropped == 0, "%u dropped", errors.dropped);
+	CHECK(in > 100*UART_RX_BUFFER_SIZE, "only %u bytes through the ring", in);
+}
+
+// The ring filled right up, but not lapped: all of it comes out
+static void test_full(){
+	UARTDrvErrors errors;
+
+	start();
+	dma_receive(UART_RX_BUFFER_SIZE-1, 1);
+	CHECK(UARTDrv_GetCount(Port_Console) == UART_RX_BUFFER_SIZE-1, "count %u", UARTDrv_GetCount(Port_Console));
+	CHECK(read_check(UART_RX_BUFFER_SIZE) == UART_RX_BUFFER_SIZE-1, "not all of the ring in one read");
+	UARTDrv_GetErrors(Port_Console, &errors);
+	CHECK(bytesOut == UART_RX_BUFFER_SIZE-1, "%u bytes out", bytesOut);
+	CHECK(errors.dropped == 0, "%u dropped", errors.dropped);
+}
+
+// The DMA gets a ring or more ahead. Without the lap check the head would look
+// like it is just behind the tail, and stale data would come out.
+static void test_lap(uint32_t extra, int deliver){
+	UARTDrvErrors errors;
+	uint32_t lost = UART_RX_BUFFER_SIZE + extra;
+
+	start();
+	dma_receive(100, 1);
+	read_check(100);
+	dma_receive(lost, deliver);
+
+	CHECK(UARTDrv_GetCount(Port_Console) == 0, "count %u after a lap", UARTDrv_GetCount(Port_Console));
+	UARTDrv_GetErrors(Port_Console, &errors);
+	CHECK(errors.dropped == lost, "%u dropped, expected %u", errors.dropped, lost);
+	CHECK(UARTDrv_TakeErrorEvents(Port_Console) & Error_Dropped, "no Error_Dropped event");
+	mock_settle();
+
+	// Carries on with what comes in next
+	nextOut = nextIn;
+	dma_receive(50, deliver);
+	CHECK(read_check(255) == 50, "not back in step after a lap");
+}
+
+int main(){
+	test_wrap();
+	test_full();
+	test_lap(0, 1);
+	test_lap(17, 1);
+	test_lap(17, 0);
+	test_lap(3*UART_RX_BUFFER_SIZE + 5, 1);
+	return MOCK_RESULT();
+}
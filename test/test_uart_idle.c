@@ -0,0 +1,143 @@
+// The receive idle timer (Timer 2), against the SFR mock. The test plays the
+// timer: while it is on, Timer2Interrupt() runs once per period. An idle line
+// must not cost any of them. While data comes in, the timer picks up what
+// stays below the FIFO threshold, and stops again once the line is quiet.
+
+#include <string.h>
+#include <mock.h>
+#include "../src/drivers/UARTDrv.c"
+
+#define BAUD			3000000
+#define BUFFER_SIZE		8
+
+static uint8_t buffers[UART_NUM_PORTS][BUFFER_SIZE];
+static uint32_t t2Interrupts;
+
+// The UART interrupts, for whatever flag is up
+static void uart_interrupts(){
+	mock_settle();
+	UART1Interrupt();
+	UART2Interrupt();
+	mock_settle();
+}
+
+// n periods of Timer 2, 0 if it is off
+static void t2_periods(uint32_t n){
+	while (n--){
+		mock_settle();
+		if (!T2CONbits.ON){
+			continue;
+		}
+		IFS0bits.T2IF = 1;
+		if (IEC0bits.T2IE){
+			t2Interrupts++;
+			Timer2Interrupt();
+			uart_interrupts();
+		}
+	}
+}
+
+// A second of timer periods
+static uint32_t t2_second(){
+	return GetPeripheralClock()/8/(PR2+1);
+}
+
+static void start(){
+	uint32_t i;
+
+	mock_reset();
+	for (i = 0; i < UART_NUM_PORTS; i++){
+		UARTDrv_Init(i, BAUD, RxMode_Direct);
+		mock_settle();
+		UARTDrv_RxAttach(i, buffers[i], BUFFER_SIZE);
+		mock_settle();
+	}
+	t2Interrupts = 0;
+}
+
+// Attached and nothing coming in: no interrupts at all
+static void test_idle(){
+	uint32_t i;
+
+	start();
+	CHECK(!T2CONbits.ON, "idle timer running on an idle line");
+	for (i = 0; i < UART_NUM_PORTS; i++){
+		CHECK(uartHw[i].sta->URXISEL == 0b00, "port %u: URXISEL %u, expected first byte", i, uartHw[i].sta->URXISEL);
+	}
+	t2_periods(t2_second());
+	CHECK(t2Interrupts == 0, "%u idle timer interrupts in an idle second", t2Interrupts);
+	for (i = 0; i < UART_NUM_PORTS; i++){
+		UARTDrvIsrStats stats;
+		UARTDrv_GetIsrStats(i, &stats);
+		CHECK(stats.calls == 0, "port %u: %u RX interrupts in an idle second", i, stats.calls);
+	}
+}
+
+// A burst on the console, then quiet again
+static void test_burst(){
+	UARTDrvPort port = Port_Console;
+	const UARTDrvHw *hw = &uartHw[port];
+	uint32_t n;
+
+	start();
+
+	// The first byte interrupts. The mock's FIFO never runs empty, so the
+	// buffer fills and the port waits for the next one.
+	hw->sta->URXDA = 1;
+	hw->ifs[SFR_SET] = hw->rxMask;
+	uart_interrupts();
+	CHECK(UARTDrv_RxDetach(port) == BUFFER_SIZE, "first byte not taken");
+	CHECK(T2CONbits.ON, "idle timer not started by the RX interrupt");
+	CHECK(hw->sta->URXISEL == 0b10, "URXISEL %u while receiving, expected 3/4 FIFO", hw->sta->URXISEL);
+
+	// Below the threshold, no RX interrupt. The timer fetches it.
+	hw->sta->URXDA = 0;
+	UARTDrv_RxAttach(port, buffers[port], BUFFER_SIZE);
+	mock_settle();
+	hw->sta->URXDA = 1;
+	t2_periods(1);
+	CHECK(t2Interrupts == 1, "%u idle timer interrupts, expected 1", t2Interrupts);
+	CHECK(UARTDrv_RxDetach(port) == BUFFER_SIZE, "the rest of the burst not picked up by the idle timer");
+	CHECK(T2CONbits.ON, "idle timer stopped while data was waiting");
+
+	// Quiet. The timer finds nothing, and stops.
+	hw->sta->URXDA = 0;
+	UARTDrv_RxAttach(port, buffers[port], BUFFER_SIZE);
+	mock_settle();
+	n = t2Interrupts;
+	t2_periods(t2_second());
+	CHECK(t2Interrupts == n + 1, "%u idle timer interrupts after the burst, expected 1", t2Interrupts - n);
+	CHECK(!T2CONbits.ON, "idle timer still running on an idle line");
+	CHECK(hw->sta->URXISEL == 0b00, "URXISEL %u when idle, expected first byte", hw->sta->URXISEL);
+}
+
+#if UART_RX_BUFFER_SIZE == 0
+// Built without the ring (test_uart_direct): a mode that needs it still receives
+static void test_compiled_out(){
+	const UARTDrvRxMode modes[] = { RxMode_Interrupt, RxMode_DMA };
+	const UARTDrvHw *hw = &uartHw[Port_Console];
+	uint32_t i;
+
+	for (i = 0; i < sizeof(modes)/sizeof(modes[0]); i++){
+		mock_reset();
+		UARTDrv_Init(Port_Console, BAUD, modes[i]);
+		mock_settle();
+		CHECK(uartPorts[Port_Console].rxMode == RxMode_Direct, "mode %u: %u, expected RxMode_Direct",
+			modes[i], uartPorts[Port_Console].rxMode);
+		UARTDrv_RxAttach(Port_Console, buffers[Port_Console], BUFFER_SIZE);
+		hw->sta->URXDA = 1;
+		hw->ifs[SFR_SET] = hw->rxMask;
+		uart_interrupts();
+		CHECK(UARTDrv_RxDetach(Port_Console) == BUFFER_SIZE, "mode %u: nothing received", modes[i]);
+	}
+}
+#endif
+
+int main(){
+	test_idle();
+	test_burst();
+#if UART_RX_BUFFER_SIZE == 0
+	test_compiled_out();
+#endif
+	return MOCK_RESULT();
+}
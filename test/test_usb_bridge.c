@@ -0,0 +1,188 @@
+// The USB to UART bridge (src/main.c), on the simulated SIE.
+// With a slow UART: while the TX ring is full the bridge must NAK its bulk
+// OUT endpoint and nothing else. Every token still gets an answer, EP0 and
+// the other endpoints carry on, and the bytes leave the UART in order, as
+// fast as the wire takes them.
+// With a fast one: a burst of n bytes within a frame goes to the host as full
+// packets and then a short one, or a ZLP when it ends on a packet boundary.
+
+#include <string.h>
+#include <mock.h>
+#include <usb.h>
+#include <usb_ch9.h>
+#include <usb_cdc.h>
+#include <vendor.h>
+#include "sie.h"
+#include "host.h"
+#include "uart_sim.h"
+#include "firmware.h"
+
+#define SLOW_BAUD		9600
+#define FAST_BAUD		12000000
+#define BURST_MAX		256
+#define TOTAL			(8*UART_TX_BUFFER_SIZE)	// Bytes the host sends
+#define BUFFERED		(UART_TX_BUFFER_SIZE + 2*FIRMWARE_BRIDGE_LEN)	// The TX ring, and both ping-pong OUT buffers
+#define CONTROL_EVERY	200		// NAKs on the bulk OUT endpoint between control requests
+
+#define BYTE_BITS(n, baud)	((uint64_t)(n)*10*12000000/(baud))	// Bus bit times for n bytes on a UART
+
+static uint8_t packet[FIRMWARE_BRIDGE_LEN];
+
+static void start(uint32_t baud){
+	struct cdc_line_coding coding = { baud, CDC_CHAR_FORMAT_1_STOP_BIT, CDC_PARITY_NONE, 8 };
+	HostEnum e;
+
+	firmware_start();
+	host_init();
+	CHECK(host_enumerate(&e), "enumeration failed");
+	CHECK(host_control(0x21, CDC_SET_LINE_CODING, 0, 2*Port_Console, sizeof(coding), &coding) == sizeof(coding),
+		"SET_LINE_CODING failed");
+	CHECK(uartSim[Port_Console].baud == baud, "console at %u baud", uartSim[Port_Console].baud);
+}
+
+// A control request in the middle of the NAKs: answered at once, every stage
+static void check_control(){
+	uint32_t naks = sieStats.naks + sieStats.timeouts;
+	uint16_t status = 0xFFFF;
+
+	CHECK(host_control(0x80, GET_STATUS, 0, 0, sizeof(status), &status) == sizeof(status), "GET_STATUS failed");
+	CHECK(sieStats.naks + sieStats.timeouts == naks, "EP0 NAKed or didn't answer while EP2 OUT was full");
+}
+
+// The other port's IN endpoint, in the middle of the NAKs
+static void check_aux_in(){
+	uint8_t in[FIRMWARE_BRIDGE_LEN];
+	uint32_t got = 0;
+	int32_t n;
+	uint32_t i;
+
+	uart_sim_receive(Port_Aux, 10);
+	while (got < 10){	// The bytes trickle in, so maybe in more than one packet
+		n = host_bulk_in(FIRMWARE_BRIDGE_EP(Port_Aux), in + got, sizeof(in) - got, FIRMWARE_BRIDGE_LEN);
+		if (n < 0){
+			CHECK(false, "EP4 IN failed while EP2 OUT was full");
+			return;
+		}
+		got += n;
+	}
+	CHECK(got == 10, "EP4 IN: %u bytes", got);
+	for (i = 0; i < got; i++){
+		CHECK(in[i] == i, "EP4 IN byte %u is %u", i, in[i]);
+	}
+}
+
+static void test_slow_tx(){
+	UartSimPort *u = &uartSim[Port_Console];
+	uint32_t timeouts;
+	uint32_t naks = 0;
+	uint32_t controls = 0;
+	uint32_t sent = 0;
+	uint64_t bits;
+	uint32_t i;
+	SieResult r;
+
+	start(SLOW_BAUD);
+	timeouts = sieStats.timeouts;
+	bits = sieStats.bits;
+	hostNakLimit = 1;	// Every attempt comes back here
+	while (sent < TOTAL){
+		for (i = 0; i < sizeof(packet); i++){
+			packet[i] = sent + i;
+		}
+		while ((r = host_out(FIRMWARE_BRIDGE_EP(Port_Console), packet, sizeof(packet))) == Sie_Nak){
+			if (++naks % CONTROL_EVERY == 0){
+				hostNakLimit = 100000;
+				check_control();
+				if (controls++ == 0){
+					check_aux_in();
+				}
+				hostNakLimit = 1;
+			}
+		}
+		if (r != Sie_Ack){
+			CHECK(false, "EP2 OUT: %u after %u bytes", r, sent);
+			break;
+		}
+		// Taken only when it fits, so nothing is lost
+		CHECK(u->txWire + BUFFERED >= sent + sizeof(packet), "%u bytes held", (uint32_t)(sent + sizeof(packet) - u->txWire));
+		sent += sizeof(packet);
+	}
+	hostNakLimit = 100000;
+
+	CHECK(naks > 0, "EP2 OUT never NAKed, the UART isn't slow");
+	CHECK(controls > 0, "no control requests in the NAKs");
+	CHECK(sieStats.timeouts == timeouts, "%u tokens got no answer", sieStats.timeouts - timeouts);
+
+	// The wire is the limit: once the buffers filled, the host waits only for it
+	bits = sieStats.bits - bits;
+	CHECK(bits >= BYTE_BITS(TOTAL - BUFFERED, SLOW_BAUD),
+		"%u bytes in %u us, faster than the wire", TOTAL, (uint32_t)(bits/12));
+	CHECK(bits <= BYTE_BITS(TOTAL, SLOW_BAUD), "%u bytes in %u us, slower than the wire", TOTAL, (uint32_t)(bits/12));
+
+	// The rest drains, in order
+	sie_idle(BYTE_BITS(BUFFERED, SLOW_BAUD) + SIE_BITS_PER_FRAME);
+	CHECK(u->txWire == TOTAL, "%u of %u bytes out of the UART", u->txWire, TOTAL);
+	CHECK(u->txErrors == 0, "%u bytes out of order", u->txErrors);
+}
+
+// Polls EP2 IN until the burst and the coalescing time are over, and checks
+// the packet lengths. The bytes carry on from the last burst.
+static void check_burst(uint32_t n, uint8_t *next){
+	uint8_t in[FIRMWARE_BRIDGE_LEN];
+	uint32_t lengths[BURST_MAX/FIRMWARE_BRIDGE_LEN + 2];
+	uint32_t packets = 0;
+	uint32_t expected;
+	uint32_t len;
+	uint32_t sofs;
+	uint32_t i;
+	uint64_t end;
+
+	// Right after a SOF, so the burst is in before the coalescing time can
+	// end it early (256 bytes take 213us at FAST_BAUD)
+	sofs = sieStats.sofs;
+	while (sieStats.sofs == sofs){
+		sie_idle(SIE_BITS_PER_FRAME/100);
+	}
+	uart_sim_receive(Port_Console, n);
+	end = sieStats.bits + BYTE_BITS(n, FAST_BAUD) + (BRIDGE_COALESCE_FRAMES_DEFAULT + 2)*SIE_BITS_PER_FRAME;
+	while (sieStats.bits < end){
+		if (host_in(FIRMWARE_BRIDGE_EP(Port_Console), in, &len) != Sie_Ack){
+			continue;
+		}
+		if (packets == USB_ARRAYLEN(lengths)){
+			CHECK(false, "%u bytes: too many packets", n);
+			return;
+		}
+		lengths[packets++] = len;
+		for (i = 0; i < len; i++){
+			CHECK(in[i] == *next, "%u bytes: %u where %u was next", n, in[i], *next);
+			*next = in[i] + 1;
+		}
+	}
+
+	// Full packets, then the rest, or a ZLP if there is no rest
+	expected = n/FIRMWARE_BRIDGE_LEN + (n > 0);
+	CHECK(packets == expected, "%u bytes: %u packets, expected %u", n, packets, expected);
+	for (i = 0; i < packets && i < expected; i++){
+		len = (i < n/FIRMWARE_BRIDGE_LEN) ? FIRMWARE_BRIDGE_LEN : n%FIRMWARE_BRIDGE_LEN;
+		CHECK(lengths[i] == len, "%u bytes: packet %u is %u bytes, expected %u", n, i, lengths[i], len);
+	}
+}
+
+static void test_zlp_sequence(){
+	uint8_t next = 0;
+	uint32_t n;
+
+	start(FAST_BAUD);
+	hostNakLimit = 1;
+	for (n = 0; n <= BURST_MAX; n++){
+		check_burst(n, &next);
+	}
+	hostNakLimit = 100000;
+}
+
+int main(){
+	test_slow_tx();
+	test_zlp_sequence();
+	return MOCK_RESULT();
+}
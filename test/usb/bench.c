@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include "bench.h"
+
+static bool times;
+static bool instructions;
+
+void bench_start(bool hostTimes){
+	times = hostTimes;
+	instructions = hostTimes && sie_count_instructions();
+	printf("%-28s %-6s %10s %9s %9s %9s %11s", "case", "per", "tokens", "naks", "irqs", "loops", "bus_us");
+	if (times){
+		printf(" %11s %11s %12s %12s", "host_ns", "irq_ns", "host_instr", "irq_instr");
+	}
+	printf("\n");
+}
+
+void bench_begin(SieStats *mark){
+	*mark = sieStats;
+}
+
+uint32_t bench_tokens(const SieStats *mark){
+	return (sieStats.setups - mark->setups) + (sieStats.ins - mark->ins) + (sieStats.outs - mark->outs)
+		+ (sieStats.naks - mark->naks) + (sieStats.stalls - mark->stalls) + (sieStats.timeouts - mark->timeouts);
+}
+
+void bench_row(const char *name, const char *unit, double units, const SieStats *mark){
+	printf("%-28s %-6s %10.1f %9.1f %9.1f %9.1f %11.1f", name, unit,
+		bench_tokens(mark) / units,
+		(sieStats.naks - mark->naks + sieStats.timeouts - mark->timeouts) / units,
+		(sieStats.interrupts - mark->interrupts) / units,
+		(sieStats.mainLoops - mark->mainLoops) / units,
+		(sieStats.bits - mark->bits) / 12.0 / units);
+	if (times){
+		printf(" %11.0f %11.0f", (sieStats.deviceNs - mark->deviceNs) / units,
+			(sieStats.serviceNs - mark->serviceNs) / units);
+		if (instructions){
+			printf(" %12.0f %12.0f", (sieStats.deviceInstructions - mark->deviceInstructions) / units,
+				(sieStats.serviceInstructions - mark->serviceInstructions) / units);
+		}
+		else{
+			printf(" %12s %12s", "n/a", "n/a");
+		}
+	}
+	printf("\n");
+}
@@ -0,0 +1,31 @@
+#ifndef BENCH_H_21d6f8e4a9c04b7e93a5c0b8e4f17d26
+#define BENCH_H_21d6f8e4a9c04b7e93a5c0b8e4f17d26
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include "sie.h"
+
+// Benchmark rows for the USB stack on the simulated SIE. Each row is one
+// case, divided by its unit (an enumeration, a MB, a sector). The simulation
+// is deterministic, so these columns only change with the code:
+//   tokens      Transactions, by the host, NAKed or not
+//   naks        Of them, NAKed (or not answered)
+//   irqs        usb_service() calls from the USB interrupt
+//   loops       Main loop passes. One runs after every token.
+//   bus_us      Bus time at 12Mbit/s
+// With host times on (bench_start(true)), four columns more, which vary from
+// run to run and machine to machine:
+//   host_ns     Time in the device code (usb_service() and the main loop)
+//   irq_ns      Of it, in usb_service(), the USB interrupt
+//   host_instr  Host instructions in the device code, and in usb_service(),
+//   irq_instr   where perf events are available. x86-64 (or so), not MIPS:
+//               compare them with each other only.
+// Rows "per token" divide by the tokens of the case, for the stack's cost of
+// one transaction.
+
+void bench_start(bool hostTimes);
+void bench_begin(SieStats *mark);
+uint32_t bench_tokens(const SieStats *mark);	// Tokens since bench_begin()
+void bench_row(const char *name, const char *unit, double units, const SieStats *mark);
+
+#endif
@@ -0,0 +1,41 @@
+// src/main.c, with its main() renamed, so the tests can run setup() and
+// loop() themselves. The programmer channel is stubbed out, unless
+// FIRMWARE_COMMS is defined.
+
+#define main firmware_main
+#include "../../src/main.c"
+#undef main
+
+#include <mock.h>
+#include "sie.h"
+#include "uart_sim.h"
+#include "firmware.h"
+
+void BTN_init(){
+}
+
+// With FIRMWARE_COMMS, the real COMMS.c is linked in
+#ifndef FIRMWARE_COMMS
+void COMMS_init(){
+}
+
+void COMMS_reset(){
+}
+
+void COMMS_service(){
+}
+#endif
+
+void firmware_pass(){
+	uart_sim_run();
+	loop();
+}
+
+void firmware_start(){
+	sie_init();
+	setup();
+	usb_application_init_serial();
+	usb_init();
+	mock_settle();
+	sieMainLoop = firmware_pass;
+}
@@ -0,0 +1,17 @@
+#ifndef FIRMWARE_H_b41d9e6a07c34f28935e1f7a2cd8b650
+#define FIRMWARE_H_b41d9e6a07c34f28935e1f7a2cd8b650
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+// The adapter firmware (src/main.c, the CDC bridge) on the simulated SIE.
+// The UARTs are uart_sim.c, the programmer channel is stubbed out (see
+// firmware.c for building it in).
+
+#define FIRMWARE_BRIDGE_EP(port)	(2 + 2*(port))	// Bulk data endpoint of a port
+#define FIRMWARE_BRIDGE_LEN			64
+
+void firmware_start();	// sie_init(), then what main() does before its loop
+void firmware_pass();	// One main loop pass, after the UART wires caught up
+
+#endif
@@ -0,0 +1,256 @@
+#include <string.h>
+#include <mock.h>
+#include "host.h"
+
+#define MIN(x,y) (((x)<(y))?(x):(y))
+
+uint8_t hostAddr = 0;
+uint8_t hostEp0Size = 64;
+uint32_t hostNakLimit = 100000;
+
+static bool toggle[16][2];	// DATA1 next, per endpoint, OUT and IN
+
+#define HOST_TIMEOUTS	3	// Like a host controller, then the transaction fails
+
+// Address 0, toggles reset, EP0 size unknown (the first read asks for 64)
+void host_init(){
+	hostAddr = 0;
+	hostEp0Size = 64;
+	memset(toggle, 0, sizeof(toggle));
+}
+
+void host_reset_toggle(uint8_t ep){
+	toggle[ep][0] = false;
+	toggle[ep][1] = false;
+}
+
+SieResult host_out(uint8_t ep, const void *data, uint32_t len){
+	uint32_t naks = 0;
+	uint32_t timeouts = 0;
+	SieResult r;
+
+	for (;;){
+		r = sie_out(hostAddr, ep, toggle[ep][0], data, len);
+		if (r == Sie_Nak && ++naks < hostNakLimit){
+			continue;
+		}
+		if (r == Sie_Timeout && ++timeouts < HOST_TIMEOUTS){
+			continue;
+		}
+		break;
+	}
+	if (r == Sie_Ack){
+		toggle[ep][0] = !toggle[ep][0];
+	}
+	return r;
+}
+
+SieResult host_in(uint8_t ep, void *data, uint32_t *len){
+	uint32_t naks = 0;
+	uint32_t timeouts = 0;
+	bool data1;
+	SieResult r;
+
+	for (;;){
+		r = sie_in(hostAddr, ep, &data1, data, len);
+		if (r == Sie_Nak && ++naks < hostNakLimit){
+			continue;
+		}
+		if (r == Sie_Timeout && ++timeouts < HOST_TIMEOUTS){
+			continue;
+		}
+		break;
+	}
+	if (r == Sie_Ack){
+		// No ACK is ever lost here, so the device can't have a reason to resend
+		CHECK(data1 == toggle[ep][1], "EP%u IN: DATA%u, expected DATA%u", ep, data1, toggle[ep][1]);
+		toggle[ep][1] = !data1;
+	}
+	return r;
+}
+
+// SETUP, DATA stage in EP0 sized packets, STATUS. Returns the data stage
+// length, or -1 if the device stalled or stopped answering.
+int32_t host_control(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index, uint16_t length, void *data){
+	struct setup_packet setup;
+	uint8_t packet[HOST_MAX_PACKET];
+	uint8_t *p = data;
+	bool in = requestType & 0x80;
+	uint32_t done = 0;
+	uint32_t timeouts = 0;
+	uint32_t n;
+	SieResult r;
+
+	setup.REQUEST.bmRequestType = requestType;
+	setup.bRequest = request;
+	setup.wValue = value;
+	setup.wIndex = index;
+	setup.wLength = length;
+	while ((r = sie_setup(hostAddr, 0, &setup)) == Sie_Timeout && ++timeouts < HOST_TIMEOUTS){
+	}
+	if (r != Sie_Ack){
+		return -1;
+	}
+
+	toggle[0][0] = true;
+	toggle[0][1] = true;
+	while (done < length){
+		if (in){
+			if (host_in(0, packet, &n) != Sie_Ack){
+				return -1;
+			}
+			CHECK(n <= hostEp0Size && n <= length - done, "EP0 IN: %u bytes, with %u to go", n, length - done);
+			memcpy(p + done, packet, MIN(n, length - done));
+			done += n;
+			if (n < hostEp0Size){
+				break;	// Short packet, the device has no more
+			}
+		}
+		else{
+			n = MIN(hostEp0Size, length - done);
+			if (host_out(0, p + done, n) != Sie_Ack){
+				return -1;
+			}
+			done += n;
+		}
+	}
+
+	// The status stage goes the other way, always DATA1 and zero length
+	toggle[0][0] = true;
+	toggle[0][1] = true;
+	if (in){
+		r = host_out(0, NULL, 0);
+	}
+	else{
+		r = host_in(0, packet, &n);
+		CHECK(r != Sie_Ack || n == 0, "status stage: %u bytes", n);
+	}
+	return (r == Sie_Ack) ? (int32_t)done : -1;
+}
+
+int32_t host_get_descriptor(uint8_t type, uint8_t index, uint16_t lang, uint16_t length, void *data){
+	return host_control(0x80, GET_DESCRIPTOR, (type << 8) | index, lang, length, data);
+}
+
+// The way Linux enumerates: a 64-byte device descriptor read at address 0 to
+// learn the EP0 size, a second reset, SET_ADDRESS, then the full device and
+// configuration descriptors, the strings, and SET_CONFIGURATION.
+bool host_enumerate(HostEnum *e){
+	SieStats before = sieStats;
+	uint8_t buf[255];
+	uint16_t langId;
+	bool ok = false;
+
+	memset(e, 0, sizeof(*e));
+	host_init();
+	sie_bus_reset();
+	if (host_get_descriptor(DESC_DEVICE, 0, 0, 64, buf) < 8){
+		goto done;
+	}
+	hostEp0Size = buf[7];
+	sie_bus_reset();
+	if (host_control(0x00, SET_ADDRESS, HOST_ADDRESS, 0, 0, NULL) < 0){
+		goto done;
+	}
+	hostAddr = HOST_ADDRESS;
+	sie_idle(2*SIE_BITS_PER_FRAME);	// The 2ms SET_ADDRESS recovery time
+
+	if (host_get_descriptor(DESC_DEVICE, 0, 0, sizeof(e->device), &e->device) != sizeof(e->device)
+		|| host_get_descriptor(DESC_CONFIGURATION, 0, 0, 9, e->config) != 9){
+		goto done;
+	}
+	e->configLength = e->config[2] | (e->config[3] << 8);
+	if (e->configLength > sizeof(e->config)
+		|| host_get_descriptor(DESC_CONFIGURATION, 0, 0, e->configLength, e->config) != e->configLength){
+		goto done;
+	}
+
+	if (host_get_descriptor(DESC_STRING, 0, 0, 255, buf) < 4){
+		goto done;
+	}
+	langId = buf[2] | (buf[3] << 8);
+	if ((e->device.iProduct && host_get_descriptor(DESC_STRING, e->device.iProduct, langId, 255, buf) < 2)
+		|| (e->device.iManufacturer && host_get_descriptor(DESC_STRING, e->device.iManufacturer, langId, 255, buf) < 2)
+		|| (e->device.iSerialNumber && host_get_descriptor(DESC_STRING, e->device.iSerialNumber, langId, 255, buf) < 2)){
+		goto done;
+	}
+	ok = host_control(0x00, SET_CONFIGURATION, 1, 0, 0, NULL) == 0;
+	memset(toggle + 1, 0, sizeof(toggle) - sizeof(toggle[0]));
+
+done:
+	e->transactions = (sieStats.setups - before.setups) + (sieStats.ins - before.ins) + (sieStats.outs - before.outs);
+	e->naks = sieStats.naks - before.naks;
+	e->bits = sieStats.bits - before.bits;
+	e->interrupts = sieStats.interrupts - before.interrupts;
+	e->deviceNs = sieStats.deviceNs - before.deviceNs;
+	return ok;
+}
+
+int32_t host_bulk_out(uint8_t ep, const void *data, uint32_t len, uint16_t maxPacket, bool zlp){
+	const uint8_t *p = data;
+	uint32_t done = 0;
+
+	while (done < len){
+		uint32_t n = MIN(maxPacket, len - done);
+		if (host_out(ep, p + done, n) != Sie_Ack){
+			return -1;
+		}
+		done += n;
+	}
+	if (zlp && len % maxPacket == 0 && host_out(ep, NULL, 0) != Sie_Ack){
+		return -1;
+	}
+	return done;
+}
+
+int32_t host_bulk_in(uint8_t ep, void *data, uint32_t len, uint16_t maxPacket){
+	uint8_t packet[HOST_MAX_PACKET];
+	uint8_t *p = data;
+	uint32_t done = 0;
+	uint32_t n;
+
+	while (done < len){
+		if (host_in(ep, packet, &n) != Sie_Ack){
+			return -1;
+		}
+		CHECK(n <= maxPacket && n <= len - done, "EP%u IN: %u bytes, with %u to go", ep, n, len - done);
+		memcpy(p + done, packet, MIN(n, len - done));
+		done += n;
+		if (n < maxPacket){
+			break;
+		}
+	}
+	return done;
+}
+
+int32_t host_msc_command(uint8_t ep, const uint8_t *cdb, uint8_t cdbLength, bool in, void *data, uint32_t length){
+	static uint32_t tag;
+	uint8_t cbw[31] = { 'U', 'S', 'B', 'C' };
+	uint8_t csw[13];
+	uint32_t residue;
+
+	tag++;
+	memcpy(cbw + 4, &tag, 4);
+	memcpy(cbw + 8, &length, 4);
+	cbw[12] = in ? 0x80 : 0x00;
+	cbw[14] = cdbLength;
+	memcpy(cbw + 15, cdb, cdbLength);
+	if (host_bulk_out(ep, cbw, sizeof(cbw), HOST_MSC_PACKET, false) != sizeof(cbw)){
+		return -1;
+	}
+	if (length > 0){
+		if (in && host_bulk_in(ep, data, length, HOST_MSC_PACKET) != (int32_t)length){
+			return -1;
+		}
+		if (!in && host_bulk_out(ep, data, length, HOST_MSC_PACKET, false) != (int32_t)length){
+			return -1;
+		}
+	}
+	if (host_bulk_in(ep, csw, sizeof(csw), HOST_MSC_PACKET) != sizeof(csw)
+		|| memcmp(csw, "USBS", 4) != 0 || memcmp(csw + 4, &tag, 4) != 0){
+		return -1;
+	}
+	memcpy(&residue, csw + 8, 4);
+	CHECK(residue == 0 || csw[12] != 0, "CSW residue %u with status passed", residue);
+	return csw[12];
+}
@@ -0,0 +1,53 @@
+#ifndef HOST_H_e07b4d91c35a4f2880d6a1c9b3e52f74
+#define HOST_H_e07b4d91c35a4f2880d6a1c9b3e52f74
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <usb_ch9.h>
+#include "sie.h"
+
+// Scripted USB host on the simulated SIE: control transfers, enumeration and
+// bulk transfers, packet by packet, the way a PC host controller runs them.
+// Data toggles are kept per endpoint, a mismatch from the device fails a CHECK.
+
+#define HOST_ADDRESS		5		// Given to the device by host_enumerate()
+#define HOST_MAX_PACKET		1023
+#define HOST_MSC_PACKET		64		// Bulk packet size, for host_msc_command()
+
+// What an enumeration cost, see host_enumerate()
+typedef struct HostEnumStruct {
+	uint32_t transactions;	// Completed EP0 transactions
+	uint32_t naks;
+	uint64_t bits;			// Bus time
+	uint32_t interrupts;	// usb_service() calls
+	uint64_t deviceNs;		// Host time spent running the device
+	struct device_descriptor device;
+	uint8_t config[1024];	// The whole configuration descriptor
+	uint16_t configLength;
+} HostEnum;
+
+extern uint8_t hostAddr;
+extern uint8_t hostEp0Size;
+extern uint32_t hostNakLimit;	// NAKs before a transaction is given up
+
+void host_init();
+int32_t host_control(uint8_t requestType, uint8_t request, uint16_t value, uint16_t index, uint16_t length, void *data);
+int32_t host_get_descriptor(uint8_t type, uint8_t index, uint16_t lang, uint16_t length, void *data);
+bool host_enumerate(HostEnum *e);
+
+// One packet, NAKs retried up to hostNakLimit
+SieResult host_out(uint8_t ep, const void *data, uint32_t len);
+SieResult host_in(uint8_t ep, void *data, uint32_t *len);
+
+// Bulk transfers. Out: len bytes in maxPacket pieces, and a ZLP after a last
+// full one if zlp is set. In: up to len bytes, until a short packet.
+// Both return the bytes moved, or -1 on a stall or too many NAKs.
+int32_t host_bulk_out(uint8_t ep, const void *data, uint32_t len, uint16_t maxPacket, bool zlp);
+int32_t host_bulk_in(uint8_t ep, void *data, uint32_t len, uint16_t maxPacket);
+void host_reset_toggle(uint8_t ep);
+
+// One Bulk-Only Transport command on a bulk IN/OUT endpoint pair: CBW, data
+// (in or out, length may be 0), CSW. Returns the CSW status, or -1.
+int32_t host_msc_command(uint8_t ep, const uint8_t *cdb, uint8_t cdbLength, bool in, void *data, uint32_t length);
+
+#endif
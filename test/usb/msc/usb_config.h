@@ -0,0 +1,55 @@
+/*
+ * USB configuration of the MSC + HID test device, see msc_device.c. It is
+ * only built on the host, to run usb_msc.c and usb_hid.c on the simulated
+ * SIE. The include path puts it ahead of inc/usb/usb_config.h, and the
+ * shared guard keeps that one out.
+ */
+
+#ifndef USB_CONFIG_H__
+#define USB_CONFIG_H__
+
+/* EP1: MSC bulk IN/OUT. EP2: HID interrupt IN/OUT. */
+#define NUM_ENDPOINT_NUMBERS 2
+
+#define EP_0_LEN 64
+
+#define EP_1_OUT_LEN 64
+#define EP_1_IN_LEN 64
+#define EP_2_OUT_LEN 8
+#define EP_2_IN_LEN 8
+
+#define NUMBER_OF_CONFIGURATIONS 1
+
+/* PIC32MX only supports PPB_ALL */
+#define PPB_MODE PPB_ALL
+
+#define USB_USE_INTERRUPTS
+#define USB_STATS
+
+#define MULTI_CLASS_DEVICE
+
+/* Objects from msc_device.c */
+#define USB_DEVICE_DESCRIPTOR msc_device_descriptor
+#define USB_CONFIG_DESCRIPTOR_MAP msc_device_config_descs
+#define USB_STRING_DESCRIPTOR_FUNC msc_device_get_string
+
+#define SET_CONFIGURATION_CALLBACK msc_device_set_configuration_callback
+#define ENDPOINT_HALT_CALLBACK     msc_device_endpoint_halt_callback
+#define UNKNOWN_SETUP_REQUEST_CALLBACK msc_device_unknown_setup_request_callback
+
+/* HID */
+#define USB_HID_DESCRIPTOR_FUNC msc_device_get_hid_descriptor
+#define USB_HID_REPORT_DESCRIPTOR_FUNC msc_device_get_hid_report_descriptor
+
+/* MSC, one LUN, read and write. usb_msc.c and usb_msc.h check
+   USE_USB_MSC_DEFINITELY before they include this file, so it is set with
+   -D in the Makefile. */
+#define MSC_MAX_LUNS_PER_INTERFACE 1
+#define MSC_WRITE_SUPPORT
+#define MSC_GET_STORAGE_INFORMATION msc_device_get_storage_info
+#define MSC_UNIT_READY msc_device_unit_ready
+#define MSC_START_STOP_UNIT msc_device_start_stop_unit
+#define MSC_START_READ msc_device_start_read
+#define MSC_START_WRITE msc_device_start_write
+
+#endif /* USB_CONFIG_H__ */
@@ -0,0 +1,309 @@
+#include <string.h>
+#include <mock.h>
+#include <usb_config.h>
+#include <usb.h>
+#include <usb_ch9.h>
+#include <usb_hid.h>
+#include <usb_msc.h>
+#include "sie.h"
+#include "msc_device.h"
+
+uint8_t mscDisk[MSC_DEVICE_BLOCKS][MSC_DEVICE_BLOCK_SIZE];
+
+struct configuration_packet {
+	struct configuration_descriptor	config;
+	struct interface_descriptor		msc_interface;
+	struct endpoint_descriptor		msc_ep_in;
+	struct endpoint_descriptor		msc_ep_out;
+	struct interface_descriptor		hid_interface;
+	struct hid_descriptor			hid;
+	struct endpoint_descriptor		hid_ep_in;
+	struct endpoint_descriptor		hid_ep_out;
+};
+
+const struct device_descriptor msc_device_descriptor = {
+	sizeof(struct device_descriptor),
+	DESC_DEVICE,
+	0x0200,		// USB 2.0
+	DEVICE_CLASS_DEFINED_AT_INTERFACE_LEVEL,
+	0x00,		// Subclass
+	0x00,		// Protocol
+	EP_0_LEN,
+	0x1209,		// VID, pid.codes test range
+	0x0001,		// PID
+	0x0001,		// bcdDevice
+	1,			// iManufacturer
+	2,			// iProduct
+	3,			// iSerialNumber
+	NUMBER_OF_CONFIGURATIONS,
+};
+
+// Vendor defined, one 8-byte report each way
+static const uint8_t hid_report_descriptor[] = {
+	0x06, 0x00, 0xFF,	// Usage page (vendor defined)
+	0x09, 0x01,			// Usage (1)
+	0xA1, 0x01,			// Collection (application)
+	0x15, 0x00,			//   Logical minimum (0)
+	0x26, 0xFF, 0x00,	//   Logical maximum (255)
+	0x75, 0x08,			//   Report size (8)
+	0x95, 0x08,			//   Report count (8)
+	0x09, 0x01,			//   Usage (1)
+	0x81, 0x02,			//   Input (data, variable, absolute)
+	0x09, 0x01,			//   Usage (1)
+	0x91, 0x02,			//   Output (data, variable, absolute)
+	0xC0,				// End collection
+};
+
+static const struct configuration_packet configuration = {
+	{
+	sizeof(struct configuration_descriptor),
+	DESC_CONFIGURATION,
+	sizeof(configuration),
+	2,			// bNumInterfaces
+	1,			// bConfigurationValue
+	0,			// iConfiguration
+	0b10000000,
+	100/2,		// 100mA
+	},
+
+	{
+	sizeof(struct interface_descriptor),
+	DESC_INTERFACE,
+	0,			// bInterfaceNumber
+	0,			// bAlternateSetting
+	2,			// bNumEndpoints
+	MSC_DEVICE_CLASS,
+	MSC_SCSI_TRANSPARENT_COMMAND_SET_SUBCLASS,
+	MSC_PROTOCOL_CODE_BBB,
+	0,			// iInterface
+	},
+	{
+	sizeof(struct endpoint_descriptor),
+	DESC_ENDPOINT,
+	MSC_DEVICE_EP | 0x80,
+	EP_BULK,
+	EP_1_IN_LEN,
+	1,
+	},
+	{
+	sizeof(struct endpoint_descriptor),
+	DESC_ENDPOINT,
+	MSC_DEVICE_EP,
+	EP_BULK,
+	EP_1_OUT_LEN,
+	1,
+	},
+
+	{
+	sizeof(struct interface_descriptor),
+	DESC_INTERFACE,
+	1,			// bInterfaceNumber
+	0,			// bAlternateSetting
+	2,			// bNumEndpoints
+	HID_INTERFACE_CLASS,
+	0,			// No boot protocol
+	0,
+	0,			// iInterface
+	},
+	{
+	sizeof(struct hid_descriptor),
+	DESC_HID,
+	0x0101,		// HID 1.11
+	0,			// bCountryCode
+	1,			// bNumDescriptors
+	DESC_REPORT,
+	sizeof(hid_report_descriptor),
+	},
+	{
+	sizeof(struct endpoint_descriptor),
+	DESC_ENDPOINT,
+	MSC_DEVICE_HID_EP | 0x80,
+	EP_INTERRUPT,
+	EP_2_IN_LEN,
+	1,			// 1ms
+	},
+	{
+	sizeof(struct endpoint_descriptor),
+	DESC_ENDPOINT,
+	MSC_DEVICE_HID_EP,
+	EP_INTERRUPT,
+	EP_2_OUT_LEN,
+	1,
+	},
+};
+
+const struct configuration_descriptor *msc_device_config_descs[] = {
+	(struct configuration_descriptor *)&configuration,
+};
+STATIC_SIZE_CHECK_EQUAL(USB_ARRAYLEN(USB_CONFIG_DESCRIPTOR_MAP), NUMBER_OF_CONFIGURATIONS);
+
+static const struct {uint8_t bLength; uint8_t bDescriptorType; uint16_t lang; } str00 = {
+	sizeof(str00), DESC_STRING, 0x0409
+};
+static const struct {uint8_t bLength; uint8_t bDescriptorType; uint16_t chars[4]; } vendor_string = {
+	sizeof(vendor_string), DESC_STRING, {'T','e','s','t'}
+};
+static const struct {uint8_t bLength; uint8_t bDescriptorType; uint16_t chars[10]; } product_string = {
+	sizeof(product_string), DESC_STRING, {'M','S','C',' ','+',' ','H','I','D',' '}
+};
+static const struct {uint8_t bLength; uint8_t bDescriptorType; uint16_t chars[8]; } serial_string = {
+	sizeof(serial_string), DESC_STRING, {'0','0','0','0','0','0','0','1'}
+};
+
+static const struct {
+	const void *ptr;
+	uint8_t len;
+} string_descriptors[] = {
+	{ &str00, sizeof(str00) },
+	{ &vendor_string, sizeof(vendor_string) },
+	{ &product_string, sizeof(product_string) },
+	{ &serial_string, sizeof(serial_string) },
+};
+
+int16_t msc_device_get_string(uint8_t string_number, const void **ptr){
+	if (string_number >= USB_ARRAYLEN(string_descriptors)){
+		return -1;
+	}
+	*ptr = string_descriptors[string_number].ptr;
+	return string_descriptors[string_number].len;
+}
+
+int16_t msc_device_get_hid_descriptor(uint8_t interface, const void **ptr){
+	*ptr = &configuration.hid;
+	return sizeof(configuration.hid);
+}
+
+int16_t msc_device_get_hid_report_descriptor(uint8_t interface, const void **ptr){
+	*ptr = hid_report_descriptor;
+	return sizeof(hid_report_descriptor);
+}
+
+// MSC application
+
+static struct msc_application_data mscData = {
+	0,				// interface
+	0,				// max_lun
+	MSC_DEVICE_EP,	// in_endpoint
+	MSC_DEVICE_EP,	// out_endpoint
+	EP_1_IN_LEN,	// in_endpoint_size
+	0,				// media_is_removable_mask
+	"Test    ",		// vendor, 8 characters
+	"RAM disk        ",	// product, 16 characters
+	"0001",			// revision, 4 characters
+};
+
+static uint8_t mscInterfaces[] = { 0 };
+static uint8_t hidInterfaces[] = { 1 };
+
+// The transfer the main loop is working on
+static struct {
+	bool reading;
+	bool writing;
+	volatile bool blockDone;	// Set by the USB interrupt
+	uint32_t lba;
+	uint16_t blocks;
+	uint8_t buffer[MSC_DEVICE_BLOCK_SIZE];	// Write data, until it goes to the disk
+} transfer;
+
+int8_t msc_device_get_storage_info(const struct msc_application_data *app_data, uint8_t lun,
+	uint32_t *block_size, uint32_t *num_blocks, bool *write_protect){
+	*block_size = MSC_DEVICE_BLOCK_SIZE;
+	*num_blocks = MSC_DEVICE_BLOCKS;
+	*write_protect = false;
+	return 0;
+}
+
+int8_t msc_device_unit_ready(const struct msc_application_data *app_data, uint8_t lun){
+	return 0;
+}
+
+int8_t msc_device_start_stop_unit(const struct msc_application_data *app_data, uint8_t lun, bool start, bool load_eject){
+	return 0;
+}
+
+static void block_done(struct msc_application_data *app_data, bool transfer_ok){
+	transfer.blockDone = true;
+}
+
+int8_t msc_device_start_read(struct msc_application_data *app_data, uint8_t lun, uint32_t lba_address, uint16_t num_blocks){
+	if (lba_address >= MSC_DEVICE_BLOCKS || num_blocks > MSC_DEVICE_BLOCKS - lba_address){
+		return MSC_ERROR_INVALID_ADDRESS;
+	}
+	transfer.reading = true;
+	transfer.blockDone = true;	// Start with the first one
+	transfer.lba = lba_address;
+	transfer.blocks = num_blocks;
+	return 0;
+}
+
+int8_t msc_device_start_write(struct msc_application_data *app_data, uint8_t lun, uint32_t lba_address, uint16_t num_blocks,
+	uint8_t **buffer, size_t *buffer_len, msc_completion_callback *callback){
+	if (lba_address >= MSC_DEVICE_BLOCKS || num_blocks > MSC_DEVICE_BLOCKS - lba_address){
+		return MSC_ERROR_INVALID_ADDRESS;
+	}
+	transfer.writing = true;
+	transfer.blockDone = false;
+	transfer.lba = lba_address;
+	transfer.blocks = num_blocks;
+	*buffer = transfer.buffer;
+	*buffer_len = sizeof(transfer.buffer);
+	*callback = block_done;
+	return 0;
+}
+
+void msc_device_set_configuration_callback(uint8_t configuration){
+	msc_init(&mscData, 1);
+	usb_set_endpoint_handlers(MSC_DEVICE_EP, msc_in_transaction_complete, msc_out_transaction_complete);
+	memset(&transfer, 0, sizeof(transfer));
+}
+
+void msc_device_endpoint_halt_callback(uint8_t endpoint, bool halted){
+	if (!halted){
+		msc_clear_halt(endpoint & 0x7F, endpoint & 0x80);
+	}
+}
+
+int8_t msc_device_unknown_setup_request_callback(const struct setup_packet *setup){
+	if (process_msc_setup_request(setup) == 0){
+		return 0;
+	}
+	return process_hid_setup_request(setup);
+}
+
+// Next block of a read or write, when the last one is done
+void msc_device_pass(){
+	if (!transfer.blockDone){
+		return;
+	}
+	transfer.blockDone = false;
+
+	if (transfer.reading){
+		if (transfer.blocks == 0){
+			transfer.reading = false;
+			msc_notify_read_operation_complete(&mscData, true);
+			return;
+		}
+		msc_start_send_to_host(&mscData, mscDisk[transfer.lba], MSC_DEVICE_BLOCK_SIZE, block_done);
+		transfer.lba++;
+		transfer.blocks--;
+	}
+	else if (transfer.writing){
+		memcpy(mscDisk[transfer.lba], transfer.buffer, MSC_DEVICE_BLOCK_SIZE);
+		transfer.lba++;
+		msc_notify_write_data_handled(&mscData);
+		if (--transfer.blocks == 0){
+			transfer.writing = false;
+			msc_notify_write_operation_complete(&mscData, true, mscData.transferred_bytes);
+		}
+	}
+}
+
+void msc_device_start(){
+	sie_init();
+	memset(&transfer, 0, sizeof(transfer));
+	msc_set_interface_list(mscInterfaces, USB_ARRAYLEN(mscInterfaces));
+	hid_set_interface_list(hidInterfaces, USB_ARRAYLEN(hidInterfaces));
+	usb_init();
+	mock_settle();
+	sieMainLoop = msc_device_pass;
+}
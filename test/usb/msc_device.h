@@ -0,0 +1,20 @@
+#ifndef MSC_DEVICE_H_c7f20a94e1d34b5b8e0d63a1f29b7c45
+#define MSC_DEVICE_H_c7f20a94e1d34b5b8e0d63a1f29b7c45
+
+#include <inttypes.h>
+
+// MSC + HID test device on the simulated SIE, built with msc/usb_config.h.
+// Interface 0 is a RAM disk (EP1 bulk), served a block at a time from the
+// main loop like a flash disk would be. Interface 1 is a vendor HID (EP2).
+
+#define MSC_DEVICE_EP			1
+#define MSC_DEVICE_HID_EP		2
+#define MSC_DEVICE_BLOCK_SIZE	512
+#define MSC_DEVICE_BLOCKS		256
+
+extern uint8_t mscDisk[MSC_DEVICE_BLOCKS][MSC_DEVICE_BLOCK_SIZE];
+
+void msc_device_start();	// sie_init(), then usb_init() with the MSC and HID set up
+void msc_device_pass();		// One main loop pass
+
+#endif
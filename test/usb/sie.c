@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <mock.h>
+#include <usb.h>
+#include "sie.h"
+
+// BDnSTAT, as the SIE reads and writes it
+#define BD_UOWN			0x00000080
+#define BD_DTS			0x00000040
+#define BD_DTSEN		0x00000008
+#define BD_BSTALL		0x00000004
+#define BD_PID(pid)		((pid) << 2)
+#define BD_CNT(stat)	(((stat) >> 16) & 0x3FF)
+
+// U1EPn
+#define UEP(ep)			mock_U1EP[ep].reg
+#define UEP_EPHSHK		0x01
+#define UEP_EPSTALL		0x02
+#define UEP_EPTXEN		0x04
+#define UEP_EPRXEN		0x08
+#define UEP_EPCONDIS	0x10
+
+#define PID_OUT			0x1
+#define PID_IN			0x9
+#define PID_SETUP		0xD
+
+// Packet sizes in bit times: SYNC, PID, fields, CRC, EOP
+#define BITS_TOKEN		35
+#define BITS_DATA(n)	(35 + 8*(n))
+#define BITS_HANDSHAKE	19
+#define BITS_GAP		8		// Turnaround, or the gap to the next packet
+#define BITS_TIMEOUT	18
+#define BITS_RESET		120000	// 10ms of SE0
+
+#define USTAT_FIFO		4
+
+SieStats sieStats;
+void (*sieMainLoop)(void) = NULL;
+static int perfFd = -1;		// Instruction counter, or -1
+
+static struct {
+	uint8_t ppbi[16][2];			// Next BD of each endpoint and direction
+	uint8_t ustat[USTAT_FIFO];		// The head is in U1STAT while TRNIF is set
+	uint8_t ustatCount;
+	uint64_t nextSof;
+	volatile uint32_t ppbrst;		// What the stack writes to PPBRST
+} sie;
+
+void sie_init(){
+	mock_reset();
+	memset(&sie, 0, sizeof(sie));
+	memset(&sieStats, 0, sizeof(sieStats));
+	sie.nextSof = SIE_BITS_PER_FRAME;
+	if (perfFd >= 0){
+		ioctl(perfFd, PERF_EVENT_IOC_RESET, 0);
+	}
+}
+
+// A user space instruction counter, on only while the device runs. Needs
+// perf_event_paranoid <= 2 and a PMU, so often not there in a VM or container.
+bool sie_count_instructions(){
+	struct perf_event_attr attr;
+
+	if (perfFd < 0){
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		perfFd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	return perfFd >= 0;
+}
+
+// Raise U1IR flags, and the CPU interrupt for the enabled ones
+static void sie_flag(uint32_t mask){
+	U1IR |= mask;
+	if (U1IE & mask){
+		IFS1bits.USBIF = 1;
+	}
+}
+
+void sie_clear_if(uint32_t mask){
+	if ((mask & _U1IR_TRNIF_MASK) && (U1IR & _U1IR_TRNIF_MASK) && sie.ustatCount > 0){
+		sie.ustatCount--;
+		memmove(sie.ustat, sie.ustat + 1, sie.ustatCount);
+	}
+	U1IR &= ~mask;
+	if (sie.ustatCount > 0 && !(U1IR & _U1IR_TRNIF_MASK)){
+		U1STAT = sie.ustat[0];	// The next one moves up
+		sie_flag(_U1IR_TRNIF_MASK);
+	}
+}
+
+volatile uint32_t *sie_ping_pong_reset(){
+	memset(sie.ppbi, 0, sizeof(sie.ppbi));
+	return &sie.ppbrst;
+}
+
+uint32_t sie_phys_addr(const volatile void *p){
+	if ((uintptr_t)p > 0xFFFFFFFF){
+		fprintf(stderr, "sie: %p doesn't fit in BDnADR, link with -no-pie\n", p);
+		abort();
+	}
+	return (uint32_t)(uintptr_t)p;
+}
+
+// BDT entries are 8 bytes, 4 per endpoint: OUT even/odd, IN even/odd
+static volatile uint32_t *sie_bd_at(uint8_t ep, uint8_t dir, uint8_t ppbi){
+	uint32_t base = (U1BDTP3 << 24) | (U1BDTP2 << 16) | ((U1BDTP1 & 0xFE) << 8);
+	return (volatile uint32_t *)(uintptr_t)(base + 8*(4*ep + 2*dir + ppbi));
+}
+
+static volatile uint32_t *sie_bd(uint8_t ep, uint8_t dir){
+	return sie_bd_at(ep, dir, sie.ppbi[ep][dir]);
+}
+
+static uint8_t *sie_buffer(volatile uint32_t *bd){
+	return (uint8_t *)(uintptr_t)bd[1];
+}
+
+// The transaction is done on this BD: hand it back and post U1STAT
+static void sie_complete(volatile uint32_t *bd, uint8_t ep, uint8_t dir, uint8_t pid, bool data1, uint32_t len){
+	bd[0] = (len << 16) | (data1 ? BD_DTS : 0) | BD_PID(pid);
+	sie.ustat[sie.ustatCount++] = (ep << 4) | (dir << 3) | (sie.ppbi[ep][dir] << 2);
+	sie.ppbi[ep][dir] ^= 1;
+	if (!(U1IR & _U1IR_TRNIF_MASK)){
+		U1STAT = sie.ustat[0];
+		sie_flag(_U1IR_TRNIF_MASK);
+	}
+}
+
+static uint64_t sie_now(){
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// The instruction counter, since sie_init(). 0 without one.
+static uint64_t sie_instructions(){
+	uint64_t count;
+
+	if (perfFd < 0 || read(perfFd, &count, sizeof(count)) != sizeof(count)){
+		return 0;
+	}
+	return count;
+}
+
+void sie_interrupt(){
+	uint32_t guard = 0;
+	uint64_t start;
+	uint64_t instructions;
+
+	mock_settle();
+	while (IEC1bits.USBIE && IFS1bits.USBIF){
+		start = sie_now();
+		instructions = sie_instructions();
+		usb_service();
+		sieStats.serviceInstructions += sie_instructions() - instructions;
+		sieStats.serviceNs += sie_now() - start;
+		mock_settle();
+		sieStats.interrupts++;
+		if (++guard > 100){
+			CHECK(guard <= 100, "the USB interrupt never goes idle");
+			break;
+		}
+	}
+}
+
+// Bus time passes, with a SOF at each frame start. Then the device runs: the
+// interrupt if pending, and a pass of the main loop.
+static void sie_after(uint32_t bits){
+	uint64_t start;
+
+	sieStats.bits += bits;
+	while (sieStats.bits >= sie.nextSof){
+		sie.nextSof += SIE_BITS_PER_FRAME;
+		sieStats.bits += BITS_TOKEN + BITS_GAP;
+		sieStats.sofs++;
+		if (U1CONbits.USBEN){
+			sie_flag(_U1IR_SOFIF_MASK);
+		}
+	}
+
+	start = sie_now();
+	if (perfFd >= 0){
+		ioctl(perfFd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	sie_interrupt();
+	if (sieMainLoop){
+		sieMainLoop();
+		sieStats.mainLoops++;
+		sie_interrupt();	// Anything the main loop let through, or re-enabled
+	}
+	if (perfFd >= 0){
+		ioctl(perfFd, PERF_EVENT_IOC_DISABLE, 0);
+		sieStats.deviceInstructions = sie_instructions();
+	}
+	sieStats.deviceNs += sie_now() - start;
+}
+
+void sie_idle(uint32_t bits){
+	do{
+		uint32_t step = sie.nextSof - sieStats.bits;
+
+		if (step > bits){
+			step = bits;
+		}
+		bits -= step;
+		sie_after(step);
+	} while (bits > 0);
+}
+
+void sie_bus_reset(){
+	U1ADDR = 0;
+	sieStats.bits += BITS_RESET;
+	sie.nextSof = sieStats.bits + SIE_BITS_PER_FRAME;
+	sie_flag(_U1IR_URSTIF_MASK);
+	sie_after(0);
+}
+
+// Whether the device answers a token to addr/ep at all, with the U1EPn bits needed
+static bool sie_addressed(uint8_t addr, uint8_t ep, uint32_t enable){
+	if (!U1CONbits.USBEN || !U1PWRCbits.USBPWR || ep > 15 || addr != (U1ADDR & 0x7F)){
+		return false;
+	}
+	return (UEP(ep) & enable) == enable;
+}
+
+static SieResult sie_result(SieResult result, uint32_t bits){
+	switch (result){
+		case Sie_Nak:		sieStats.naks++; break;
+		case Sie_Stall:		sieStats.stalls++; sie_flag(_U1IR_STALLIF_MASK); break;
+		case Sie_Timeout:	sieStats.timeouts++; break;
+		default:			break;
+	}
+	sie_after(bits);
+	return result;
+}
+
+SieResult sie_setup(uint8_t addr, uint8_t ep, const void *packet){
+	uint32_t bits = BITS_TOKEN + BITS_GAP + BITS_DATA(8) + BITS_GAP;
+	volatile uint32_t *bd;
+	uint32_t i;
+
+	// A SETUP can't be NAKed. When the device can't take it, it doesn't answer.
+	if (!sie_addressed(addr, ep, UEP_EPRXEN | UEP_EPHSHK) || (UEP(ep) & UEP_EPCONDIS) || sie.ustatCount == USTAT_FIFO){
+		return sie_result(Sie_Timeout, bits + BITS_TIMEOUT);
+	}
+	bd = sie_bd(ep, 0);
+	if (!(bd[0] & BD_UOWN) || BD_CNT(bd[0]) < 8){
+		return sie_result(Sie_Timeout, bits + BITS_TIMEOUT);
+	}
+
+	memcpy(sie_buffer(bd), packet, 8);
+	sie_complete(bd, ep, 0, PID_SETUP, false, 8);
+	U1CONbits.PKTDIS = 1;
+
+	// A SETUP ends a control endpoint stall
+	for (i = 0; i < 2; i++){
+		volatile uint32_t *in = sie_bd_at(ep, 1, i);
+		if (in[0] & BD_BSTALL){
+			in[0] &= ~(BD_UOWN | BD_BSTALL);
+		}
+	}
+
+	sieStats.setups++;
+	return sie_result(Sie_Ack, bits + BITS_HANDSHAKE + BITS_GAP);
+}
+
+SieResult sie_out(uint8_t addr, uint8_t ep, bool data1, const void *data, uint32_t len){
+	uint32_t bits = BITS_TOKEN + BITS_GAP + BITS_DATA(len) + BITS_GAP;
+	volatile uint32_t *bd;
+
+	if (!sie_addressed(addr, ep, UEP_EPRXEN | UEP_EPHSHK)){
+		return sie_result(Sie_Timeout, bits + BITS_TIMEOUT);
+	}
+	bits += BITS_HANDSHAKE + BITS_GAP;
+	if (UEP(ep) & UEP_EPSTALL){
+		return sie_result(Sie_Stall, bits);
+	}
+	bd = sie_bd(ep, 0);
+	if (U1CONbits.PKTDIS || !(bd[0] & BD_UOWN) || sie.ustatCount == USTAT_FIFO){
+		return sie_result(Sie_Nak, bits);
+	}
+	if (bd[0] & BD_BSTALL){
+		return sie_result(Sie_Stall, bits);
+	}
+	if (len > BD_CNT(bd[0])){
+		return sie_result(Sie_Timeout, bits - BITS_HANDSHAKE + BITS_TIMEOUT);	// Buffer overrun
+	}
+	if ((bd[0] & BD_DTSEN) && !!(bd[0] & BD_DTS) != data1){
+		sieStats.toggleErrors++;	// ACKed, but dropped as a retry
+		return sie_result(Sie_Ack, bits);
+	}
+
+	if (len > 0){
+		memcpy(sie_buffer(bd), data, len);
+	}
+	sie_complete(bd, ep, 0, PID_OUT, data1, len);
+	sieStats.outs++;
+	return sie_result(Sie_Ack, bits);
+}
+
+SieResult sie_in(uint8_t addr, uint8_t ep, bool *data1, void *data, uint32_t *len){
+	uint32_t bits = BITS_TOKEN + BITS_GAP;
+	volatile uint32_t *bd;
+	uint32_t n;
+
+	*len = 0;
+	if (!sie_addressed(addr, ep, UEP_EPTXEN | UEP_EPHSHK)){
+		return sie_result(Sie_Timeout, bits + BITS_TIMEOUT);
+	}
+	bits += BITS_HANDSHAKE + BITS_GAP;
+	if (UEP(ep) & UEP_EPSTALL){
+		return sie_result(Sie_Stall, bits);
+	}
+	bd = sie_bd(ep, 1);
+	if (U1CONbits.PKTDIS || !(bd[0] & BD_UOWN) || sie.ustatCount == USTAT_FIFO){
+		return sie_result(Sie_Nak, bits);
+	}
+	if (bd[0] & BD_BSTALL){
+		return sie_result(Sie_Stall, bits);	// Left with the SIE, no PPBI move
+	}
+
+	n = BD_CNT(bd[0]);
+	*data1 = !!(bd[0] & BD_DTS);
+	*len = n;
+	if (n > 0){
+		memcpy(data, sie_buffer(bd), n);
+	}
+	sie_complete(bd, ep, 1, PID_IN, *data1, n);
+	sieStats.ins++;
+	return sie_result(Sie_Ack, bits + BITS_DATA(n) + BITS_GAP);
+}
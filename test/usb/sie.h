@@ -0,0 +1,64 @@
+#ifndef SIE_H_5f1e8b3a2c7d4e90a6b4d2c8e1f07a93
+#define SIE_H_5f1e8b3a2c7d4e90a6b4d2c8e1f07a93
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Simulated USB SIE, so src/usb/ runs on the host. usb.c sees the mock U1*
+// SFRs and its BDT in host memory (see sim_hal.h). The host side (host.c)
+// calls the token functions below, which do what the SIE does on the wire:
+// check the endpoint and BD, move the data, hand the BD back and push U1STAT.
+// After each one the USB interrupt runs if it is pending and enabled, then
+// one pass of the application's main loop (sieMainLoop).
+//
+// Bus time is counted in full-speed bit times (12MHz): packets with their
+// SYNC, PID, CRC and EOP, and a fixed gap after each. No bit stuffing. A SOF
+// goes out every 12000 bit times.
+
+typedef enum SieResultEnum {
+	Sie_Ack		= 0,
+	Sie_Nak		= 1,
+	Sie_Stall	= 2,
+	Sie_Timeout	= 3,	// No answer: wrong address, endpoint off, BD refused the data
+} SieResult;
+
+#define SIE_BITS_PER_FRAME	12000
+
+typedef struct SieStatsStruct {
+	uint32_t setups;		// Transactions by result
+	uint32_t ins;
+	uint32_t outs;
+	uint32_t naks;
+	uint32_t stalls;
+	uint32_t timeouts;
+	uint32_t toggleErrors;	// OUT data dropped on a DATA0/1 mismatch
+	uint32_t sofs;
+	uint32_t interrupts;	// usb_service() calls from the USB interrupt
+	uint32_t mainLoops;		// Passes of sieMainLoop
+	uint64_t bits;			// Bus time
+	uint64_t deviceNs;		// Host time spent in the interrupt and the main loop
+	uint64_t serviceNs;		// Of it, in usb_service() alone
+	uint64_t deviceInstructions;	// Host instructions in them, see sie_count_instructions()
+	uint64_t serviceInstructions;	// Of them, in usb_service() alone
+} SieStats;
+
+extern SieStats sieStats;
+extern void (*sieMainLoop)(void);	// The application's main loop pass, or NULL
+
+void sie_init();
+bool sie_count_instructions();	// Count deviceInstructions from now on, if the kernel lets us
+void sie_bus_reset();
+void sie_idle(uint32_t bits);	// Let bus time pass (SOFs), running the device
+void sie_interrupt();			// Run the USB interrupt while it is pending
+
+// Host tokens. data1 is the DATA0/1 PID of the data packet, sent or received.
+SieResult sie_setup(uint8_t addr, uint8_t ep, const void *packet);
+SieResult sie_out(uint8_t addr, uint8_t ep, bool data1, const void *data, uint32_t len);
+SieResult sie_in(uint8_t addr, uint8_t ep, bool *data1, void *data, uint32_t *len);
+
+// For sim_hal.h
+void sie_clear_if(uint32_t mask);
+volatile uint32_t *sie_ping_pong_reset();
+uint32_t sie_phys_addr(const volatile void *p);
+
+#endif
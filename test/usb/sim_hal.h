@@ -0,0 +1,33 @@
+#ifndef SIM_HAL_H_9d2c71e4b05a4f3c8e6b1a7d3f08c52e
+#define SIM_HAL_H_9d2c71e4b05a4f3c8e6b1a7d3f08c52e
+
+// usb_hal.h for the host build of src/usb/, see sie.c. Used in its place
+// with -D USB_HAL_HEADER='"sim_hal.h"'.
+//
+// The registers are the mock ones (mock/p32xxxx.h), so this is the chip HAL
+// with only what plain memory can't do routed to the simulated SIE:
+// - U1IR flags are write-1-to-clear, and clearing TRNIF pops the USTAT FIFO.
+// - PPBRST resets the SIE's ping-pong pointers.
+// - The BDT and buffers are in host memory, their addresses must fit BDnADR.
+
+#include <usb_hal.h>
+#include "sie.h"
+
+#undef PHYS_ADDR
+#define PHYS_ADDR(VIRTUAL_ADDR)  sie_phys_addr(VIRTUAL_ADDR)
+
+#undef SFR_USB_PING_PONG_RESET
+#define SFR_USB_PING_PONG_RESET  (*sie_ping_pong_reset())
+
+#undef CLEAR_ALL_USB_IF
+#undef CLEAR_USB_RESET_IF
+#undef CLEAR_USB_STALL_IF
+#undef CLEAR_USB_TOKEN_IF
+#undef CLEAR_USB_SOF_IF
+#define CLEAR_ALL_USB_IF()       do { sie_clear_if(0xff); U1EIR = 0; } while(0)
+#define CLEAR_USB_RESET_IF()     sie_clear_if(_U1IR_URSTIF_MASK)
+#define CLEAR_USB_STALL_IF()     sie_clear_if(_U1IR_STALLIF_MASK)
+#define CLEAR_USB_TOKEN_IF()     sie_clear_if(_U1IR_TRNIF_MASK)
+#define CLEAR_USB_SOF_IF()       sie_clear_if(_U1IR_SOFIF_MASK)
+
+#endif
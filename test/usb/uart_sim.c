@@ -0,0 +1,136 @@
+#include <string.h>
+#include <mock.h>
+#include <system.h>
+#include "sie.h"
+#include "uart_sim.h"
+
+UartSimPort uartSim[UART_NUM_PORTS];
+static uint64_t lastBits;
+
+#define BITS_PER_CHAR		10		// 8N1
+#define USB_BIT_RATE		12000000
+
+// One character time on both wires of a port. RX holds the byte, like the
+// sender would under flow control, while no buffer has room for it.
+static void uart_sim_char(UartSimPort *p){
+	if (p->txTail != p->txHead){
+		if (p->tx[p->txTail] != p->txNext){
+			p->txErrors++;
+		}
+		p->txNext = p->tx[p->txTail] + 1;
+		p->txTail = (p->txTail+1) & (UART_TX_BUFFER_SIZE-1);
+		p->txWire++;
+	}
+	if (p->rxPending > 0){
+		if (p->rxBuffer != NULL && p->rxCount < p->rxSize){
+			p->rxBuffer[p->rxCount++] = p->rxNext++;
+			p->rxPending--;
+		}
+		else{
+			p->rxHeld++;
+		}
+	}
+}
+
+void uart_sim_run(){
+	uint32_t bits = sieStats.bits - lastBits;
+	uint32_t i;
+
+	lastBits = sieStats.bits;
+	for (i = 0; i < UART_NUM_PORTS; i++){
+		UartSimPort *p = &uartSim[i];
+
+		p->credit += (uint64_t)bits * p->baud;
+		while (p->credit >= (uint64_t)BITS_PER_CHAR * USB_BIT_RATE){
+			p->credit -= (uint64_t)BITS_PER_CHAR * USB_BIT_RATE;
+			uart_sim_char(p);
+		}
+	}
+}
+
+void uart_sim_receive(UARTDrvPort port, uint32_t n){
+	uartSim[port].rxPending += n;
+}
+
+void UARTDrv_Init(UARTDrvPort port, uint32_t baud, UARTDrvRxMode rxMode){
+	memset(&uartSim[port], 0, sizeof(uartSim[port]));
+	uartSim[port].baud = baud;
+	lastBits = sieStats.bits;
+}
+
+uint32_t UARTDrv_CheckConfig(uint32_t baud, uint8_t dataBits, UARTDrvParity parity, uint8_t stopBits){
+	if (baud == 0 || baud > GetPeripheralClock()/4 || dataBits != 8){
+		return 0;
+	}
+	return baud;
+}
+
+uint32_t UARTDrv_Configure(UARTDrvPort port, uint32_t baud, uint8_t dataBits, UARTDrvParity parity, uint8_t stopBits){
+	if (UARTDrv_CheckConfig(baud, dataBits, parity, stopBits) == 0){
+		return 0;
+	}
+	uartSim[port].baud = baud;
+	return baud;
+}
+
+uint32_t UARTDrv_TxFree(UARTDrvPort port){
+	UartSimPort *p = &uartSim[port];
+	return (UART_TX_BUFFER_SIZE-1) - ((p->txHead - p->txTail) & (UART_TX_BUFFER_SIZE-1));
+}
+
+uint32_t UARTDrv_SendAsync(UARTDrvPort port, const uint8_t *buffer, uint32_t length){
+	UartSimPort *p = &uartSim[port];
+	uint32_t n = UARTDrv_TxFree(port);
+	uint32_t i;
+
+	if (length < n){
+		n = length;
+	}
+	for (i = 0; i < n; i++){
+		p->tx[p->txHead] = buffer[i];
+		p->txHead = (p->txHead+1) & (UART_TX_BUFFER_SIZE-1);
+	}
+	return n;
+}
+
+void UARTDrv_RxAttach(UARTDrvPort port, uint8_t *buffer, uint32_t size){
+	uartSim[port].rxBuffer = buffer;
+	uartSim[port].rxSize = size;
+	uartSim[port].rxCount = 0;
+}
+
+uint32_t UARTDrv_RxDetach(UARTDrvPort port){
+	uartSim[port].rxBuffer = NULL;
+	return uartSim[port].rxCount;
+}
+
+uint32_t UARTDrv_GetCount(UARTDrvPort port){
+	return uartSim[port].rxCount;
+}
+
+void UARTDrv_SetFlowControl(UARTDrvPort port, uint8_t enable){
+}
+
+void UARTDrv_SetRts(UARTDrvPort port, uint8_t asserted){
+}
+
+void UARTDrv_Poll(){
+}
+
+void UARTDrv_GetErrors(UARTDrvPort port, UARTDrvErrors *copyTo){
+	memset(copyTo, 0, sizeof(*copyTo));
+}
+
+void UARTDrv_ClearErrors(UARTDrvPort port){
+}
+
+uint8_t UARTDrv_TakeErrorEvents(UARTDrvPort port){
+	return 0;
+}
+
+void UARTDrv_GetIsrStats(UARTDrvPort port, UARTDrvIsrStats *copyTo){
+	memset(copyTo, 0, sizeof(*copyTo));
+}
+
+void UARTDrv_ClearIsrStats(UARTDrvPort port){
+}
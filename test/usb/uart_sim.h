@@ -0,0 +1,37 @@
+#ifndef UART_SIM_H_3a8c5e17d2b94f06a1e7c4b92d05f836
+#define UART_SIM_H_3a8c5e17d2b94f06a1e7c4b92d05f836
+
+#include <inttypes.h>
+#include <UARTDrv.h>
+
+// UARTDrv for the bridge on the simulated SIE, in place of UARTDrv.c. Its
+// API works like the driver's (same TX ring size, RX into the attached
+// buffer), and the wires run on the SIE's bus time at each port's baud rate.
+// The bytes sent both ways are a counting pattern, so order is checked.
+
+typedef struct UartSimPortStruct {
+	uint32_t baud;				// 0 until UARTDrv_Init()
+
+	uint8_t tx[UART_TX_BUFFER_SIZE];	// Ring, like the driver's
+	uint32_t txHead;
+	uint32_t txTail;
+	uint32_t txWire;			// Bytes sent on the wire
+	uint32_t txErrors;			// Of them, not the next of the pattern
+	uint8_t txNext;
+
+	volatile uint8_t *rxBuffer;	// See UARTDrv_RxAttach()
+	uint32_t rxSize;
+	uint32_t rxCount;
+	uint32_t rxPending;			// Still to come in on the wire
+	uint32_t rxHeld;			// Byte times it waited for an attached buffer
+	uint8_t rxNext;
+
+	uint64_t credit;			// Bus bits x baud not yet turned into bytes
+} UartSimPort;
+
+extern UartSimPort uartSim[UART_NUM_PORTS];
+
+void uart_sim_run();	// Move what the wires carried since the last call
+void uart_sim_receive(UARTDrvPort port, uint32_t n);	// n more bytes to come in
+
+#endif